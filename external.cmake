@@ -62,6 +62,45 @@ ExternalProject_Add(snappy
     -DCMAKE_INSTALL_PREFIX:PATH=${USR_DIR}
   DOWNLOAD_EXTRACT_TIMESTAMP TRUE
 )
+
+ExternalProject_Add(lz4
+  PREFIX ${EXTERNAL_DIR}
+  SOURCE_DIR ${EXTERNAL_DIR}/lz4
+  SOURCE_SUBDIR build/cmake
+  INSTALL_DIR ${USR_DIR}
+  GIT_REPOSITORY https://github.com/lz4/lz4.git
+  GIT_TAG v1.10.0
+  GIT_SHALLOW TRUE
+  LIST_SEPARATOR ${semicolon_smuggle}
+  CMAKE_ARGS
+    -DCMAKE_OSX_ARCHITECTURES:STRING=${CMAKE_OSX_ARCHITECTURES}
+    -DCMAKE_BUILD_TYPE=${CMAKE_BUILD_TYPE}
+    -DBUILD_SHARED_LIBS=OFF
+    -DBUILD_STATIC_LIBS=ON
+    -DLZ4_BUILD_CLI=OFF
+    -DCMAKE_INSTALL_PREFIX:PATH=${USR_DIR}
+  DOWNLOAD_EXTRACT_TIMESTAMP TRUE
+)
+
+ExternalProject_Add(zstd
+  PREFIX ${EXTERNAL_DIR}
+  SOURCE_DIR ${EXTERNAL_DIR}/zstd
+  SOURCE_SUBDIR build/cmake
+  INSTALL_DIR ${USR_DIR}
+  GIT_REPOSITORY https://github.com/facebook/zstd.git
+  GIT_TAG v1.5.6
+  GIT_SHALLOW TRUE
+  LIST_SEPARATOR ${semicolon_smuggle}
+  CMAKE_ARGS
+    -DCMAKE_OSX_ARCHITECTURES:STRING=${CMAKE_OSX_ARCHITECTURES}
+    -DCMAKE_BUILD_TYPE=${CMAKE_BUILD_TYPE}
+    -DZSTD_BUILD_SHARED=OFF
+    -DZSTD_BUILD_STATIC=ON
+    -DZSTD_BUILD_PROGRAMS=OFF
+    -DZSTD_BUILD_TESTS=OFF
+    -DCMAKE_INSTALL_PREFIX:PATH=${USR_DIR}
+  DOWNLOAD_EXTRACT_TIMESTAMP TRUE
+)
     
 add_dependencies(zmqpp libzmq)
 
@@ -21,6 +21,13 @@ Author(s): Paolo Bosetti
 #endif
 
 #include "mads.hpp"
+#include "scheduler.hpp"
+#include "compression.hpp"
+#include "outbox.hpp"
+#include "batch.hpp"
+#include "status.hpp"
+#include "reactor.hpp"
+#include "shards.hpp"
 #include <nlohmann/json.hpp>
 #ifdef _WIN32
 #include <winsock.h>
@@ -36,13 +43,17 @@ Author(s): Paolo Bosetti
 #pragma GCC diagnostic pop
 #endif
 #include <csignal>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <regex>
 #include <snappy.h>
+#include <span>
 #include <string>
 #include <string_view>
 #include <thread>
 #include <future>
+#include <mutex>
 #include <zmqpp/zmqpp.hpp>
 
 #ifndef HOST_NAME_MAX
@@ -83,8 +94,11 @@ namespace Mads {
  * myagent.loop([&]() {
  *   // receive a message
  *   myagent.receive();
- *   // get the last message received
+ *   // get the last message received (or a zero-copy view of it)
  *   myagent.last_message();
+ *   string_view payload = myagent.last_payload_view();
+ *   // or directly the parsed JSON, whatever the wire encoding
+ *   nlohmann::json j = myagent.last_json();
  *   // get the status of the myagent agent, i.e. a map of all last messages by
  *   //  topics
  *   auto status = myagent.status();
@@ -188,6 +202,107 @@ public:
     return timecode;
   }
 
+  /**
+   * @brief Static function to ask the broker for its ipc endpoints.
+   *
+   * @param uri The URI of the broker.
+   * @param name The name of the agent.
+   * @param hostname The host of the agent.
+   * @param timeout The timeout in milliseconds (default 2000).
+   * @return The directory of the ipc endpoints, or an empty string if the
+   * broker is on another host, does not offer them, or does not reply.
+   */
+  static string read_ipc_dir(string uri, string name, string hostname,
+                             int timeout = 2000) {
+    zmqpp::context context;
+    zmqpp::socket socket(context, zmqpp::socket_type::req);
+    message msg;
+    socket.set(zmqpp::socket_option::receive_timeout, timeout);
+    socket.set(zmqpp::socket_option::linger, 0);
+    socket.connect(uri);
+    msg << LIB_VERSION << "endpoints" << name << hostname;
+    socket.send(msg);
+    string dir;
+    if (socket.receive(msg) && msg.parts() >= 2)
+      dir = msg.get(1);
+    socket.close();
+    context.terminate();
+    return dir;
+  }
+
+
+  /**
+   * @brief A received message, kept alive to hand out views of its frames.
+   * Immutable once stored, so that it can be read from any thread.
+   */
+  struct inbound {
+    zmqpp::message msg;
+    wire::header header;
+    size_t part = 1;           // Frame holding the body
+    string decoded;            // Decompressed body
+    mutable string text;       // JSON text of a binary body (lazy)
+    mutable once_flag text_once;
+
+    inbound() = default;
+
+    // If the body is compressed, its decompressed version is swapped in
+    // from scratch
+    inbound(zmqpp::message &&m, const wire::header &h, string &scratch,
+            size_t body_part = 1)
+        : msg(std::move(m)), header(h), part(body_part) {
+      if (header.codec != wire_codec::none)
+        decoded.swap(scratch);
+    }
+
+    // A payload extracted from a batch
+    inbound(string_view record, wire_encoding encoding) : decoded(record) {
+      header.encoding = encoding;
+      header.batch = true;
+    }
+
+    static string_view frame(const zmqpp::message &m, size_t part) {
+      if (part >= m.parts())
+        return string_view();
+      return string_view(static_cast<const char *>(m.raw_data(part)),
+                         m.size(part));
+    }
+
+    string_view frame(size_t part) const { return frame(msg, part); }
+
+    // Payload as on the wire, after decompression
+    string_view body() const {
+      return header.codec != wire_codec::none || header.batch
+                 ? string_view(decoded)
+                 : frame(part).substr(header.size);
+    }
+
+    // Payload as JSON text; binary encodings are converted on first access
+    string_view payload() const {
+      if (header.encoding == wire_encoding::json)
+        return body();
+      call_once(text_once, [this]() {
+        text = wire::decode(body(), header.encoding).dump();
+      });
+      return text;
+    }
+
+    nlohmann::json json() const {
+      if (msg.parts() < 2 && !header.batch)
+        return nlohmann::json();
+      return wire::decode(body(), header.encoding);
+    }
+
+    // Memory held, for the bounds of the status store
+    size_t footprint() const {
+      size_t bytes = decoded.capacity();
+      for (size_t i = 0; i < msg.parts(); i++)
+        bytes += msg.size(i);
+      return bytes;
+    }
+  };
+
+  using status_store = TopicStore<inbound>;
+
 
 /*
   _     _  __                      _      
@@ -295,6 +410,11 @@ public:
       auto b_uri = split_URL(_sub_endpoint);
       _pub_endpoint = get<0>(f_uri) + get<1>(s_uri) + ":" + get<2>(f_uri);
       _sub_endpoint = get<0>(b_uri) + get<1>(s_uri) + ":" + get<2>(b_uri);
+      // On the broker host, prefer its Unix domain sockets (see route())
+      if (all_cfg["ipc"].value_or(true))
+        _ipc_dir = read_ipc_dir(_settings_uri, _name, _hostname,
+                                _settings_timeout > 0 ? _settings_timeout
+                                                      : 2000);
     }
     _pub_topic = cfg["pub_topic"].value_or(_name);
     if (cfg["sub_topic"].type() == toml::node_type::string) {
@@ -309,6 +429,35 @@ public:
       throw AgentError("Invalid sub_topic type for " + _name);
     }
     _time_step = chrono::milliseconds(cfg["time_step"].value_or(0));
+    StatusBounds bounds;
+    bounds.max_topics = cfg["status_max_topics"].value_or(
+        all_cfg["status_max_topics"].value_or(0));
+    bounds.max_bytes = cfg["status_max_bytes"].value_or(
+        all_cfg["status_max_bytes"].value_or(0));
+    bounds.ttl = chrono::milliseconds(
+        cfg["status_ttl"].value_or(all_cfg["status_ttl"].value_or(0)));
+    _status.set_bounds(bounds);
+    _replay_history = _config["broker"]["history"].value_or(0) > 0 &&
+                      cfg["replay_history"].value_or(
+                          all_cfg["replay_history"].value_or(true));
+    _batch_policy.size =
+        cfg["batch_size"].value_or(all_cfg["batch_size"].value_or(0));
+    _batch_policy.latency = chrono::milliseconds(
+        cfg["batch_latency"].value_or(all_cfg["batch_latency"].value_or(2)));
+    try {
+      _scheduler.set_policy(overrun_policy_from(cfg["loop_policy"].value_or(
+          all_cfg["loop_policy"].value_or(string("skip")))));
+      _encoding = wire_encoding_from(cfg["encoding"].value_or(
+          all_cfg["encoding"].value_or(string("json"))));
+      load_compression();
+      _shards = ShardMap(_config["broker"].as_table());
+      _outbox.configure(
+          cfg["queue_size"].value_or(all_cfg["queue_size"].value_or(1024)),
+          queue_policy_from(cfg["queue_policy"].value_or(
+              all_cfg["queue_policy"].value_or(string("block")))));
+    } catch (const std::invalid_argument &e) {
+      throw AgentError(e.what());
+    }
 
     // rename attachment if not a plugin
     if (!_attachment_path.empty()) {
@@ -328,6 +477,8 @@ public:
 
   // Destructor
   virtual ~Agent() {
+    _batcher.stop();
+    _outbox.stop();
     disconnect();
     _publisher.close();
     _subscriber.close();
@@ -406,11 +557,13 @@ public:
     out << "  Settings file:    " << style::bold << _settings_uri
         << style::reset << endl;
     out << "  Pub endpoint:     " << style::bold
-        << (_cross ? _sub_endpoint : _pub_endpoint) << style::reset << endl;
+        << (_cross ? _sub_endpoint : route(_pub_endpoint)) << style::reset
+        << endl;
     out << "  Pub topic:        " << style::bold << _pub_topic << style::reset
         << endl;
     out << "  Sub endpoint:     " << style::bold
-        << (_cross ? _pub_endpoint : _sub_endpoint) << style::reset << endl;
+        << (_cross ? _pub_endpoint : route(_sub_endpoint)) << style::reset
+        << endl;
     out << "  Sub topics:       " << style::bold;
     for (auto &t : _sub_topic) {
       if (t.empty())
@@ -424,12 +577,47 @@ public:
           << endl;
     }
     out << "  Compression:      " << style::bold;
-    if (_compress)
-      out << "enabled" << style::reset << endl;
+    if (_compressor.active()) {
+      auto const &p = _compressor.default_policy();
+      out << wire_codec_map.at(p.codec);
+      if (p.threshold > 0)
+        out << " (>= " << p.threshold << " bytes)";
+      for (auto const &[topic, tp] : _compressor.policies()) {
+        out << ", " << topic << ": " << wire_codec_map.at(tp.codec)
+            << (tp.dictionary ? "+dict" : "");
+      }
+      out << style::reset << endl;
+    } else
+      out << fg::red << "disabled" << fg::reset << style::reset << endl;
+    out << "  Outbound queue:   " << style::bold << _outbox.capacity() << " ("
+        << queue_policy_map.at(_outbox.policy()) << ")" << style::reset
+        << endl;
+    out << "  Batching:         " << style::bold;
+    if (_batch_policy.enabled())
+      out << "up to " << _batch_policy.size << " bytes or "
+          << _batch_policy.latency.count() << " ms" << style::reset << endl;
     else
       out << fg::red << "disabled" << fg::reset << style::reset << endl;
+    if (_shards.enabled() && !_cross)
+      out << "  Broker shards:    " << style::bold << _shards.count()
+          << style::reset << endl;
+    if (_status.bounds().bounded()) {
+      auto const &b = _status.bounds();
+      out << "  Status store:     " << style::bold;
+      if (b.max_topics > 0)
+        out << b.max_topics << " topics ";
+      if (b.max_bytes > 0)
+        out << b.max_bytes << " bytes ";
+      if (b.ttl.count() > 0)
+        out << b.ttl.count() << " ms TTL";
+      out << style::reset << endl;
+    }
+    out << "  Wire encoding:    " << style::bold
+        << wire_encoding_map.at(_encoding) << style::reset << endl;
     out << "  Timecode FPS:     " << style::bold << timecode_fps << style::reset
         << endl;
+    out << "  Overrun policy:   " << style::bold
+        << overrun_policy_map.at(_scheduler.policy()) << style::reset << endl;
     out << "  Timecode offset:  " << style::bold << _timecode_offset
         << " s" << style::reset << endl;
     if (!_attachment_path.empty()) {
@@ -483,12 +671,21 @@ public:
       throw AgentError("Agent not initialized");
     if (!_connected)
       return;
+    _batcher.stop(); // send pending batches
+    _outbox.stop(); // give the publisher socket back to this thread
     try {
-      _publisher.disconnect(_pub_endpoint);
-      _subscriber.disconnect(_sub_endpoint);
+      _publisher.disconnect(_cross ? _sub_endpoint : route(_pub_endpoint));
+      _subscriber.disconnect(_cross ? _pub_endpoint : route(_sub_endpoint));
+      for (size_t i = 0; i < _shard_publishers.size(); i++)
+        _shard_publishers[i]->disconnect(
+            route(_shards.endpoint(_pub_endpoint, i + 1)));
+      for (size_t i = 1; i < _shards.count() && !_cross; i++)
+        _subscriber.disconnect(route(_shards.endpoint(_sub_endpoint, i)));
     } catch (...) {
       // NOOP
     }
+    _shard_publishers.clear();
+    _routes.clear();
     _connected = false;
   }
 
@@ -516,10 +713,12 @@ public:
    * @brief Enables remote control for the agent.
    *
    * This function subscribes the agent to the "control" topic. If the agent
-   * is not a subscriber starts a thread to handle remote control commands.
+   * is not a subscriber, loop() starts a thread to handle remote control
+   * commands, while run() handles them in the reactor.
    *
    * If the agent is also a subscriber, then the remote control is handled
-   * in the main loop by calling the remote_control() function.
+   * in the main loop by calling the remote_control() function (automatically
+   * when using on_receive()).
    *
    * @throws AgentError if not initialized
    * @throws AgentError if already connected
@@ -531,30 +730,18 @@ public:
       throw AgentError("Cannot enable remote control after connecting");
     bool subscriber = !_sub_topic.empty();
     _sub_topic.push_back("control");
-    if (!subscriber)
-      thread([&]() {
-        _subscriber.set(zmqpp::socket_option::receive_timeout, 100);
-        while (Mads::running) {
-          message_type type;
-          try {
-            type = receive();
-          } catch (const std::exception &e) {
-            cerr << "Error receiving message: " << e.what() << endl;
-            continue;
-          }
-          if (type != message_type::json)
-            continue;
-          remote_control();
-        }
-      }).detach();
+    _remote_control = true;
+    _remote_control_thread = !subscriber;
   }
 
 
   /**
    * @brief Registers an event.
    *
-   * This function registers an event with the broker. The event is sent after
-   * 500 milliseconds.
+   * This function registers an event with the broker. Startup events are
+   * sent after 500 milliseconds (without blocking), to let the connection
+   * settle; shutdown events block for 500 milliseconds, to let the message
+   * out before disconnecting.
    *
    * @param event The event to be registered.
    * @throws AgentError if not initialized
@@ -563,31 +750,36 @@ public:
                       const nlohmann::json &info = nlohmann::json()) {
     if (!_init_done)
       throw AgentError("Agent not initialized");
-    nlohmann::json settings = get_settings();
-    thread t([info, event, settings, this]() {
-      nlohmann::json payload;
-      if (event == event_type::startup)
-        this_thread::sleep_for(chrono::milliseconds(STARTUP_SHUTDOWN_DELAY));
-      payload["name"] = _name;
-      payload["version"] = LIB_VERSION;
-      payload["event"] = event_map.at(event);
-      payload["timecode_offset"] = _timecode_offset;
-      payload["settings_path"] = _settings_uri;
-      payload["settings"] = settings;
-      if (!_agent_id.empty()) {
-        payload["agent_id"] = _agent_id;
-      }
-      if (!info.empty()) {
-        payload["info"] = info;
-      }
+    nlohmann::json payload;
+    payload["name"] = _name;
+    payload["version"] = LIB_VERSION;
+    payload["event"] = event_map.at(event);
+    payload["timecode_offset"] = _timecode_offset;
+    payload["settings_path"] = _settings_uri;
+    payload["settings"] = get_settings();
+    if (!_agent_id.empty()) {
+      payload["agent_id"] = _agent_id;
+    }
+    if (!info.empty()) {
+      payload["info"] = info;
+    }
+    if (event == event_type::shutdown && _compressor.active()) {
+      payload["compression"] = _compressor.stats();
+    }
+    if (event == event_type::shutdown && _batcher.active()) {
+      payload["batching"] = _batcher.stats();
+    }
+    if (event == event_type::startup) {
+      send_json(payload, METADATA_TOPIC, 0,
+                chrono::milliseconds(STARTUP_SHUTDOWN_DELAY));
+    } else {
       publish(payload, METADATA_TOPIC);
-    });
+    }
     if (event == event_type::shutdown) {
-      // wait for the thread to publish the message
+      // wait for the message (and pending batches) to be sent
+      _batcher.flush();
+      _outbox.flush();
       this_thread::sleep_for(chrono::milliseconds(STARTUP_SHUTDOWN_DELAY));
-      t.join();
-    } else {
-      t.detach();
     }
   }
 
@@ -595,43 +787,36 @@ public:
   /**
    * @brief Publishes a message with the given JSON payload.
    *
+   * The payload is serialized according to the wire encoding (JSON text by
+   * default, or CBOR/MessagePack, see set_encoding()), and compressed
+   * according to the compression policy of the topic. This can be called
+   * from any thread: the message is queued and sent by the I/O thread that
+   * owns the socket (see set_queue()). On batched topics, the payload is
+   * coalesced with others in a single message (see set_batching()).
+   *
    * @param payload The JSON payload of the message.
    * @throws AgentError if not initialized
    */
   void publish(nlohmann::json payload, string topic = "") {
     if (!_init_done)
       throw AgentError("Agent not initialized");
-    message message;
-    string str;
     uint32_t offset = 0;
     if (payload.contains("event"))
       if (payload["event"] == event_map.at(event_type::shutdown) ||
           payload["event"] == event_map.at(event_type::startup)) {
         offset = STARTUP_SHUTDOWN_DELAY;
       }
-    chrono::system_clock::time_point now = chrono::system_clock::now();
-    payload["hostname"] = _hostname;
-    payload["timestamp"]["$date"] = get_ISODate_time(now, -offset);
-    if (!payload.contains("timecode")) {
-      payload["timecode"] = timecode(now, timecode_fps) - offset;
-    }
-    str = payload.dump();
-    if (topic.empty())
-      topic = _pub_topic;
-    if (_compress) {
-      string compressed;
-      snappy::Compress(str.data(), str.size(), &compressed);
-      message << topic << compressed;
-    } else {
-      message << topic << str;
-    }
-    _publisher.send(message);
+    send_json(payload, topic, offset);
   }
 
 
   /**
    * @brief Publishes a message with the given binary blob payload.
    *
+   * If the compression policy of the topic enables blobs, the data are
+   * compressed and the codec is added to the metadata under the reserved
+   * key "_mads_codec" (receivers decompress them transparently).
+   *
    * @param payload The binary blob payload of the message.
    * @param format The format of the blob (a string, default "raw").
    * @param topic The topic of the message.
@@ -640,23 +825,15 @@ public:
   void publish(const char *payload, size_t len,
                nlohmann::json meta = nlohmann::json{{"format", "raw"}},
                string topic = "") {
-    if (!_init_done)
-      throw AgentError("Agent not initialized");
-    message message;
-    chrono::system_clock::time_point now = chrono::system_clock::now();
-    meta["timestamp"]["$date"] = get_ISODate_time(now);
-    meta["timecode"] = timecode(now, timecode_fps);
-    if (topic.empty())
-      topic = _pub_topic;
-    message << topic << meta.dump();
-    message.add_raw(payload, len);
-    _publisher.send(message);
+    send_blob(payload, len, nullptr, nullptr, meta, topic);
   }
 
   
   /**
    * @brief Publishes a message with the given binary blob payload.
    *
+   * @note This copies the payload: if the vector is no longer needed, move
+   * it in, so that it is sent without copies.
    * @param payload The binary blob payload of the message.
    * @param metadata The metadata for the blob.
    * @param topic The topic of the message.
@@ -670,52 +847,194 @@ public:
   }
 
 
+  /**
+   * @brief Publishes a binary blob without copying it, taking ownership of
+   * the vector. The vector is destroyed when ZeroMQ is done sending it.
+   *
+   * @param payload The binary blob payload of the message.
+   * @param metadata The metadata for the blob.
+   * @param topic The topic of the message.
+   * @throws AgentError if not initialized
+   */
+  void publish(vector<unsigned char> &&payload,
+               nlohmann::json meta = nlohmann::json{{"format", "raw"}},
+               string topic = "") {
+    auto owner = new vector<unsigned char>(std::move(payload));
+    publish_nocopy((const char *)owner->data(), owner->size(),
+                   free_owner<vector<unsigned char>>, owner, meta, topic);
+  }
+
+
+  /**
+   * @brief Publishes a binary blob without copying it, taking ownership of
+   * the buffer. The buffer is released with the deleter of the unique_ptr
+   * when ZeroMQ is done sending it.
+   *
+   * @param payload The buffer.
+   * @param len The size of the buffer in bytes.
+   * @param metadata The metadata for the blob.
+   * @param topic The topic of the message.
+   * @throws AgentError if not initialized
+   */
+  template <typename T, typename D>
+  void publish(unique_ptr<T, D> payload, size_t len,
+               nlohmann::json meta = nlohmann::json{{"format", "raw"}},
+               string topic = "") {
+    const char *data = (const char *)payload.get();
+    auto owner = new unique_ptr<T, D>(std::move(payload));
+    publish_nocopy(data, len, free_owner<unique_ptr<T, D>>, owner, meta,
+                   topic);
+  }
+
+
+  /**
+   * @brief Publishes a binary blob without copying it. Once ZeroMQ is done
+   * sending the message (or if it is dropped), the buffer is handed back
+   * with release(payload, hint), possibly from another thread; it must not
+   * be modified meanwhile.
+   *
+   * @param payload The buffer.
+   * @param len The size of the buffer in bytes.
+   * @param release The function releasing the buffer (may be null, if the
+   * buffer outlives the agent).
+   * @param hint Passed to release.
+   * @param metadata The metadata for the blob.
+   * @param topic The topic of the message.
+   * @throws AgentError if not initialized (the buffer is released)
+   */
+  void publish_nocopy(const char *payload, size_t len, zmq_free_fn *release,
+                      void *hint,
+                      nlohmann::json meta = nlohmann::json{{"format", "raw"}},
+                      string topic = "") {
+    send_blob(payload, len, release ? release : keep, hint, meta, topic);
+  }
+
+
+  /**
+   * @brief Publishes an already encoded message as is, e.g. recorded
+   * traffic: frames are copied, but neither stamped nor compressed again.
+   *
+   * @param topic The topic of the message.
+   * @param frames The frames following the topic (payload, or metadata and
+   * blob).
+   * @throws AgentError if not initialized
+   */
+  void forward(string_view topic, const vector<string_view> &frames) {
+    if (!_init_done)
+      throw AgentError("Agent not initialized");
+    message message;
+    message.add_raw(topic.data(), topic.size());
+    for (auto const &f : frames)
+      message.add_raw(f.data(), f.size());
+    _outbox.push(message);
+  }
+
+
   /**
    * @brief Receives a message from the subscribe socket.
    *
    * This function receives a message from the subscribe socket and updates the
-   * agent's status and last received message.
+   * agent's status and last received message. The received message is kept
+   * alive in memory (one per topic, see status_changes()), and its frames are
+   * made available
+   * without copies via last_topic_view(), last_payload_view(),
+   * last_blob_view() and status_view(). Views are invalidated by the next
+   * message received on the same topic; those from status_view() also when
+   * the topic is evicted from a bounded status (see set_status_bounds()).
+   * Topics older than the status TTL are evicted here, before reading.
+   * Payloads are decoded according to the wire format marked in the frame,
+   * so that agents with different encoding and compression settings
+   * interoperate. zstd dictionary frames are consumed here (returning
+   * message_type::none), as are messages that need a dictionary not yet
+   * received. Batches are split here: each call returns one of their
+   * payloads, without reading the socket until the batch is exhausted.
    *
    * @throws AgentError if the received message has only one part or more than
    * two parts.
+   * @throws AgentError if the payload has an unknown or corrupted wire format.
    * @throws AgentError if not initialized
    */
   message_type receive(bool dont_block = false) {
     if (!_init_done)
       throw AgentError("Agent not initialized");
+    _status.expire();
+    if (_batch_next < _batch_records.size())
+      return next_batched();
     message message;
-    message_type result = message_type::none;
-    string topic, format, payload, j;
-    if (!_subscriber.receive(message, dont_block)) {
-      return result;
+    if (!_replay.empty()) {
+      message = std::move(_replay.front());
+      _replay.pop_front();
+    } else if (!_subscriber.receive(message, dont_block)) {
+      return message_type::none;
     }
     switch (message.parts()) {
     case 0:
       throw AgentError("Received message with no parts");
     case 1:
       throw AgentError("Received message with only one part");
-    case 2: // Payload is JSON
-      message >> topic >> payload;
-      if (_compress) {
-        snappy::Uncompress(payload.data(), payload.size(), &j);
-      } else {
-        j = payload;
+    case 2: { // Payload is JSON
+      string_view topic = inbound::frame(message, 0);
+      string_view data = inbound::frame(message, 1);
+      wire::header header;
+      try {
+        header = wire::read_header(data);
+        if (header.codec == wire_codec::dictionary) {
+          _compressor.add_dictionary(topic, data.substr(header.size));
+          return message_type::none;
+        }
+        // Headerless snappy from agents prior to wire headers
+        if (header.size == 0 && _compress &&
+            snappy::IsValidCompressedBuffer(data.data(), data.size()))
+          header.codec = wire_codec::snappy;
+        if (header.codec != wire_codec::none &&
+            !_compressor.unpack(topic, header.codec, data.substr(header.size),
+                                _scratch))
+          return message_type::none;
+        if (header.batch) {
+          if (header.codec == wire_codec::none)
+            _batch_body.assign(data.substr(header.size));
+          else
+            _batch_body.swap(_scratch);
+          Batcher::split(_batch_body, _batch_records);
+          _batch_next = 0;
+          _batch_topic = topic;
+          _batch_encoding = header.encoding;
+          _batcher.received(topic, _batch_records.size());
+        }
+      } catch (const std::exception &e) {
+        _batch_records.clear();
+        throw AgentError("Invalid payload on topic '" + string(topic) +
+                         "': " + e.what());
       }
-      _status[topic] = j;
-      _last_message = make_tuple(topic, j);
-      result = message_type::json;
-      break;
-    case 3: // Payload is a binary blob, type is in message[1]
-      message >> topic >> format >> payload;
-      _last_blob = make_tuple(
-          topic, format, vector<unsigned char>(payload.begin(), payload.end()));
-      result = message_type::blob;
-      break;
+      if (header.batch)
+        return next_batched();
+      _last_topic = topic;
+      _last_message =
+          _status.emplace(_last_topic, std::move(message), header, _scratch);
+      return message_type::json;
+    }
+    case 3: { // Payload is a binary blob, type is in message[1]
+      wire::header header;
+      string_view meta = inbound::frame(message, 1);
+      if (meta.find(wire::blob_codec_key) != string_view::npos) {
+        try {
+          header.codec = wire_codec_from(nlohmann::json::parse(meta).value(
+              wire::blob_codec_key, "none"));
+          if (!_compressor.unpack(inbound::frame(message, 0), header.codec,
+                                  inbound::frame(message, 2), _scratch))
+            return message_type::none;
+        } catch (const std::exception &e) {
+          throw AgentError("Invalid blob: "s + e.what());
+        }
+      }
+      _last_blob =
+          make_shared<const inbound>(std::move(message), header, _scratch, 2);
+      return message_type::blob;
+    }
     default:
       throw AgentError("Received message with "s + to_string(message.parts()) +
                        " parts"s);
     }
-    return result;
   }
 
 
@@ -732,6 +1051,10 @@ public:
    * @brief Enters the main loop of the agent. It also sets a signal handler for
    * SIGNINT, which will set the running flag to false.
    *
+   * The loop is timed on absolute deadlines, so that the period does not
+   * drift. If an iteration takes longer than the period, the missed ticks are
+   * handled according to the overrun policy (see set_loop_policy()).
+   *
    * @param lambda the function to be executed in the main loop
    * @param duration the duration of the loop (default 0, max speed)
    * @throws AgentError if not initialized
@@ -740,22 +1063,36 @@ public:
             chrono::milliseconds duration) {
     if (!_init_done)
       throw AgentError("Agent not initialized");
-    std::signal(SIGINT, [](int signum) {
-      UNUSED(signum);
-      Mads::running = false;
-    });
-    std::signal(SIGTERM, [](int signum) {
-      UNUSED(signum);
-      Mads::running = false;
-    });
-    while (running) {
-      if (duration > chrono::milliseconds(0)) {
-        thread t([&]() { this_thread::sleep_for(duration); });
-        lambda();
-        t.join();
-      } else {
+    trap_signals();
+    if (_remote_control_thread) {
+      _remote_control_thread = false;
+      thread([&]() {
+        _subscriber.set(zmqpp::socket_option::receive_timeout, 100);
+        while (Mads::running) {
+          message_type type;
+          try {
+            type = receive();
+          } catch (const std::exception &e) {
+            cerr << "Error receiving message: " << e.what() << endl;
+            continue;
+          }
+          if (type != message_type::json)
+            continue;
+          remote_control();
+        }
+      }).detach();
+    }
+    if (duration <= chrono::milliseconds(0)) {
+      while (running) {
         lambda();
       }
+      return;
+    }
+    _scheduler.set_period(duration);
+    _scheduler.start();
+    while (running) {
+      lambda();
+      _scheduler.wait();
     }
   }
 
@@ -775,6 +1112,88 @@ public:
   }
 
 
+  /**
+   * @brief Calls handler for each message received, when run() is used in
+   * place of loop(). Messages are read without blocking as soon as the
+   * subscriber socket has input; control messages are also handled here if
+   * remote control is enabled.
+   *
+   * @param handler Called with the type of each received message; use the
+   * last_*() accessors to get it.
+   * @throws AgentError if not initialized
+   */
+  void on_receive(std::function<void(message_type)> handler) {
+    if (!_init_done)
+      throw AgentError("Agent not initialized");
+    _receive_handler = [this, handler = std::move(handler)]() {
+      // Bounded, so that a flooded subscriber does not starve other sources
+      for (int i = 0; i < 1000 && Mads::running; i++) {
+        message_type type;
+        try {
+          type = receive(true);
+        } catch (const std::exception &e) {
+          cerr << "Error receiving message: " << e.what() << endl;
+          continue;
+        }
+        if (type == message_type::none)
+          break;
+        if (handler)
+          handler(type);
+        if (_remote_control && type == message_type::json)
+          remote_control();
+      }
+      // History and batches already received do not make the socket readable
+      if (pending())
+        _reactor.add_timer(chrono::milliseconds(0), _receive_handler, false);
+    };
+    _reactor.add(_subscriber, _receive_handler);
+  }
+
+
+  /**
+   * @brief Enters the event loop of the agent, as an alternative to loop().
+   * It also sets a signal handler for SIGINT and SIGTERM, which will set the
+   * running flag to false.
+   *
+   * A single thread waits on all the sources registered in the reactor
+   * (subscriber via on_receive(), other sockets, file descriptors and timers,
+   * see reactor()) and calls their handlers when they are ready, so that the
+   * agent sleeps when idle and reacts without polling delays.
+   *
+   * @example
+   * agent.on_receive([&](message_type type) { ... });
+   * agent.reactor().add_timer(1s, [&]() { agent.publish(status); });
+   * agent.run();
+   *
+   * @throws AgentError if not initialized
+   */
+  void run() {
+    if (!_init_done)
+      throw AgentError("Agent not initialized");
+    trap_signals();
+    _remote_control_thread = false;
+    if (_remote_control && !_reactor.has(_subscriber))
+      on_receive(nullptr);
+    if (_receive_handler && pending())
+      _reactor.add_timer(chrono::milliseconds(0), _receive_handler, false);
+    Reactor::timer_id expiry = 0;
+    if (auto ttl = _status.bounds().ttl; ttl.count() > 0)
+      expiry = _reactor.add_timer(max(ttl / 2, chrono::milliseconds(1)),
+                                  [this]() { _status.expire(); });
+    _reactor.run(Mads::running);
+    _reactor.cancel(expiry);
+  }
+
+
+  /**
+   * @brief The event loop used by run(), for registering sockets, file
+   * descriptors and timers.
+   *
+   * @return The reactor.
+   */
+  Reactor &reactor() { return _reactor; }
+
+
   /**
    * @brief Handles remote control commands.
    *
@@ -783,9 +1202,8 @@ public:
    * accordingly.
    */
   void remote_control() {
-    auto msg = last_message();
-    if (get<0>(msg) == "control") {
-      nlohmann::json j = nlohmann::json::parse(get<1>(msg));
+    if (last_topic_view() == "control") {
+      nlohmann::json j = last_json();
       if (j["cmd"] == "shutdown") {
         Mads::running = false;
       } else if (j["cmd"] == "restart") {
@@ -824,9 +1242,123 @@ public:
   /**
    * @brief Returns the status of the system.
    *
+   * @note This copies all the payloads: prefer status_view() for reading the
+   * last message of a given topic, or status_changes() for the updated ones.
    * @return A map containing the last messages for each subscribed topic.
    */
-  map<string, string> status() { return _status; }
+  map<string, string> status() {
+    map<string, string> result;
+    for (auto const &[topic, rec] : _status.snapshot().entries) {
+      result.emplace(topic, rec->value.payload());
+    }
+    return result;
+  }
+
+
+  /**
+   * @brief Returns a view of the last message received on a given topic.
+   *
+   * @note The view is valid until the next message on the same topic is
+   * received, or until the topic is evicted, if the status is bounded (see
+   * set_status_bounds()): eviction can follow any received message, or the
+   * TTL. To keep a payload across receive() calls on a bounded status, hold
+   * its record (status_changes()) or parse it (status_json()).
+   * @param topic The topic.
+   * @return The (decompressed) JSON payload, empty if nothing was received.
+   */
+  string_view status_view(string_view topic) const {
+    auto rec = _status.get(topic);
+    return rec ? rec->value.payload() : string_view();
+  }
+
+
+  /**
+   * @brief Returns the parsed last message received on a given topic.
+   *
+   * @param topic The topic.
+   * @return The JSON payload, null if nothing was received.
+   */
+  nlohmann::json status_json(string_view topic) const {
+    auto rec = _status.get(topic);
+    return rec ? rec->value.json() : nlohmann::json();
+  }
+
+
+  /**
+   * @brief Returns the sequence number of the last message received on a
+   * topic (1 for the first one).
+   *
+   * @param topic The topic.
+   * @return The sequence number, 0 if nothing was received.
+   */
+  uint64_t status_seq(string_view topic) const {
+    auto rec = _status.get(topic);
+    return rec ? rec->seq : 0;
+  }
+
+
+  /**
+   * @brief Returns the version of the status, i.e. the number of messages
+   * stored since the start. Pass it to status_changes() to get the topics
+   * updated afterwards.
+   *
+   * @return The version.
+   */
+  uint64_t status_version() const { return _status.version(); }
+
+
+  /**
+   * @brief Returns a snapshot of the last messages of the topics updated
+   * after a given version, without copying payloads. It can be called from
+   * any thread, and the messages it holds stay valid as long as the snapshot
+   * is alive.
+   *
+   * @example
+   * auto snap = agent.status_changes(version);
+   * version = agent.status_version();
+   * for (auto const &[topic, rec] : snap.entries)
+   *   cout << topic << " #" << rec->seq << ": " << rec->value.payload();
+   * @param since The version (0 for all topics).
+   * @return The snapshot.
+   */
+  status_store::snapshot_t status_changes(uint64_t since = 0) const {
+    return _status.snapshot(since);
+  }
+
+
+  /**
+   * @brief Adds a callback, called by receive() each time a topic is
+   * updated with a JSON message.
+   *
+   * @param callback Function taking the topic and the new record.
+   */
+  void on_status_change(status_store::callback_t callback) {
+    _status.on_change(std::move(callback));
+  }
+
+
+  /**
+   * @brief Bounds the status store, in number of topics, memory and time
+   * since the last update: least recently updated topics are evicted. Can
+   * also be set with the status_max_topics, status_max_bytes and status_ttl
+   * (ms) keys in the INI file (agent section or [agents]). Call it from the
+   * receiving thread, or before connecting. Topics older than the TTL are
+   * evicted by receive(), and periodically by run() when idle.
+   *
+   * @param bounds The bounds (0 for unbounded).
+   */
+  void set_status_bounds(const StatusBounds &bounds) {
+    _status.set_bounds(bounds);
+  }
+
+
+  /**
+   * @brief Returns the occupation of the status store (topics, bytes,
+   * evictions) and its bounds.
+   *
+   * @return The statistics as JSON.
+   */
+  nlohmann::json status_stats() const { return _status.stats(); }
 
 
   /**
@@ -843,7 +1375,9 @@ public:
    * @return A tuple containing the topic and payload of the last received
    * message.
    */
-  tuple<string, string> last_message() { return _last_message; }
+  tuple<string, string> last_message() {
+    return make_tuple(string(last_topic_view()), string(last_payload_view()));
+  }
 
 
   /**
@@ -851,17 +1385,87 @@ public:
    *
    * @return The topic of the last received message.
    */
-  string last_topic() { return get<0>(_last_message); }
+  string last_topic() { return string(last_topic_view()); }
+
+
+  /**
+   * @brief Returns a view of the topic of the last received JSON message.
+   *
+   * @return The topic, valid until the next message on the same topic.
+   */
+  string_view last_topic_view() const {
+    return _last_message ? string_view(_last_topic) : string_view();
+  }
+
+
+  /**
+   * @brief Returns a view of the payload of the last received JSON message.
+   *
+   * @return The (decompressed) JSON payload, valid until the next message on
+   * the same topic.
+   */
+  string_view last_payload_view() const {
+    return _last_message ? _last_message->value.payload() : string_view();
+  }
+
+
+  /**
+   * @brief Returns the parsed payload of the last received JSON message.
+   *
+   * Binary encoded payloads (CBOR, MessagePack) are decoded directly, without
+   * going through JSON text.
+   *
+   * @return The JSON payload, null if nothing was received.
+   */
+  nlohmann::json last_json() const {
+    return _last_message ? _last_message->value.json() : nlohmann::json();
+  }
 
 
   /**
    * @brief Returns the last received blob by the agent.
    *
+   * @note This copies the blob: prefer last_blob_view().
    * @return A tuple containing the topic, format, and payload of the last
    * received blob.
    */
   tuple<string, string, vector<unsigned char>> last_blob() {
-    return _last_blob;
+    auto data = last_blob_view();
+    auto bytes = reinterpret_cast<const unsigned char *>(data.data());
+    return make_tuple(string(last_blob_topic_view()),
+                      string(last_blob_meta_view()),
+                      vector<unsigned char>(bytes, bytes + data.size()));
+  }
+
+
+  /**
+   * @brief Returns a view of the topic of the last received blob.
+   *
+   * @return The topic, valid until the next blob is received.
+   */
+  string_view last_blob_topic_view() const {
+    return _last_blob ? _last_blob->frame(0) : string_view();
+  }
+
+
+  /**
+   * @brief Returns a view of the metadata (format) of the last received blob.
+   *
+   * @return The metadata JSON, valid until the next blob is received.
+   */
+  string_view last_blob_meta_view() const {
+    return _last_blob ? _last_blob->frame(1) : string_view();
+  }
+
+
+  /**
+   * @brief Returns a view of the data of the last received blob.
+   *
+   * @return The blob bytes, valid until the next blob is received.
+   */
+  span<const std::byte> last_blob_view() const {
+    string_view data = _last_blob ? _last_blob->body() : string_view();
+    return {reinterpret_cast<const std::byte *>(data.data()), data.size()};
   }
 
 
@@ -881,6 +1485,53 @@ public:
   bool is_connected() { return _connected; }
 
 
+  /**
+   * @brief Returns the broker endpoints, frontend and backend, as given by
+   * the settings (before route()).
+   *
+   * @return a tuple with the frontend and backend endpoints.
+   */
+  tuple<string, string> endpoints() { return {_pub_endpoint, _sub_endpoint}; }
+
+
+  /**
+   * @brief Returns the directory of the ipc endpoints offered by the broker.
+   *
+   * @return the directory (empty if the agent is not on the broker host, or
+   * if ipc is disabled with ipc = false in [agents]).
+   */
+  string ipc_dir() { return _ipc_dir; }
+
+
+  /**
+   * @brief Returns the topic partitioning of the broker.
+   *
+   * @return the shard map (not enabled if the broker is not partitioned).
+   */
+  const ShardMap &shards() const { return _shards; }
+
+
+  /**
+   * @brief The endpoint actually used for a broker endpoint: its ipc
+   * counterpart (see Mads::ipc_endpoint()) if the broker offered it and its
+   * socket file exists, otherwise the endpoint itself. The choice is kept
+   * until disconnect().
+   *
+   * @param endpoint A TCP endpoint of the broker.
+   * @return the endpoint to connect to.
+   */
+  string route(const string &endpoint) {
+    auto it = _routes.find(endpoint);
+    if (it != _routes.end())
+      return it->second;
+    string ipc = ipc_endpoint(_ipc_dir, endpoint);
+    std::error_code ec;
+    bool local = !ipc.empty() &&
+                 filesystem::exists(ipc.substr(sizeof("ipc://") - 1), ec);
+    return _routes[endpoint] = local ? ipc : endpoint;
+  }
+
+
   /**
    * @brief Returns the value of timeout in loading settings from URI.
    *
@@ -922,6 +1573,103 @@ public:
   }
 
 
+  /**
+   * @brief Sets the policy for handling loop iterations that overrun their
+   * period. Can also be set with the loop_policy key in the INI file (agent
+   * section or [agents]), as "skip" (default), "burst" or "shift".
+   *
+   * @param policy The overrun policy.
+   */
+  void set_loop_policy(overrun_policy policy) { _scheduler.set_policy(policy); }
+
+
+  /**
+   * @brief Sets the wire encoding of published JSON payloads. Can also be set
+   * with the encoding key in the INI file (agent section or [agents]), as
+   * "json" (default), "cbor" or "msgpack".
+   *
+   * @param encoding The wire encoding.
+   */
+  void set_encoding(wire_encoding encoding) { _encoding = encoding; }
+
+
+  /**
+   * @brief Sets capacity and full-queue policy of the outbound queue. Can
+   * also be set with the queue_size and queue_policy keys in the INI file
+   * (agent section or [agents]); policy is "block" (default) or "drop".
+   *
+   * @param capacity The capacity (rounded up to a power of two).
+   * @param policy The policy when the queue is full.
+   * @throws AgentError if already connected
+   */
+  void set_queue(size_t capacity, queue_policy policy) {
+    if (_outbox.running())
+      throw AgentError("Cannot change the outbound queue after connecting");
+    _outbox.configure(capacity, policy);
+  }
+
+
+  /**
+   * @brief Returns the statistics of the outbound queue (messages sent and
+   * dropped, maximum depth).
+   *
+   * @return The statistics as JSON.
+   */
+  nlohmann::json queue_stats() const { return _outbox.stats(); }
+
+
+  /**
+   * @brief Enables batching on a topic: payloads are coalesced into a single
+   * message until its size reaches size bytes, or latency has elapsed since
+   * the first payload. Can also be set for the pub topic with the batch_size
+   * and batch_latency (ms) keys in the INI file (agent section or [agents]).
+   *
+   * Any topic can be batched; if called before connect(), batching starts
+   * once the agent is connected.
+   *
+   * @param size The batch size in bytes (0 disables batching).
+   * @param latency The maximum delay of a payload.
+   * @param topic The topic (empty for the pub topic).
+   */
+  void set_batching(size_t size, chrono::milliseconds latency,
+                    string topic = "") {
+    if (topic.empty() || topic == _pub_topic) {
+      topic = _pub_topic;
+      _batch_policy = {size, latency};
+    }
+    _batcher.set_policy(topic, {size, latency});
+    start_batcher();
+  }
+
+
+  /**
+   * @brief Returns the per-topic batching statistics: batches and payloads
+   * sent, payloads per batch, effective message and batch rates, batches
+   * received and split.
+   *
+   * @return A JSON object with one key per topic.
+   */
+  nlohmann::json batch_stats() const { return _batcher.stats(); }
+
+
+  /**
+   * @brief Returns the per-topic compression statistics (published and
+   * received messages, compression ratio, cumulative times) and policies.
+   *
+   * @return A JSON object with one key per topic.
+   */
+  nlohmann::json compression_stats() const { return _compressor.stats(); }
+
+
+  /**
+   * @brief Returns the statistics of the timed main loop (actual period,
+   * jitter histogram, overruns).
+   *
+   * @return The loop statistics.
+   */
+  const LoopStats &loop_stats() const { return _scheduler.stats(); }
+
+
   /**
    * @brief Returns wheter a restart has been requested.
    *
@@ -966,7 +1714,24 @@ protected:
       _sub_endpoint = "tcp://*:" + port;
       _publisher.bind(_sub_endpoint);
     } else
-      _publisher.connect(_pub_endpoint);
+      _publisher.connect(route(_pub_endpoint));
+    if (_shards.enabled() && !_cross) {
+      // One publisher per broker shard, each topic goes to its shard
+      vector<zmqpp::socket *> sockets{&_publisher};
+      for (size_t i = 1; i < _shards.count(); i++) {
+        auto &pub = _shard_publishers.emplace_back(
+            make_unique<zmqpp::socket>(_context, socket_type::pub));
+        pub->connect(route(_shards.endpoint(_pub_endpoint, i)));
+        sockets.push_back(pub.get());
+      }
+      _outbox.start(sockets, [this](const zmqpp::message &msg) {
+        return _shards.shard(inbound::frame(msg, 0));
+      });
+    } else
+      _outbox.start(_publisher);
+    if (_batch_policy.enabled())
+      _batcher.set_policy(_pub_topic, _batch_policy);
+    start_batcher();
     if (delay.count() > 0)
       this_thread::sleep_for(delay);
   }
@@ -982,13 +1747,250 @@ protected:
       string port = _pub_endpoint.substr(_pub_endpoint.find_last_of(":") + 1);
       _pub_endpoint = "tcp://*:" + port;
       _subscriber.bind(_pub_endpoint);
-    } else
-      _subscriber.connect(_sub_endpoint);
+    } else {
+      _subscriber.connect(route(_sub_endpoint));
+      // Each topic flows through one shard only: no duplicates
+      for (size_t i = 1; i < _shards.count(); i++)
+        _subscriber.connect(route(_shards.endpoint(_sub_endpoint, i)));
+    }
     for (auto &t : _sub_topic) {
       _subscriber.subscribe(t);
     }
+    if (_replay_history && !_cross && !settings_are_local())
+      fetch_history();
+  }
+
+
+  /**
+   * @brief Asks the broker for its cached messages on the subscribed topics
+   * (after subscribing, so that nothing is missed). They are returned by
+   * receive() before reading the socket.
+   */
+  void fetch_history() {
+    zmqpp::socket socket(_context, zmqpp::socket_type::req);
+    int timeout = _settings_timeout > 0 ? _settings_timeout : 2000;
+    socket.set(zmqpp::socket_option::receive_timeout, timeout);
+    socket.set(zmqpp::socket_option::send_timeout, timeout);
+    socket.set(zmqpp::socket_option::linger, 0);
+    socket.connect(_settings_uri);
+    message msg;
+    msg << LIB_VERSION << "history" << _name;
+    for (auto &t : _sub_topic) {
+      // Past control commands must not be replayed
+      if (t != "control")
+        msg << t;
+    }
+    if (!socket.send(msg) || !socket.receive(msg)) {
+      cerr << fg::yellow << "No history from broker" << fg::reset << endl;
+      socket.close();
+      return;
+    }
+    size_t i = 1;
+    try {
+      while (i < msg.parts()) {
+        size_t n = stoul(msg.get(i++));
+        if (i + n > msg.parts())
+          break;
+        message m;
+        for (size_t j = 0; j < n; j++, i++)
+          m.add_raw(msg.raw_data(i), msg.size(i));
+        _replay.push_back(std::move(m));
+      }
+    } catch (const std::exception &e) {
+      cerr << fg::yellow << "Invalid history from broker: " << e.what()
+           << fg::reset << endl;
+    }
+    socket.close();
+  }
+
+
+  /**
+   * @brief True if receive() has messages to return without reading the
+   * socket (broker history, rest of a batch).
+   */
+  bool pending() const {
+    return !_replay.empty() || _batch_next < _batch_records.size();
+  }
+
+
+  /**
+   * @brief Stores the next payload of the last received batch as the last
+   * message of the batch topic.
+   */
+  message_type next_batched() {
+    if (_batch_next >= _batch_records.size())
+      return message_type::none;
+    _last_topic = _batch_topic;
+    _last_message = _status.emplace(
+        _batch_topic, _batch_records[_batch_next++], _batch_encoding);
+    return message_type::json;
+  }
+
+  /**
+   * @brief Stamps, encodes and queues a JSON message.
+   *
+   * @param payload The JSON payload.
+   * @param topic The topic (empty for the pub topic).
+   * @param offset Milliseconds to subtract from timestamp and timecode.
+   * @param delay Delay before the actual transmission.
+   */
+  void send_json(nlohmann::json &payload, string topic, uint32_t offset,
+                 chrono::milliseconds delay = chrono::milliseconds(0)) {
+    chrono::system_clock::time_point now = chrono::system_clock::now();
+    payload["hostname"] = _hostname;
+    payload["timestamp"]["$date"] = get_ISODate_time(now, -offset);
+    if (!payload.contains("timecode")) {
+      payload["timecode"] = timecode(now, timecode_fps) - offset;
+    }
+    if (topic.empty())
+      topic = _pub_topic;
+    string body;
+    wire::encode(payload, _encoding, body);
+    if (delay.count() == 0 && _batcher.add(topic, body))
+      return;
+    send_body(topic, std::move(body), false, delay);
+  }
+
+
+  /**
+   * @brief Starts the flusher of the batcher, if any topic is batched and
+   * the publisher is connected.
+   */
+  void start_batcher() {
+    if (!_outbox.running() || !_batcher.active())
+      return;
+    _batcher.start([this](const string &t, string &&body, size_t count) {
+      send_body(t, std::move(body), count > 1);
+    });
+  }
+
+
+  /**
+   * @brief Compresses and queues an encoded payload (or a batch of them).
+   *
+   * @param topic The topic.
+   * @param body The encoded payload, or the batch body.
+   * @param batch True if body is a batch.
+   * @param delay Delay before the actual transmission.
+   */
+  void send_body(const string &topic, string &&body, bool batch,
+                 chrono::milliseconds delay = chrono::milliseconds(0)) {
+    message message;
+    string dict_frame;
+    // Delayed messages would be overtaken: they never carry new dictionaries
+    string frame = _compressor.pack(topic, _encoding, std::move(body),
+                                    delay.count() > 0 ? nullptr : &dict_frame,
+                                    batch);
+    message << topic << frame;
+    if (dict_frame.empty()) {
+      _outbox.push(message, delay);
+      return;
+    }
+    // The dictionary and its first payload make a single outbox entry, and
+    // other publishing threads only use the dictionary once it is queued
+    zmqpp::message dict;
+    dict << topic << dict_frame;
+    _compressor.announced(topic, _outbox.push(dict, message));
+  }
+
+
+  /**
+   * @brief Stamps, compresses and queues a blob message.
+   *
+   * @param payload The blob.
+   * @param len The size of the blob.
+   * @param release If not null, the blob is sent without copies and then
+   * handed to release; otherwise it is copied.
+   * @param hint Passed to release.
+   * @param meta The blob metadata.
+   * @param topic The topic (empty for the pub topic).
+   */
+  void send_blob(const char *payload, size_t len, zmq_free_fn *release,
+                 void *hint, nlohmann::json &meta, string topic) {
+    if (!_init_done) {
+      if (release)
+        release((void *)payload, hint);
+      throw AgentError("Agent not initialized");
+    }
+    message message;
+    chrono::system_clock::time_point now = chrono::system_clock::now();
+    meta["timestamp"]["$date"] = get_ISODate_time(now);
+    meta["timecode"] = timecode(now, timecode_fps);
+    if (topic.empty())
+      topic = _pub_topic;
+    string packed;
+    wire_codec codec =
+        _compressor.pack_blob(topic, string_view(payload, len), packed);
+    if (codec != wire_codec::none)
+      meta[wire::blob_codec_key] = wire_codec_map.at(codec);
+    message << topic << meta.dump();
+    if (codec != wire_codec::none) {
+      // The original is no longer needed, the compressed copy is moved out
+      if (release)
+        release((void *)payload, hint);
+      auto owner = new string(std::move(packed));
+      message.add_nocopy_const(owner->data(), owner->size(),
+                               free_owner<string>, owner);
+    } else if (release) {
+      message.add_nocopy_const(payload, len, release, hint);
+    } else {
+      message.add_raw(payload, len);
+    }
+    _outbox.push(message);
+  }
+
+  // Deallocators for zero-copy frames: the hint is the owner of the data
+  template <typename T> static void free_owner(void *data, void *hint) {
+    UNUSED(data);
+    delete static_cast<T *>(hint);
+  }
+
+  static void keep(void *data, void *hint) {
+    UNUSED(data);
+    UNUSED(hint);
+  }
+
+  // SIGINT and SIGTERM end loop() and run()
+  static void trap_signals() {
+    std::signal(SIGINT, [](int signum) {
+      UNUSED(signum);
+      Mads::running = false;
+      Reactor::wake_all();
+    });
+    std::signal(SIGTERM, [](int signum) {
+      UNUSED(signum);
+      Mads::running = false;
+      Reactor::wake_all();
+    });
   }
 
+  /**
+   * @brief Loads the compression policies from the [compression] section.
+   * Without that section, the legacy compress flag enables snappy on all
+   * topics.
+   *
+   * @throws std::invalid_argument on invalid codecs.
+   */
+  void load_compression() {
+    CompressionPolicy policy;
+    policy.codec = _compress ? wire_codec::snappy : wire_codec::none;
+    auto cfg = _config["compression"];
+    if (cfg.is_table()) {
+      policy.load(cfg);
+      _compressor.set_dict_interval(
+          chrono::milliseconds(cfg["dict_interval"].value_or(5000)));
+      _compressor.set_max_size(
+          cfg["max_size"].value_or<int64_t>(_compressor.max_size()));
+    }
+    _compressor.set_default(policy);
+    if (auto topics = cfg["topics"].as_table()) {
+      for (auto &&[topic, node] : *topics) {
+        CompressionPolicy tp = policy;
+        tp.load(cfg["topics"][topic.str()]);
+        _compressor.set_policy(string(topic.str()), tp);
+      }
+    }
+  }
 
   static tuple<string, string, string> split_URL(const string &url) {
     static regex re("(\\w+://)([\\w\\.-]+):(\\d+)");
@@ -1008,23 +2010,46 @@ protected:
   string _raw_settings;
   toml::table _config;
   string _pub_endpoint, _sub_endpoint;
+  string _ipc_dir;              // Of the broker, if on this host
+  map<string, string> _routes; // Broker endpoints to those connected
   string _pub_topic;
   string _agent_id;
   vector<string> _sub_topic;
   context _context;
   zmqpp::socket _publisher;
   zmqpp::socket _subscriber;
-  map<string, string> _status;
-  tuple<string, string> _last_message;
-  tuple<string, string, vector<unsigned char>> _last_blob;
+  status_store _status;
+  status_store::record_ptr _last_message;
+  string _last_topic;
+  shared_ptr<const inbound> _last_blob;
   bool _compress = false;
+  wire_encoding _encoding = wire_encoding::json;
+  Compressor _compressor;
+  Outbox _outbox;
+  ShardMap _shards;
+  vector<unique_ptr<zmqpp::socket>> _shard_publishers; // Shards 1..N-1
+  string _scratch; // Decompression buffer, swapped into inbound messages
+  Batcher _batcher;
+  BatchPolicy _batch_policy;
+  string _batch_body; // Last received batch, split into _batch_records
+  vector<string_view> _batch_records;
+  size_t _batch_next = 0;
+  string _batch_topic;
+  wire_encoding _batch_encoding = wire_encoding::json;
+  bool _replay_history = false;
+  deque<message> _replay; // Broker history, received before live messages
   bool _cross = false;
   bool _connected = false;
   int _receive_timeout = 500;
   int _settings_timeout = 0;
   bool _init_done = false;
   bool _restart = false;
+  bool _remote_control = false;
+  bool _remote_control_thread = false; // Pending, started by loop()
+  Reactor _reactor;
+  Reactor::handler_t _receive_handler; // Set by on_receive()
   chrono::milliseconds _time_step = chrono::milliseconds(0);
+  Scheduler _scheduler;
   double _timecode_offset = 0.0;
   filesystem::path _attachment_path;
 public:
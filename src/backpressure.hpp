@@ -0,0 +1,335 @@
+/*
+  ____             _
+ | __ )  __ _  ___| | ___ __  _ __ ___  ___ ___ _   _ _ __ ___
+ |  _ \ / _` |/ __| |/ / '_ \| '__/ _ \/ __/ __| | | | '__/ _ \
+ | |_) | (_| | (__|   <| |_) | | |  __/\__ \__ \ |_| | | |  __/
+ |____/ \__,_|\___|_|\_\ .__/|_|  \___||___/___/\__,_|_|  \___|
+                       |_|
+
+Backpressure controls of the broker: socket options of the frontend and
+backend endpoints (high-water marks, kernel buffers, drop policy), and
+per-peer accounting. Peers are tracked with the ZeroMQ socket monitor, and
+their queues are sampled from the kernel: a subscriber whose send queue
+stays full is a slow consumer, and ZeroMQ is dropping its messages (or, with
+nodrop, stalling the broker).
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef BACKPRESSURE_HPP
+#define BACKPRESSURE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <toml++/toml.hpp>
+#include <zmqpp/zmqpp.hpp>
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if defined(__linux__)
+#include <linux/sockios.h>
+#endif
+
+namespace Mads {
+
+/**
+ * @brief Options of a broker socket, from the [broker.frontend] or
+ * [broker.backend] table. Unset options keep the ZeroMQ defaults.
+ *
+ * - sndhwm, rcvhwm: high-water marks, in messages per peer
+ * - sndbuf, rcvbuf: kernel buffer sizes, in bytes
+ * - nodrop (backend only): when a subscriber is full, block the broker
+ *   instead of dropping its messages
+ *
+ * @note ZeroMQ applies these to the connections made after they are set.
+ */
+struct SocketOptions {
+  SocketOptions() = default;
+
+  /**
+   * @brief Reads the options from a table (may be null).
+   *
+   * @throws std::invalid_argument on negative values.
+   */
+  explicit SocketOptions(const toml::table *t) {
+    if (!t)
+      return;
+    auto read = [&](const char *key) -> int64_t {
+      int64_t v = (*t)[key].value_or(-1);
+      if ((*t)[key] && v < 0)
+        throw std::invalid_argument(std::string(key) + " must be positive");
+      return v;
+    };
+    sndhwm = read("sndhwm");
+    rcvhwm = read("rcvhwm");
+    sndbuf = read("sndbuf");
+    rcvbuf = read("rcvbuf");
+    nodrop = (*t)["nodrop"].value_or(false);
+  }
+
+  bool operator==(const SocketOptions &other) const = default;
+
+  /**
+   * @brief Sets the options on a socket.
+   *
+   * @param xpub True for the backend socket, enabling nodrop.
+   */
+  void apply(zmqpp::socket &socket, bool xpub) const {
+    if (sndhwm >= 0)
+      socket.set(zmqpp::socket_option::send_high_water_mark, (int)sndhwm);
+    if (rcvhwm >= 0)
+      socket.set(zmqpp::socket_option::receive_high_water_mark, (int)rcvhwm);
+    if (sndbuf >= 0)
+      socket.set(zmqpp::socket_option::send_buffer_size, (int)sndbuf);
+    if (rcvbuf >= 0)
+      socket.set(zmqpp::socket_option::receive_buffer_size, (int)rcvbuf);
+    if (xpub) {
+      // Not wrapped by zmqpp
+      int value = nodrop ? 1 : 0;
+      zmq_setsockopt(static_cast<void *>(socket), ZMQ_XPUB_NODROP, &value,
+                     sizeof(value));
+    }
+  }
+
+  nlohmann::json json() const {
+    nlohmann::json j = nlohmann::json::object();
+    if (sndhwm >= 0)
+      j["sndhwm"] = sndhwm;
+    if (rcvhwm >= 0)
+      j["rcvhwm"] = rcvhwm;
+    if (sndbuf >= 0)
+      j["sndbuf"] = sndbuf;
+    if (rcvbuf >= 0)
+      j["rcvbuf"] = rcvbuf;
+    j["nodrop"] = nodrop;
+    return j;
+  }
+
+  int64_t sndhwm = -1, rcvhwm = -1, sndbuf = -1, rcvbuf = -1;
+  bool nodrop = false;
+};
+
+/**
+ * @brief Peers connected to the broker sockets, with their kernel queues.
+ * Thread-safe.
+ *
+ * Subscribers (backend peers) are sampled for the bytes waiting in their
+ * send queue, publishers (frontend peers) for those waiting to be read. A
+ * subscriber is a slow consumer when its queue stays over a fraction of the
+ * kernel buffer for some time. Queues are measured on Linux and macOS only.
+ *
+ * @example
+ * PeerMonitor peers(0.8, 2s);
+ * peers.event(monitor_msg, PeerMonitor::backend, 0); // on monitor messages
+ * peers.sample(); // periodically
+ * auto slow = peers.slow_consumers();
+ */
+class PeerMonitor {
+public:
+  using clock = std::chrono::steady_clock;
+  enum side_t { frontend, backend };
+
+  /**
+   * @brief A connected peer.
+   */
+  struct peer {
+    side_t side;
+    size_t shard;
+    std::string address;
+    clock::time_point since;
+    size_t queued = 0, max_queued = 0, buffer = 0; // Bytes
+    double saturated_time = 0;                     // Seconds, in total
+    clock::time_point saturated_since;
+    bool saturated = false, slow = false;
+  };
+
+  /**
+   * @brief Creates a monitor.
+   *
+   * @param threshold Fraction of the kernel buffer above which a queue is
+   * saturated.
+   * @param slow_after A subscriber saturated for this long is slow.
+   */
+  PeerMonitor(double threshold = 0.8,
+              std::chrono::milliseconds slow_after = std::chrono::seconds(2))
+      : _threshold(threshold), _slow_after(slow_after) {}
+
+  void configure(double threshold, std::chrono::milliseconds slow_after) {
+    std::lock_guard lock(_mtx);
+    _threshold = threshold;
+    _slow_after = slow_after;
+  }
+
+  /**
+   * @brief Handles a message of the socket monitor (event and value frame,
+   * then the endpoint).
+   */
+  void event(const zmqpp::message &msg, side_t side, size_t shard) {
+    if (msg.parts() < 1 || msg.size(0) < 6)
+      return;
+    uint16_t event;
+    uint32_t value;
+    auto data = static_cast<const char *>(msg.raw_data(0));
+    std::memcpy(&event, data, 2);
+    std::memcpy(&value, data + 2, 4);
+    auto fd = (zmqpp::raw_socket_t)value;
+    std::lock_guard lock(_mtx);
+    if (event == ZMQ_EVENT_ACCEPTED) {
+      peer p{side, shard, peer_address(fd), clock::now()};
+      _peers[fd] = p;
+    } else if (event == ZMQ_EVENT_DISCONNECTED ||
+               event == ZMQ_EVENT_CLOSED) {
+      _peers.erase(fd);
+    }
+  }
+
+  /**
+   * @brief Samples the queues of all the peers.
+   *
+   * @return The subscribers that have just become slow.
+   */
+  std::vector<peer> sample() {
+    auto now = clock::now();
+    std::vector<peer> slowed;
+    std::lock_guard lock(_mtx);
+    for (auto &[fd, p] : _peers) {
+      p.queued = queued(fd, p.side);
+      p.buffer = buffer(fd, p.side);
+      p.max_queued = std::max(p.max_queued, p.queued);
+      bool saturated = p.buffer > 0 && p.queued >= _threshold * p.buffer;
+      if (saturated && !p.saturated)
+        p.saturated_since = now;
+      if (saturated) {
+        if (_last_sample.time_since_epoch().count() > 0)
+          p.saturated_time +=
+              std::chrono::duration<double>(now - _last_sample).count();
+        bool slow =
+            p.side == backend && now - p.saturated_since >= _slow_after;
+        if (slow && !p.slow)
+          slowed.push_back(p);
+        p.slow = slow;
+      } else {
+        p.slow = false;
+      }
+      p.saturated = saturated;
+    }
+    _last_sample = now;
+    return slowed;
+  }
+
+  /**
+   * @brief The subscribers that are currently slow.
+   */
+  std::vector<peer> slow_consumers() const {
+    std::vector<peer> slow;
+    std::lock_guard lock(_mtx);
+    for (auto const &[fd, p] : _peers) {
+      if (p.slow)
+        slow.push_back(p);
+    }
+    return slow;
+  }
+
+  /**
+   * @brief All the peers, and the addresses of the slow consumers.
+   */
+  nlohmann::json json() const {
+    auto now = clock::now();
+    std::lock_guard lock(_mtx);
+    nlohmann::json peers = nlohmann::json::array();
+    nlohmann::json slow = nlohmann::json::array();
+    for (auto const &[fd, p] : _peers) {
+      peers.push_back(
+          {{"address", p.address},
+           {"side", p.side == backend ? "subscriber" : "publisher"},
+           {"shard", p.shard},
+           {"connected_s",
+            std::chrono::duration<double>(now - p.since).count()},
+           {"queued", p.queued},
+           {"max_queued", p.max_queued},
+           {"buffer", p.buffer},
+           {"saturated_s", p.saturated_time},
+           {"slow", p.slow}});
+      if (p.slow)
+        slow.push_back(p.address);
+    }
+    return {{"peers", peers}, {"slow_consumers", slow}};
+  }
+
+private:
+  static std::string peer_address(zmqpp::raw_socket_t fd) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (sockaddr *)&addr, &len) != 0)
+      return "fd " + std::to_string(fd);
+    char host[INET6_ADDRSTRLEN] = {0};
+    if (addr.ss_family == AF_INET) {
+      auto a = (sockaddr_in *)&addr;
+      inet_ntop(AF_INET, &a->sin_addr, host, sizeof(host));
+      return std::string(host) + ":" + std::to_string(ntohs(a->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+      auto a = (sockaddr_in6 *)&addr;
+      inet_ntop(AF_INET6, &a->sin6_addr, host, sizeof(host));
+      return "[" + std::string(host) + "]:" + std::to_string(ntohs(a->sin6_port));
+    }
+    // Unix domain sockets have no peer address
+    return "local fd " + std::to_string(fd);
+  }
+
+  static size_t queued(zmqpp::raw_socket_t fd, side_t side) {
+    int bytes = 0;
+#if defined(__linux__)
+    if (ioctl(fd, side == backend ? SIOCOUTQ : SIOCINQ, &bytes) != 0)
+      return 0;
+#elif defined(__APPLE__)
+    if (side == backend) {
+      socklen_t len = sizeof(bytes);
+      if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &bytes, &len) != 0)
+        return 0;
+    } else if (ioctl(fd, FIONREAD, &bytes) != 0) {
+      return 0;
+    }
+#else
+    (void)fd;
+    (void)side;
+#endif
+    return bytes > 0 ? (size_t)bytes : 0;
+  }
+
+  static size_t buffer(zmqpp::raw_socket_t fd, side_t side) {
+    int bytes = 0;
+    socklen_t len = sizeof(bytes);
+    if (getsockopt(fd, SOL_SOCKET, side == backend ? SO_SNDBUF : SO_RCVBUF,
+                   (char *)&bytes, &len) != 0)
+      return 0;
+#if defined(__linux__)
+    bytes /= 2; // Linux doubles the size, for its bookkeeping
+#endif
+    return bytes > 0 ? (size_t)bytes : 0;
+  }
+
+  mutable std::mutex _mtx;
+  std::map<zmqpp::raw_socket_t, peer> _peers;
+  double _threshold;
+  std::chrono::milliseconds _slow_after;
+  clock::time_point _last_sample{};
+};
+
+} // namespace Mads
+
+#endif // BACKPRESSURE_HPP
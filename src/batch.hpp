@@ -0,0 +1,361 @@
+/*
+  ____        _       _     _
+ | __ )  __ _| |_ ___| |__ (_)_ __   __ _
+ |  _ \ / _` | __/ __| '_ \| | '_ \ / _` |
+ | |_) | (_| | || (__| | | | | | | | (_| |
+ |____/ \__,_|\__\___|_| |_|_|_| |_|\__, |
+                                    |___/
+
+Micro-batching of outbound payloads. On high-rate topics, many small encoded
+payloads are coalesced into a single message until a size or a latency bound
+is reached. The batch body is a sequence of records, each made of a 4-byte
+little-endian length followed by the encoded payload; it is compressed as a
+unit and marked with the batch flag in the wire header (see wire.hpp).
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Bounds of the batches of a topic.
+ *
+ * A batch is sent when its body reaches size bytes, or latency after its
+ * first payload was added, whichever comes first. A size of 0 disables
+ * batching.
+ */
+struct BatchPolicy {
+  size_t size = 0;
+  std::chrono::milliseconds latency{2};
+
+  bool enabled() const { return size > 0; }
+
+  bool operator==(const BatchPolicy &other) const = default;
+};
+
+/**
+ * @brief Batching statistics for a topic.
+ *
+ */
+struct BatchStats {
+  uint64_t batches = 0;  // Batches sent
+  uint64_t messages = 0; // Payloads sent in batches
+  uint64_t bytes = 0;    // Uncompressed batch bytes
+  uint64_t by_size = 0;  // Batches sent because full
+  uint64_t received = 0; // Batches received
+  uint64_t unbatched = 0; // Payloads extracted from received batches
+  std::chrono::steady_clock::time_point first, last;
+
+  nlohmann::json json() const {
+    nlohmann::json j;
+    if (batches > 0) {
+      double elapsed = std::chrono::duration<double>(last - first).count();
+      j["batches"] = batches;
+      j["messages"] = messages;
+      j["bytes"] = bytes;
+      j["by_size"] = by_size;
+      j["by_latency"] = batches - by_size;
+      j["messages_per_batch"] = (double)messages / batches;
+      if (elapsed > 0) {
+        j["message_rate"] = messages / elapsed;
+        j["batch_rate"] = batches / elapsed;
+      }
+    }
+    if (received > 0) {
+      j["received"] = received;
+      j["unbatched"] = unbatched;
+    }
+    return j;
+  }
+};
+
+/**
+ * @brief Coalesces payloads into batches, per topic. All methods are
+ * thread-safe.
+ *
+ * Full batches are handed to the sink by the thread that adds the last
+ * payload; batches that reach their latency bound are handed to the sink by
+ * the flusher thread. A batch holding a single payload is handed over as is
+ * (count 1, no record framing), so that it can be sent as a plain message.
+ *
+ * @example
+ * Batcher batcher;
+ * batcher.set_policy("sensors", BatchPolicy{65536, 2ms});
+ * batcher.start([&](const string &topic, string &&body, size_t count) {
+ *   // compress and send body, flagged as batch if count > 1
+ * });
+ * string body = j.dump();
+ * if (!batcher.add("sensors", body))
+ *   // not batched: send body as usual
+ * batcher.stop(); // sends what is pending
+ */
+class Batcher {
+public:
+  using clock = std::chrono::steady_clock;
+  using sink_t =
+      std::function<void(const std::string &topic, std::string &&body,
+                         size_t count)>;
+
+  static constexpr size_t record_header = 4;
+
+  Batcher() = default;
+  Batcher(const Batcher &) = delete;
+  Batcher &operator=(const Batcher &) = delete;
+
+  ~Batcher() { stop(); }
+
+  /**
+   * @brief Sets the batch bounds of a topic (disabled if size is 0).
+   */
+  void set_policy(const std::string &topic, const BatchPolicy &policy) {
+    std::lock_guard lock(_mtx);
+    // Topics are never removed, as the flusher may be iterating over them
+    if (policy.enabled() || _topics.count(topic))
+      _topics[topic].policy = policy;
+  }
+
+  /**
+   * @brief The batch bounds of a topic (disabled if not batched).
+   */
+  BatchPolicy policy(std::string_view topic) const {
+    std::lock_guard lock(_mtx);
+    auto it = _topics.find(topic);
+    return it == _topics.end() ? BatchPolicy{} : it->second.policy;
+  }
+
+  /**
+   * @brief True if any topic is batched.
+   */
+  bool active() const {
+    std::lock_guard lock(_mtx);
+    for (auto const &[topic, st] : _topics) {
+      if (st.policy.enabled())
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * @brief Starts the flusher thread, if any topic is batched.
+   *
+   * @param sink Called with each batch to be sent.
+   */
+  void start(sink_t sink) {
+    std::unique_lock lock(_mtx);
+    _sink = std::move(sink);
+    _stop = false;
+    if (_thread.joinable())
+      return;
+    lock.unlock();
+    if (!active())
+      return;
+    _thread = std::thread([this]() { run(); });
+  }
+
+  /**
+   * @brief Sends all pending batches and stops the flusher thread.
+   */
+  void stop() {
+    {
+      std::lock_guard lock(_mtx);
+      _stop = true;
+    }
+    _cv.notify_one();
+    if (_thread.joinable())
+      _thread.join();
+    flush();
+  }
+
+  /**
+   * @brief Adds an encoded payload to the batch of its topic.
+   *
+   * @param topic The topic.
+   * @param body The encoded payload (copied into the batch).
+   * @return false if the topic is not batched (or batching is stopped).
+   */
+  bool add(std::string_view topic, std::string_view body) {
+    std::unique_lock lock(_mtx);
+    if (_stop || !_sink)
+      return false;
+    auto it = _topics.find(topic);
+    if (it == _topics.end() || !it->second.policy.enabled())
+      return false;
+    topic_state &st = it->second;
+    if (st.count == 0) {
+      st.deadline = clock::now() + st.policy.latency;
+      if (st.stats.batches == 0)
+        st.stats.first = clock::now();
+      _cv.notify_one();
+    }
+    append_record(st.body, body);
+    st.count++;
+    if (st.body.size() < st.policy.size)
+      return true;
+    st.stats.by_size++;
+    emit(it->first, st, lock);
+    return true;
+  }
+
+  /**
+   * @brief Sends all pending batches now.
+   */
+  void flush() {
+    std::unique_lock lock(_mtx);
+    for (auto &[topic, st] : _topics) {
+      if (st.count > 0)
+        emit(topic, st, lock);
+    }
+  }
+
+  /**
+   * @brief Counts a batch received on a topic.
+   */
+  void received(std::string_view topic, size_t count) {
+    std::lock_guard lock(_mtx);
+    auto &st = _rx[std::string(topic)];
+    st.received++;
+    st.unbatched += count;
+  }
+
+  /**
+   * @brief Per-topic batching statistics (sent and received).
+   *
+   * @return A JSON object with one key per topic; empty if no batch was
+   * sent nor received.
+   */
+  nlohmann::json stats() const {
+    std::lock_guard lock(_mtx);
+    nlohmann::json j = nlohmann::json::object();
+    for (auto const &[topic, st] : _topics) {
+      if (st.stats.batches > 0)
+        j[topic] = st.stats.json();
+    }
+    for (auto const &[topic, rx] : _rx) {
+      nlohmann::json r = rx.json();
+      if (r.empty())
+        continue;
+      if (!j.contains(topic))
+        j[topic] = nlohmann::json::object();
+      j[topic].update(r);
+    }
+    return j;
+  }
+
+  /**
+   * @brief Appends a record to a batch body.
+   */
+  static void append_record(std::string &batch, std::string_view payload) {
+    uint32_t len = (uint32_t)payload.size();
+    for (int i = 0; i < 4; i++)
+      batch.push_back((char)((len >> (8 * i)) & 0xFF));
+    batch.append(payload);
+  }
+
+  /**
+   * @brief Splits a batch body into its records.
+   *
+   * @param batch The (decompressed) batch body.
+   * @param records Receives views on the records of batch.
+   * @throws std::runtime_error if the batch is truncated.
+   */
+  static void split(std::string_view batch,
+                    std::vector<std::string_view> &records) {
+    records.clear();
+    size_t pos = 0;
+    while (pos < batch.size()) {
+      if (batch.size() - pos < record_header)
+        throw std::runtime_error("Truncated batch record header");
+      const unsigned char *p = (const unsigned char *)batch.data() + pos;
+      size_t len = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+      pos += record_header;
+      if (len > batch.size() - pos)
+        throw std::runtime_error("Truncated batch record");
+      records.push_back(batch.substr(pos, len));
+      pos += len;
+    }
+  }
+
+private:
+  struct topic_state {
+    BatchPolicy policy;
+    std::string body;
+    size_t count = 0;
+    clock::time_point deadline;
+    BatchStats stats;
+  };
+
+  // Hands the batch to the sink, without holding the lock. The emit mutex
+  // is taken before releasing the lock, so that batches of the same topic
+  // reach the sink in order.
+  void emit(const std::string &topic, topic_state &st,
+            std::unique_lock<std::mutex> &lock) {
+    std::string body;
+    body.reserve(st.policy.size + st.policy.size / 8);
+    body.swap(st.body);
+    size_t count = st.count;
+    st.count = 0;
+    st.stats.batches++;
+    st.stats.messages += count;
+    st.stats.bytes += body.size();
+    st.stats.last = clock::now();
+    if (count == 1)
+      body.erase(0, record_header);
+    std::string name = topic;
+    std::unique_lock emit_lock(_emit_mtx);
+    lock.unlock();
+    _sink(name, std::move(body), count);
+    emit_lock.unlock();
+    lock.lock();
+  }
+
+  void run() {
+    std::unique_lock lock(_mtx);
+    while (!_stop) {
+      auto now = clock::now();
+      auto next = clock::time_point::max();
+      for (auto &[topic, st] : _topics) {
+        if (st.count == 0)
+          continue;
+        if (st.deadline <= now) {
+          emit(topic, st, lock);
+          now = clock::now();
+        } else if (st.deadline < next) {
+          next = st.deadline;
+        }
+      }
+      if (next == clock::time_point::max())
+        _cv.wait(lock);
+      else
+        _cv.wait_until(lock, next);
+    }
+  }
+
+  mutable std::mutex _mtx;
+  std::mutex _emit_mtx;
+  std::condition_variable _cv;
+  std::thread _thread;
+  bool _stop = false;
+  sink_t _sink;
+  std::map<std::string, topic_state, std::less<>> _topics;
+  std::map<std::string, BatchStats, std::less<>> _rx;
+};
+
+} // namespace Mads
+
+#endif // BATCH_HPP
@@ -54,35 +54,73 @@ public:
    * publish the message, otherwise the default topic will be used. 
    * This allowas a single CLI client to publish to multiple topics.
    * 
-   * @note This function is blocking. 
+   * @note This function is blocking (see route_input() for the non-blocking
+   * version). 
    */
   void route() {
-    message message;
-    string payload, compressed;
-    regex re("^(\\w+):\\s*(\\{.*\\})\\s*$");
-    smatch match;
-    json j;
+    string payload;
     while (getline(cin, payload)) {
-      if (payload == "exit") {
-        Mads::running = false;
+      if (!route_line(payload))
         break;
-      }
-      if (regex_search(payload, match, re) && match.size() > 1) {
-        _pub_topic = match[1];
-        payload = match[2];
-      }
-      cout << "Topic: " << _pub_topic << ", Payload: " << payload << endl;
-      try {
-        j = json::parse(payload);
-        publish(j, _pub_topic);
-      } catch (const std::exception &e) {
-        cerr << "Failed to parse JSON: " << e.what() << endl;
-        continue;
+    }
+  }
+
+#ifndef _WIN32
+  /**
+   * @brief Routes the lines available on STDIN, without blocking: to be
+   * called by the reactor when STDIN is readable. Incomplete lines are kept
+   * until the rest is available.
+   *
+   * @return false at the end of input, or after the "exit" line.
+   */
+  bool route_input() {
+    char buffer[4096];
+    ssize_t length = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (length < 0)
+      return errno == EINTR || errno == EAGAIN;
+    if (length == 0) {
+      if (!_input.empty())
+        route_line(exchange(_input, string()));
+      return false;
+    }
+    _input.append(buffer, length);
+    size_t start = 0, end;
+    while ((end = _input.find('\n', start)) != string::npos) {
+      string line = _input.substr(start, end - start);
+      start = end + 1;
+      if (!route_line(line)) {
+        _input.clear();
+        return false;
       }
     }
+    _input.erase(0, start);
+    return true;
   }
+#endif
 
 private:
+  // Publishes a line, returns false on "exit"
+  bool route_line(string payload) {
+    smatch match;
+    json j;
+    if (payload == "exit") {
+      Mads::running = false;
+      return false;
+    }
+    if (regex_search(payload, match, _topic_re) && match.size() > 1) {
+      _pub_topic = match[1];
+      payload = match[2];
+    }
+    cout << "Topic: " << _pub_topic << ", Payload: " << payload << endl;
+    try {
+      j = json::parse(payload);
+      publish(j, _pub_topic);
+    } catch (const std::exception &e) {
+      cerr << "Failed to parse JSON: " << e.what() << endl;
+    }
+    return true;
+  }
+
   /**
    * @brief Loads the settings for the Bridge.
    *
@@ -93,6 +131,8 @@ private:
     // NONE
   }
 
+  regex _topic_re{"^(\\w+):\\s*(\\{.*\\})\\s*$"};
+  string _input; // Partial line read from STDIN
 };
 
 } // namespace Mads
@@ -0,0 +1,635 @@
+/*
+   ____                                        _
+  / ___|___  _ __ ___  _ __  _ __ ___  ___ ___(_) ___  _ __
+ | |   / _ \| '_ ` _ \| '_ \| '__/ _ \/ __/ __| |/ _ \| '_ \
+ | |__| (_) | | | | | | |_) | | |  __/\__ \__ \ | (_) | | | |
+  \____\___/|_| |_| |_| .__/|_|  \___||___/___/_|\___/|_| |_|
+                      |_|
+
+Per-topic compression of payloads. Each topic has a policy (codec, size
+threshold, level, optional zstd dictionary) and statistics. zstd dictionaries
+are trained (in the background) from the first messages published on a
+topic, and then periodically sent in-band on the same topic as dictionary
+frames, so that receivers can decode them.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include "wire.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <lz4.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <snappy.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <zdict.h>
+#include <zstd.h>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Compression policy of a topic.
+ *
+ * Payloads shorter than threshold are sent uncompressed, as are payloads that
+ * do not shrink. level is the zstd compression level, or the LZ4 acceleration
+ * (0 means the codec default). Dictionaries are only supported by zstd.
+ */
+struct CompressionPolicy {
+  wire_codec codec = wire_codec::none;
+  size_t threshold = 0;
+  int level = 0;
+  bool blobs = false;
+  bool dictionary = false;
+  size_t dict_samples = 1000;
+  size_t dict_size = 16 * 1024;
+
+  /**
+   * @brief Loads the policy from a settings table, keeping current values
+   * as defaults.
+   *
+   * @param cfg A toml node view (e.g. _config["compression"]).
+   * @throws std::invalid_argument on unknown codec.
+   */
+  template <typename Node> void load(Node &&cfg) {
+    codec = wire_codec_from(cfg["codec"].value_or(wire_codec_map.at(codec)));
+    threshold = cfg["threshold"].value_or(threshold);
+    level = cfg["level"].value_or(level);
+    blobs = cfg["blobs"].value_or(blobs);
+    dictionary = cfg["dictionary"].value_or(dictionary);
+    dict_samples = cfg["dict_samples"].value_or(dict_samples);
+    dict_size = cfg["dict_size"].value_or(dict_size);
+    if (dictionary && codec != wire_codec::zstd)
+      throw std::invalid_argument("Dictionaries require the zstd codec");
+  }
+
+  nlohmann::json json() const {
+    nlohmann::json j = {{"codec", wire_codec_map.at(codec)},
+                        {"threshold", threshold}};
+    if (level != 0)
+      j["level"] = level;
+    if (blobs)
+      j["blobs"] = blobs;
+    if (dictionary)
+      j["dictionary"] = dict_size;
+    return j;
+  }
+};
+
+/**
+ * @brief Compression statistics of a topic.
+ *
+ * Times are cumulative, in seconds. The ratio is computed on the published
+ * messages, including those sent uncompressed.
+ */
+struct CompressionStats {
+  uint64_t published = 0;
+  uint64_t compressed = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  double compress_time = 0;
+  uint64_t received = 0;
+  double decompress_time = 0;
+  uint64_t undecodable = 0;
+
+  double ratio() const {
+    return bytes_out > 0 ? (double)bytes_in / bytes_out : 1.0;
+  }
+
+  nlohmann::json json() const {
+    nlohmann::json j;
+    if (published > 0) {
+      j["published"] = published;
+      j["compressed"] = compressed;
+      j["bytes_in"] = bytes_in;
+      j["bytes_out"] = bytes_out;
+      j["ratio"] = ratio();
+      j["compress_time"] = compress_time;
+    }
+    if (received > 0) {
+      j["received"] = received;
+      j["decompress_time"] = decompress_time;
+    }
+    if (undecodable > 0)
+      j["undecodable"] = undecodable;
+    return j;
+  }
+};
+
+/**
+ * @brief Compresses and decompresses payloads according to per-topic
+ * policies. All methods are thread-safe.
+ *
+ * Only the bookkeeping (policies, statistics, dictionaries) is under a lock:
+ * compression and decompression run concurrently, each thread with its own
+ * zstd contexts, and dictionaries are trained in a background thread while
+ * messages keep being compressed without them.
+ *
+ * @example
+ * Compressor comp;
+ * CompressionPolicy p;
+ * p.codec = wire_codec::zstd;
+ * p.threshold = 64;
+ * comp.set_policy("sensors", p);
+ * string dict_frame;
+ * string frame = comp.pack("sensors", wire_encoding::json, j.dump(),
+ *                           &dict_frame);
+ * if (!dict_frame.empty()) {
+ *   // send dict_frame, then frame, then:
+ *   comp.announced("sensors", true);
+ * }
+ */
+class Compressor {
+public:
+  using clock = std::chrono::steady_clock;
+
+  // Decompression dictionaries kept per topic, e.g. one for each publisher
+  // of the topic, plus the previous one of a publisher that just retrained
+  static constexpr size_t max_dictionaries = 8;
+
+  Compressor() = default;
+
+  Compressor(const Compressor &) = delete;
+  Compressor &operator=(const Compressor &) = delete;
+
+  ~Compressor() {
+    for (auto &t : _trainers)
+      t.join();
+    for (auto &[topic, st] : _topics)
+      ZSTD_freeCDict(st.cdict);
+  }
+
+  /**
+   * @brief Sets the policy for topics without a specific one.
+   */
+  void set_default(const CompressionPolicy &policy) {
+    std::lock_guard lock(_mtx);
+    _default = policy;
+    for (auto &[topic, st] : _topics) {
+      if (!_policies.count(topic))
+        st.policy = policy;
+    }
+  }
+
+  const CompressionPolicy &default_policy() const { return _default; }
+
+  /**
+   * @brief Sets the policy for a given topic.
+   */
+  void set_policy(const std::string &topic, const CompressionPolicy &policy) {
+    std::lock_guard lock(_mtx);
+    _policies[topic] = policy;
+    auto it = _topics.find(topic);
+    if (it != _topics.end())
+      it->second.policy = policy;
+  }
+
+  const std::map<std::string, CompressionPolicy, std::less<>> &
+  policies() const {
+    return _policies;
+  }
+
+  /**
+   * @brief Sets how often a trained dictionary is sent again, for the
+   * benefit of late subscribers.
+   */
+  void set_dict_interval(std::chrono::milliseconds interval) {
+    _dict_interval = interval;
+  }
+
+  /**
+   * @brief Sets the maximum size of a decompressed payload: larger declared
+   * sizes are rejected as corrupted, rather than allocated.
+   */
+  void set_max_size(size_t bytes) { _max_size = bytes; }
+  size_t max_size() const { return _max_size; }
+
+  /**
+   * @brief True if any topic may be compressed.
+   */
+  bool active() const {
+    if (_default.codec != wire_codec::none)
+      return true;
+    for (auto const &[topic, p] : _policies) {
+      if (p.codec != wire_codec::none)
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * @brief Builds the payload frame of a message.
+   *
+   * A newly trained dictionary is only used by the message that carries its
+   * first dictionary frame, and then by all messages packed after the caller
+   * has confirmed with announced() that the two frames are queued: messages
+   * packed meanwhile by other threads cannot overtake the dictionary.
+   *
+   * @param topic The topic.
+   * @param encoding The encoding of body.
+   * @param body The encoded payload.
+   * @param dict_frame If not null, receives a dictionary frame that must be
+   * sent on the same topic before the payload (empty if not needed).
+   * @param batch True if body is a batch of payloads (see batch.hpp).
+   * @return The frame. Uncompressed JSON text is sent without header.
+   */
+  std::string pack(std::string_view topic, wire_encoding encoding,
+                   std::string body, std::string *dict_frame = nullptr,
+                   bool batch = false) {
+    auto t0 = clock::now();
+    if (dict_frame)
+      dict_frame->clear();
+    CompressionPolicy policy;
+    const ZSTD_CDict *cdict = nullptr;
+    bool eligible;
+    {
+      std::lock_guard lock(_mtx);
+      topic_state &st = state(topic);
+      policy = st.policy;
+      eligible = policy.codec != wire_codec::none &&
+                 body.size() >= policy.threshold;
+      if (eligible && policy.dictionary) {
+        sample(st, body, dict_frame);
+        if (st.announced || (dict_frame && !dict_frame->empty()))
+          cdict = st.cdict;
+      }
+    }
+    size_t in = body.size();
+    std::string frame;
+    wire::write_header(frame, encoding, policy.codec, batch);
+    bool compressed = eligible && compress(policy, cdict, body, frame);
+    if (!compressed) {
+      if (encoding == wire_encoding::json && !batch) {
+        frame = std::move(body);
+      } else {
+        frame[3] = (char)wire_codec::none;
+        frame.resize(wire::header_size);
+        frame.append(body);
+      }
+    }
+    std::lock_guard lock(_mtx);
+    topic_state &st = state(topic);
+    if (compressed) {
+      st.stats.compressed++;
+      st.stats.compress_time +=
+          std::chrono::duration<double>(clock::now() - t0).count();
+    }
+    if (dict_frame)
+      st.stats.bytes_out += dict_frame->size();
+    st.stats.published++;
+    st.stats.bytes_in += in;
+    st.stats.bytes_out += frame.size();
+    return frame;
+  }
+
+  /**
+   * @brief Confirms that a dictionary frame returned by pack() has been
+   * queued, ahead of its payload.
+   *
+   * @param topic The topic.
+   * @param sent False if the frames were dropped: the dictionary is then
+   * sent again with the next message.
+   */
+  void announced(std::string_view topic, bool sent) {
+    std::lock_guard lock(_mtx);
+    topic_state &st = state(topic);
+    if (sent)
+      st.announced = true;
+    else
+      st.dict_sent = clock::time_point();
+  }
+
+  /**
+   * @brief Compresses blob data, if the topic policy says so.
+   *
+   * @param topic The topic.
+   * @param data The blob.
+   * @param out Receives the compressed data.
+   * @return The codec used (none if data must be sent as is).
+   */
+  wire_codec pack_blob(std::string_view topic, std::string_view data,
+                       std::string &out) {
+    CompressionPolicy policy;
+    {
+      std::lock_guard lock(_mtx);
+      policy = state(topic).policy;
+    }
+    wire_codec codec = policy.codec;
+    auto t0 = clock::now();
+    out.clear();
+    if (!policy.blobs || codec == wire_codec::none ||
+        data.size() < policy.threshold || !compress(policy, nullptr, data, out))
+      codec = wire_codec::none;
+    std::lock_guard lock(_mtx);
+    topic_state &st = state(topic);
+    if (codec != wire_codec::none) {
+      st.stats.compressed++;
+      st.stats.compress_time +=
+          std::chrono::duration<double>(clock::now() - t0).count();
+    }
+    st.stats.published++;
+    st.stats.bytes_in += data.size();
+    st.stats.bytes_out += codec == wire_codec::none ? data.size() : out.size();
+    return codec;
+  }
+
+  /**
+   * @brief Decompresses a payload body.
+   *
+   * @param topic The topic.
+   * @param codec The codec.
+   * @param data The compressed body.
+   * @param out Receives the decompressed body.
+   * @return false if the zstd dictionary is not (yet) known.
+   * @throws std::runtime_error if data are corrupted, or declare a size
+   * larger than max_size().
+   */
+  bool unpack(std::string_view topic, wire_codec codec, std::string_view data,
+              std::string &out) {
+    auto t0 = clock::now();
+    switch (codec) {
+    case wire_codec::none:
+      out.assign(data);
+      break;
+    case wire_codec::snappy: {
+      size_t len;
+      if (!snappy::GetUncompressedLength(data.data(), data.size(), &len))
+        throw std::runtime_error("Corrupted snappy payload");
+      check_size(len);
+      if (!snappy::Uncompress(data.data(), data.size(), &out))
+        throw std::runtime_error("Corrupted snappy payload");
+      break;
+    }
+    case wire_codec::lz4: {
+      uint32_t len;
+      if (data.size() < sizeof(len))
+        throw std::runtime_error("Corrupted LZ4 payload");
+      memcpy(&len, data.data(), sizeof(len));
+      check_size(len);
+      out.resize(len);
+      int n = LZ4_decompress_safe(data.data() + sizeof(len), out.data(),
+                                  data.size() - sizeof(len), len);
+      if (n < 0 || (uint32_t)n != len)
+        throw std::runtime_error("Corrupted LZ4 payload");
+      break;
+    }
+    case wire_codec::zstd: {
+      unsigned long long len =
+          ZSTD_getFrameContentSize(data.data(), data.size());
+      if (len == ZSTD_CONTENTSIZE_ERROR || len == ZSTD_CONTENTSIZE_UNKNOWN)
+        throw std::runtime_error("Corrupted zstd payload");
+      check_size(len);
+      std::shared_ptr<ZSTD_DDict> ddict; // Kept alive, even if evicted
+      unsigned id = ZSTD_getDictID_fromFrame(data.data(), data.size());
+      if (id != 0) {
+        std::lock_guard lock(_mtx);
+        auto it = _ddicts.find(id);
+        if (it != _ddicts.end() && !(ddict = it->second.lock()))
+          _ddicts.erase(it); // Evicted while in use
+        if (!ddict) {
+          state(topic).stats.undecodable++;
+          return false;
+        }
+      }
+      out.resize(len);
+      ZSTD_DCtx *dctx = contexts().dctx;
+      size_t n = ddict ? ZSTD_decompress_usingDDict(dctx, out.data(), len,
+                                                    data.data(), data.size(),
+                                                    ddict.get())
+                       : ZSTD_decompressDCtx(dctx, out.data(), len,
+                                             data.data(), data.size());
+      if (ZSTD_isError(n))
+        throw std::runtime_error(std::string("Corrupted zstd payload: ") +
+                                 ZSTD_getErrorName(n));
+      break;
+    }
+    default:
+      throw std::runtime_error("Not a compressed payload");
+    }
+    std::lock_guard lock(_mtx);
+    topic_state &st = state(topic);
+    st.stats.received++;
+    st.stats.decompress_time +=
+        std::chrono::duration<double>(clock::now() - t0).count();
+    return true;
+  }
+
+  /**
+   * @brief Registers a zstd dictionary received in a dictionary frame.
+   * Only the last max_dictionaries of each topic are kept: payloads
+   * compressed with older ones are undecodable until their dictionary is
+   * sent again.
+   *
+   * @param topic The topic of the dictionary frame.
+   * @param dict The dictionary (frame without header).
+   */
+  void add_dictionary(std::string_view topic, std::string_view dict) {
+    std::lock_guard lock(_mtx);
+    register_ddict(state(topic), dict);
+  }
+
+  /**
+   * @brief Per-topic statistics and policies.
+   *
+   * @return A JSON object with one key per topic (topics never compressed
+   * nor decompressed are omitted).
+   */
+  nlohmann::json stats() const {
+    std::lock_guard lock(_mtx);
+    nlohmann::json j = nlohmann::json::object();
+    for (auto const &[topic, st] : _topics) {
+      if (st.policy.codec == wire_codec::none && st.stats.received == 0 &&
+          st.stats.undecodable == 0)
+        continue; // No compression on this topic
+      j[topic] = st.stats.json();
+      if (st.stats.published > 0)
+        j[topic]["policy"] = st.policy.json();
+      if (!st.dict.empty())
+        j[topic]["dict_id"] = ZSTD_getDictID_fromDict(st.dict.data(),
+                                                      st.dict.size());
+    }
+    return j;
+  }
+
+private:
+  struct topic_state {
+    CompressionPolicy policy;
+    CompressionStats stats;
+    std::string samples;
+    std::vector<size_t> sample_sizes;
+    bool trained = false;   // Training started
+    bool announced = false; // First dictionary frame queued
+    std::string dict;
+    ZSTD_CDict *cdict = nullptr;
+    clock::time_point dict_sent;
+    std::deque<std::shared_ptr<ZSTD_DDict>> ddicts; // Most recent last
+  };
+
+  // zstd contexts cannot be shared among threads: each one has its own
+  struct zstd_contexts {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ~zstd_contexts() {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+    }
+  };
+
+  static zstd_contexts &contexts() {
+    thread_local zstd_contexts ctx;
+    return ctx;
+  }
+
+  void check_size(unsigned long long len) const {
+    if (len > _max_size)
+      throw std::runtime_error("Declared payload size " + std::to_string(len) +
+                               " exceeds the maximum of " +
+                               std::to_string(_max_size) + " bytes");
+  }
+
+  // Under lock
+  topic_state &state(std::string_view topic) {
+    auto it = _topics.find(topic);
+    if (it == _topics.end()) {
+      it = _topics.emplace(std::string(topic), topic_state{}).first;
+      auto p = _policies.find(topic);
+      it->second.policy = p == _policies.end() ? _default : p->second;
+    }
+    return it->second;
+  }
+
+  // Appends the compressed data to out; false if it does not pay off
+  static bool compress(const CompressionPolicy &policy,
+                       const ZSTD_CDict *cdict, std::string_view in,
+                       std::string &out) {
+    size_t offset = out.size(), n = 0;
+    switch (policy.codec) {
+    case wire_codec::snappy:
+      out.resize(offset + snappy::MaxCompressedLength(in.size()));
+      snappy::RawCompress(in.data(), in.size(), out.data() + offset, &n);
+      break;
+    case wire_codec::lz4: {
+      uint32_t len = in.size();
+      int bound = LZ4_compressBound(in.size());
+      out.resize(offset + sizeof(len) + bound);
+      memcpy(out.data() + offset, &len, sizeof(len));
+      int r = LZ4_compress_fast(in.data(), out.data() + offset + sizeof(len),
+                                in.size(), bound, std::max(policy.level, 1));
+      n = r > 0 ? r + sizeof(len) : 0;
+      break;
+    }
+    case wire_codec::zstd: {
+      size_t bound = ZSTD_compressBound(in.size());
+      out.resize(offset + bound);
+      ZSTD_CCtx *cctx = contexts().cctx;
+      if (cdict)
+        n = ZSTD_compress_usingCDict(cctx, out.data() + offset, bound,
+                                     in.data(), in.size(), cdict);
+      else
+        n = ZSTD_compressCCtx(cctx, out.data() + offset, bound, in.data(),
+                              in.size(), policy.level);
+      if (ZSTD_isError(n))
+        n = 0;
+      break;
+    }
+    default:
+      break;
+    }
+    out.resize(offset + n);
+    return n > 0 && n < in.size();
+  }
+
+  // Collects samples, starts the training and schedules the transmission of
+  // the dictionary (under lock). zstd suggests about 100 times the
+  // dictionary size of samples.
+  void sample(topic_state &st, std::string_view body,
+              std::string *dict_frame) {
+    if (!st.trained) {
+      st.samples.append(body);
+      st.sample_sizes.push_back(body.size());
+      if (st.sample_sizes.size() < st.policy.dict_samples &&
+          st.samples.size() < 100 * st.policy.dict_size)
+        return;
+      st.trained = true;
+      _trainers.emplace_back(&Compressor::train, this, &st,
+                             std::move(st.samples),
+                             std::move(st.sample_sizes), st.policy);
+      st.samples = std::string();
+      st.sample_sizes = std::vector<size_t>();
+      return;
+    }
+    if (st.cdict && dict_frame &&
+        clock::now() - st.dict_sent >= _dict_interval) {
+      wire::write_header(*dict_frame, wire_encoding::json,
+                         wire_codec::dictionary);
+      dict_frame->append(st.dict);
+      st.dict_sent = clock::now();
+    }
+  }
+
+  // Runs in its own thread; topic states are never erased, so st is stable
+  void train(topic_state *st, std::string samples, std::vector<size_t> sizes,
+             CompressionPolicy policy) {
+    std::string dict(policy.dict_size, '\0');
+    size_t n = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(),
+                                     sizes.data(), sizes.size());
+    if (ZDICT_isError(n))
+      return; // Not enough (or too uniform) samples: go on without dictionary
+    dict.resize(n);
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict.data(), dict.size(), policy.level);
+    std::lock_guard lock(_mtx);
+    st->dict = std::move(dict);
+    st->cdict = cdict;
+    st->dict_sent = clock::time_point();
+    register_ddict(*st, st->dict); // to decode our own messages
+  }
+
+  // Under lock. Topics own their dictionaries; _ddicts finds them by id
+  // while any topic holds them
+  void register_ddict(topic_state &st, std::string_view dict) {
+    unsigned id = ZSTD_getDictID_fromDict(dict.data(), dict.size());
+    if (id == 0)
+      return;
+    for (auto const &d : st.ddicts) {
+      if (ZSTD_getDictID_fromDDict(d.get()) == id)
+        return;
+    }
+    auto ddict = _ddicts[id].lock();
+    if (!ddict) {
+      ddict.reset(ZSTD_createDDict(dict.data(), dict.size()),
+                  ZSTD_freeDDict);
+      _ddicts[id] = ddict;
+    }
+    st.ddicts.push_back(std::move(ddict));
+    while (st.ddicts.size() > max_dictionaries) {
+      unsigned old = ZSTD_getDictID_fromDDict(st.ddicts.front().get());
+      st.ddicts.pop_front();
+      if (_ddicts[old].expired())
+        _ddicts.erase(old);
+    }
+  }
+
+  mutable std::mutex _mtx;
+  CompressionPolicy _default;
+  std::map<std::string, CompressionPolicy, std::less<>> _policies;
+  std::map<std::string, topic_state, std::less<>> _topics;
+  std::map<unsigned, std::weak_ptr<ZSTD_DDict>> _ddicts;
+  std::vector<std::thread> _trainers; // At most one per topic
+  std::chrono::milliseconds _dict_interval{5000};
+  size_t _max_size = 64 * 1024 * 1024;
+};
+
+} // namespace Mads
+
+#endif // COMPRESSION_HPP
@@ -0,0 +1,483 @@
+/*
+  _____        _                _   _
+ |  ___|__  __| | ___ _ __ __ _| |_(_) ___  _ __
+ | |_ / _ \/ _` |/ _ \ '__/ _` | __| |/ _ \| '_ \
+ |  _|  __/ (_| |  __/ | | (_| | |_| | (_) | | | |
+ |_|  \___|\__,_|\___|_|  \__,_|\__|_|\___/|_| |_|
+
+Broker-to-broker federation. A broker can serve its traffic to other brokers
+on a federation endpoint (XPUB), and pull selected topic prefixes from the
+federation endpoints of other brokers (links), injecting the messages into
+its own frontend. Messages cross the links without being decoded.
+
+On the link, each message is [topic, envelope, body]:
+- envelope: "\0MF", version (u8), message count (u32, little endian)
+- body: a payload frame (see wire.hpp) holding a batch of records (see
+  batch.hpp), possibly compressed; each record is itself a batch of records:
+  first hops (u8) and origin broker name, then the frames of the message
+
+A message is dropped when it comes back to its origin, or when it has
+crossed more than max_hops links. A link can also point to the plain backend
+of a broker (e.g. an older one): its messages are forwarded as they are,
+with the link name as origin.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef FEDERATION_HPP
+#define FEDERATION_HPP
+
+#include "batch.hpp"
+#include "compression.hpp"
+#include "wire.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <toml++/toml.hpp>
+
+namespace Mads {
+
+/**
+ * @brief A link to another broker: its federation endpoint (or backend),
+ * and the topic prefixes pulled from it (all if empty).
+ */
+struct FederationLink {
+  std::string name;
+  std::string address;
+  std::vector<std::string> topics;
+
+  bool operator==(const FederationLink &other) const = default;
+};
+
+/**
+ * @brief Federation settings, from the [broker.federation] table.
+ *
+ * - name: origin id of this broker (default: the hostname)
+ * - address: federation endpoint served to other brokers (empty: none)
+ * - batch_size, batch_latency: batching of the messages sent on the
+ *   endpoint, in bytes and ms (size 0 disables batching)
+ * - compression: codec of the messages sent on the endpoint (none, snappy,
+ *   lz4, zstd), with compression_level
+ * - max_hops: messages that crossed more links are dropped
+ * - [broker.federation.links]: name = { address = "...", topics = [...] },
+ *   one for each broker to pull from
+ */
+struct FederationSettings {
+  FederationSettings() = default;
+
+  /**
+   * @brief Reads the settings from a table (may be null).
+   *
+   * @param t The [broker.federation] table.
+   * @param hostname The default name.
+   * @throws std::invalid_argument on invalid settings.
+   */
+  FederationSettings(const toml::table *t, const std::string &hostname)
+      : name(hostname) {
+    if (!t)
+      return;
+    name = (*t)["name"].value_or(name);
+    address = (*t)["address"].value_or("");
+    int64_t size = (*t)["batch_size"].value_or(65536);
+    int64_t latency = (*t)["batch_latency"].value_or(2);
+    if (size < 0 || latency < 1)
+      throw std::invalid_argument(
+          "batch_size must be positive and batch_latency at least 1 ms");
+    batch = {(size_t)size, std::chrono::milliseconds(latency)};
+    codec = wire_codec_from((*t)["compression"].value_or("none"));
+    level = (*t)["compression_level"].value_or(0);
+    int64_t hops = (*t)["max_hops"].value_or(4);
+    if (hops < 1 || hops > 255)
+      throw std::invalid_argument("max_hops must be between 1 and 255");
+    max_hops = (uint8_t)hops;
+    if (name.empty() || name.size() > 255)
+      throw std::invalid_argument("name must have 1 to 255 characters");
+    auto links_table = (*t)["links"].as_table();
+    if (!links_table)
+      return;
+    for (auto &&[key, node] : *links_table) {
+      auto lt = node.as_table();
+      if (!lt || !(*lt)["address"].is_string())
+        throw std::invalid_argument("link " + std::string(key.str()) +
+                                    " has no address");
+      FederationLink link{std::string(key.str()),
+                          (*lt)["address"].value_or(""),
+                          {}};
+      if (auto a = (*lt)["topics"].as_array()) {
+        a->for_each(
+            [&](auto &&el) { link.topics.push_back(el.value_or("")); });
+      }
+      links.push_back(std::move(link));
+    }
+  }
+
+  bool operator==(const FederationSettings &other) const = default;
+
+  bool enabled() const { return !address.empty() || !links.empty(); }
+
+  std::string name;
+  std::string address;
+  BatchPolicy batch{65536, std::chrono::milliseconds(2)};
+  wire_codec codec = wire_codec::none;
+  int level = 0;
+  uint8_t max_hops = 4;
+  std::vector<FederationLink> links;
+};
+
+/**
+ * @brief Federation counters, of the endpoint or of a link. Thread-safe.
+ */
+struct FederationStats {
+  std::atomic<uint64_t> messages = 0; // Sent, or forwarded to the frontend
+  std::atomic<uint64_t> batches = 0;  // Sent or received
+  std::atomic<uint64_t> bytes = 0;    // On the link
+  std::atomic<uint64_t> looped = 0;   // Dropped, back to their origin
+  std::atomic<uint64_t> expired = 0;  // Dropped, over max_hops
+  std::atomic<uint64_t> invalid = 0;  // Undecodable
+
+  nlohmann::json json() const {
+    return {{"messages", messages.load()}, {"batches", batches.load()},
+            {"bytes", bytes.load()},       {"looped", looped.load()},
+            {"expired", expired.load()},   {"invalid", invalid.load()}};
+  }
+};
+
+namespace federation {
+
+static constexpr char magic[] = {'\0', 'M', 'F'};
+static constexpr uint8_t version = 1;
+static constexpr size_t envelope_size = sizeof(magic) + 1 + 4;
+
+inline std::string write_envelope(uint32_t count) {
+  std::string e(magic, sizeof(magic));
+  e.push_back((char)version);
+  for (int i = 0; i < 4; i++)
+    e.push_back((char)((count >> (8 * i)) & 0xFF));
+  return e;
+}
+
+/**
+ * @brief Reads the envelope frame of a federation message.
+ *
+ * @return false if frame is not an envelope (e.g. a payload from a plain
+ * backend).
+ */
+inline bool read_envelope(std::string_view frame, uint32_t &count) {
+  if (frame.size() != envelope_size ||
+      frame.substr(0, sizeof(magic)) != std::string_view(magic, sizeof(magic)))
+    return false;
+  if ((uint8_t)frame[3] != version)
+    throw std::invalid_argument("Unknown federation version " +
+                                std::to_string((uint8_t)frame[3]));
+  auto p = (const unsigned char *)frame.data() + 4;
+  count = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  return true;
+}
+
+/**
+ * @brief Identifies a message, to recognize it when it comes back from the
+ * frontend.
+ */
+inline uint64_t fingerprint(std::string_view topic,
+                            const std::vector<std::string_view> &frames) {
+  std::hash<std::string_view> hash;
+  uint64_t h = hash(topic);
+  for (auto const &f : frames)
+    h = h * 0x100000001b3ull ^ hash(f);
+  return h;
+}
+
+} // namespace federation
+
+/**
+ * @brief Origins of the messages injected into the frontend by the links,
+ * so that the endpoint sends them on with their origin and hops, rather
+ * than as local messages. Bounded, thread-safe.
+ */
+class FederationLedger {
+public:
+  explicit FederationLedger(size_t capacity = 65536) : _capacity(capacity) {}
+
+  void add(uint64_t fingerprint, std::string_view origin, uint8_t hops) {
+    std::lock_guard lock(_mtx);
+    uint64_t seq = _seq++;
+    _entries.emplace(fingerprint, entry{std::string(origin), hops, seq});
+    _order.emplace_back(fingerprint, seq);
+    while (_order.size() > _capacity) {
+      auto [fp, s] = _order.front();
+      _order.pop_front();
+      auto range = _entries.equal_range(fp);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.seq == s) {
+          _entries.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  /**
+   * @brief Takes the origin of a message, if injected by a link.
+   *
+   * @return false for local messages.
+   */
+  bool take(uint64_t fingerprint, std::string &origin, uint8_t &hops) {
+    std::lock_guard lock(_mtx);
+    auto it = _entries.find(fingerprint);
+    if (it == _entries.end())
+      return false;
+    origin = std::move(it->second.origin);
+    hops = it->second.hops;
+    _entries.erase(it);
+    return true;
+  }
+
+  bool empty() const {
+    std::lock_guard lock(_mtx);
+    return _entries.empty();
+  }
+
+private:
+  struct entry {
+    std::string origin;
+    uint8_t hops;
+    uint64_t seq;
+  };
+  mutable std::mutex _mtx;
+  std::unordered_multimap<uint64_t, entry> _entries;
+  std::deque<std::pair<uint64_t, uint64_t>> _order;
+  size_t _capacity;
+  uint64_t _seq = 0;
+};
+
+/**
+ * @brief Packs the messages of the frontend for the federation endpoint.
+ * Not thread-safe: add(), subscription() and flush() must be called from
+ * the same thread, which also runs the sender.
+ *
+ * @example
+ * FederationExporter exporter(settings, ledger,
+ *   [&](const string &topic, string &&envelope, string &&body) {...});
+ * exporter.subscription(xpub_frame); // on subscription messages
+ * if (exporter.wanted(topic))
+ *   exporter.add(topic, frames);     // on backend messages
+ * exporter.flush();                  // every batch latency
+ */
+class FederationExporter {
+public:
+  using sender_t = std::function<void(
+      const std::string &topic, std::string &&envelope, std::string &&body)>;
+
+  FederationExporter(const FederationSettings &settings,
+                     FederationLedger &ledger, sender_t sender)
+      : _name(settings.name), _batch(settings.batch), _ledger(ledger),
+        _sender(std::move(sender)) {
+    CompressionPolicy policy;
+    policy.codec = settings.codec;
+    policy.level = settings.level;
+    policy.threshold = 64;
+    _compressor.set_default(policy);
+    // Batches are emitted by add() and flush(), in the calling thread
+    _batcher.start([this](const std::string &topic, std::string &&body,
+                          size_t count) {
+      if (count == 1) {
+        std::string record;
+        Batcher::append_record(record, body);
+        body.swap(record);
+      }
+      send(topic, std::move(body), count);
+    });
+  }
+
+  /**
+   * @brief Handles a subscription message of the endpoint (XPUB).
+   */
+  void subscription(std::string_view frame) {
+    if (frame.empty())
+      return;
+    std::string prefix(frame.substr(1));
+    if (frame[0] == 1) {
+      _prefixes[prefix]++;
+    } else if (frame[0] == 0) {
+      auto it = _prefixes.find(prefix);
+      if (it != _prefixes.end() && --it->second == 0)
+        _prefixes.erase(it);
+    }
+  }
+
+  /**
+   * @brief True if some broker pulls the topic.
+   */
+  bool wanted(std::string_view topic) const {
+    for (auto const &[prefix, n] : _prefixes) {
+      if (topic.substr(0, prefix.size()) == prefix)
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * @brief Packs a message, and sends it unless batched.
+   */
+  void add(std::string_view topic,
+           const std::vector<std::string_view> &frames) {
+    std::string origin;
+    uint8_t hops = 0;
+    if (_ledger.empty() ||
+        !_ledger.take(federation::fingerprint(topic, frames), origin, hops))
+      origin = _name;
+    _record.clear();
+    std::string meta(1, (char)hops);
+    meta += origin;
+    Batcher::append_record(_record, meta);
+    for (auto const &f : frames)
+      Batcher::append_record(_record, f);
+    _stats.messages++;
+    if (_batch.enabled()) {
+      _batcher.set_policy(std::string(topic), _batch);
+      if (_batcher.add(topic, _record))
+        return;
+    }
+    std::string body;
+    Batcher::append_record(body, _record);
+    send(std::string(topic), std::move(body), 1);
+  }
+
+  /**
+   * @brief Sends the pending batches.
+   */
+  void flush() { _batcher.flush(); }
+
+  const FederationStats &stats() const { return _stats; }
+
+  size_t subscriptions() const { return _prefixes.size(); }
+
+private:
+  void send(const std::string &topic, std::string &&body, size_t count) {
+    std::string frame = _compressor.pack(topic, wire_encoding::json,
+                                         std::move(body), nullptr, true);
+    _stats.batches++;
+    _stats.bytes += frame.size();
+    _sender(topic, federation::write_envelope((uint32_t)count),
+            std::move(frame));
+  }
+
+  std::string _name;
+  BatchPolicy _batch;
+  FederationLedger &_ledger;
+  sender_t _sender;
+  Compressor _compressor;
+  Batcher _batcher;
+  std::map<std::string, size_t, std::less<>> _prefixes;
+  std::string _record;
+  FederationStats _stats;
+};
+
+/**
+ * @brief Unpacks the messages received on a link. Not thread-safe: one
+ * per link.
+ *
+ * @example
+ * FederationImporter importer(settings, link, ledger);
+ * importer.unpack(msg, [&](string_view topic, auto &frames) {...},
+ *                 [&](zmqpp::message &raw) {...});
+ */
+class FederationImporter {
+public:
+  FederationImporter(const FederationSettings &settings,
+                     const FederationLink &link, FederationLedger *ledger)
+      : _name(settings.name), _link(link.name), _max_hops(settings.max_hops),
+        _ledger(ledger) {}
+
+  /**
+   * @brief Unpacks a message of the link.
+   *
+   * @param topic The first frame.
+   * @param frames The other frames.
+   * @param forward Called as forward(topic, frames) with each message to be
+   * injected into the frontend.
+   * @return false if the message is not a federation message, and must be
+   * forwarded as it is.
+   */
+  template <typename F>
+  bool unpack(std::string_view topic,
+              const std::vector<std::string_view> &frames, F &&forward) {
+    uint32_t count = 0;
+    try {
+      if (frames.size() != 2 || !federation::read_envelope(frames[0], count)) {
+        // From a plain backend
+        if (frames.size() >= 1 && _ledger)
+          _ledger->add(federation::fingerprint(topic, frames), _link, 1);
+        _stats.messages++;
+        _stats.bytes += topic.size();
+        for (auto const &f : frames)
+          _stats.bytes += f.size();
+        return false;
+      }
+      _stats.batches++;
+      _stats.bytes += frames[1].size();
+      auto header = wire::read_header(frames[1]);
+      if (header.size == 0)
+        throw std::runtime_error("Missing payload header");
+      std::string_view body = frames[1].substr(header.size);
+      if (header.codec != wire_codec::none) {
+        _compressor.unpack(topic, header.codec, body, _buffer);
+        body = _buffer;
+      }
+      Batcher::split(body, _records);
+      if (_records.size() != count)
+        throw std::runtime_error("Wrong message count");
+      for (auto const &record : _records) {
+        Batcher::split(record, _frames);
+        if (_frames.empty() || _frames[0].empty())
+          throw std::runtime_error("Missing origin");
+        uint8_t received = (uint8_t)_frames[0][0];
+        std::string_view origin = _frames[0].substr(1);
+        if (origin == _name) {
+          _stats.looped++;
+          continue;
+        }
+        // Checked before counting this link, so that hops cannot wrap
+        if (received >= _max_hops) {
+          _stats.expired++;
+          continue;
+        }
+        uint8_t hops = received + 1;
+        _frames.erase(_frames.begin());
+        if (_ledger)
+          _ledger->add(federation::fingerprint(topic, _frames), origin, hops);
+        forward(topic, _frames);
+        _stats.messages++;
+      }
+    } catch (const std::exception &) {
+      _stats.invalid++;
+    }
+    return true;
+  }
+
+  const FederationStats &stats() const { return _stats; }
+
+private:
+  std::string _name, _link;
+  uint8_t _max_hops;
+  FederationLedger *_ledger;
+  Compressor _compressor;
+  std::string _buffer;
+  std::vector<std::string_view> _records, _frames;
+  FederationStats _stats;
+};
+
+} // namespace Mads
+
+#endif // FEDERATION_HPP
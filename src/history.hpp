@@ -0,0 +1,237 @@
+/*
+  _   _ _     _
+ | | | (_)___| |_ ___  _ __ _   _
+ | |_| | / __| __/ _ \| '__| | | |
+ |  _  | \__ \ || (_) | |  | |_| |
+ |_| |_|_|___/\__\___/|_|   \__, |
+                            |___/
+
+Last-N message cache of the broker. The broker keeps the last messages of
+each (selected) topic, so that agents subscribing late can ask for them and
+get the current state without waiting for the next publication. Messages are
+kept as received, i.e. encoded and compressed; the last zstd dictionary of
+each topic is also kept, and replayed first. The number of topics can be
+bounded, evicting the least recently updated ones.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include "wire.hpp"
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <zmqpp/zmqpp.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Bounded ring of the last messages of each topic. Thread-safe.
+ *
+ * @example
+ * HistoryCache history(10, {"clock_slow", "metadata"}, 1000);
+ * history.add(msg); // for each relayed message
+ * auto replay = history.replay({"clock"}); // subscription prefixes
+ */
+class HistoryCache {
+public:
+  /**
+   * @brief Creates a cache.
+   *
+   * @param depth Messages kept per topic (0 disables the cache).
+   * @param topics Prefixes of the cached topics (all topics if empty).
+   * @param max_topics Maximum number of cached topics (0 for no limit).
+   */
+  HistoryCache(size_t depth = 0, std::vector<std::string> topics = {},
+               size_t max_topics = 0)
+      : _depth(depth), _topics(std::move(topics)), _max_topics(max_topics) {}
+
+  /**
+   * @brief Changes depth, cached topics and their maximum number, keeping
+   * the messages that are still in scope.
+   */
+  void configure(size_t depth, std::vector<std::string> topics,
+                 size_t max_topics = 0) {
+    std::lock_guard lock(_mtx);
+    _depth = depth;
+    _topics = std::move(topics);
+    _max_topics = max_topics;
+    for (auto it = _cache.begin(); it != _cache.end();) {
+      ring &r = it->second;
+      while (r.messages.size() > _depth)
+        r.messages.pop_front();
+      if (_depth == 0 || !cached(it->first)) {
+        _lru.erase(r.lru);
+        it = _cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    evict();
+  }
+
+  bool enabled() const {
+    std::lock_guard lock(_mtx);
+    return _depth > 0;
+  }
+
+  size_t depth() const {
+    std::lock_guard lock(_mtx);
+    return _depth;
+  }
+
+  std::vector<std::string> topics() const {
+    std::lock_guard lock(_mtx);
+    return _topics;
+  }
+
+  size_t max_topics() const {
+    std::lock_guard lock(_mtx);
+    return _max_topics;
+  }
+
+  /**
+   * @brief The prefixes the broker must subscribe to on its frontend, so
+   * that publishers send the cached topics even with no subscriber.
+   */
+  std::vector<std::string> subscriptions() const {
+    std::lock_guard lock(_mtx);
+    if (_depth == 0)
+      return {};
+    if (_topics.empty())
+      return {""};
+    return _topics;
+  }
+
+  /**
+   * @brief Stores a copy of a message (topic, payload and possibly blob
+   * frames), if its topic is cached.
+   */
+  void add(const zmqpp::message &msg) {
+    if (msg.parts() < 2)
+      return;
+    std::string_view topic = frame(msg, 0);
+    bool dictionary = false;
+    if (msg.parts() == 2) {
+      try {
+        dictionary =
+            wire::read_header(frame(msg, 1)).codec == wire_codec::dictionary;
+      } catch (const std::invalid_argument &) {
+        // Not a MADS payload, cached as is
+      }
+    }
+    std::lock_guard lock(_mtx);
+    if (_depth == 0 || !cached(topic))
+      return;
+    auto it = _cache.find(topic);
+    if (it == _cache.end()) {
+      it = _cache.emplace(std::string(topic), ring{}).first;
+      _lru.push_front(&it->first);
+      it->second.lru = _lru.begin();
+      evict();
+    } else {
+      _lru.splice(_lru.begin(), _lru, it->second.lru);
+    }
+    ring &r = it->second;
+    if (dictionary) {
+      r.dictionary = msg.copy();
+      r.has_dictionary = true;
+      return;
+    }
+    r.messages.push_back(msg.copy());
+    if (r.messages.size() > _depth)
+      r.messages.pop_front();
+  }
+
+  /**
+   * @brief Copies of the cached messages of the topics matching any of the
+   * prefixes (as in ZeroMQ subscriptions: an empty prefix matches all),
+   * oldest first within each topic.
+   */
+  std::vector<zmqpp::message>
+  replay(const std::vector<std::string> &prefixes) const {
+    std::vector<zmqpp::message> out;
+    std::lock_guard lock(_mtx);
+    for (auto const &[topic, r] : _cache) {
+      if (!matches(topic, prefixes))
+        continue;
+      if (r.has_dictionary)
+        out.push_back(r.dictionary.copy());
+      for (auto const &m : r.messages)
+        out.push_back(m.copy());
+    }
+    return out;
+  }
+
+  /**
+   * @brief Number of cached topics and messages, and of evicted topics.
+   */
+  nlohmann::json stats() const {
+    std::lock_guard lock(_mtx);
+    size_t messages = 0;
+    for (auto const &[topic, r] : _cache)
+      messages += r.messages.size();
+    nlohmann::json j = {{"depth", _depth},
+                        {"topics", _cache.size()},
+                        {"messages", messages},
+                        {"evicted", _evicted}};
+    if (_max_topics > 0)
+      j["max_topics"] = _max_topics;
+    return j;
+  }
+
+private:
+  struct ring {
+    std::deque<zmqpp::message> messages;
+    zmqpp::message dictionary;
+    bool has_dictionary = false;
+    std::list<const std::string *>::iterator lru;
+  };
+
+  // Drops the least recently updated topics beyond max_topics (under lock)
+  void evict() {
+    while (_max_topics > 0 && _cache.size() > _max_topics) {
+      _cache.erase(_cache.find(*_lru.back()));
+      _lru.pop_back();
+      _evicted++;
+    }
+  }
+
+  static std::string_view frame(const zmqpp::message &m, size_t part) {
+    return std::string_view(static_cast<const char *>(m.raw_data(part)),
+                            m.size(part));
+  }
+
+  static bool matches(std::string_view topic,
+                      const std::vector<std::string> &prefixes) {
+    for (auto const &p : prefixes) {
+      if (topic.substr(0, p.size()) == p)
+        return true;
+    }
+    return false;
+  }
+
+  bool cached(std::string_view topic) const {
+    return _topics.empty() || matches(topic, _topics);
+  }
+
+  size_t _depth;
+  std::vector<std::string> _topics;
+  size_t _max_topics;
+  uint64_t _evicted = 0;
+  mutable std::mutex _mtx;
+  std::map<std::string, ring, std::less<>> _cache;
+  std::list<const std::string *> _lru; // Keys of _cache, most recent first
+};
+
+} // namespace Mads
+
+#endif // HISTORY_HPP
@@ -87,6 +87,19 @@ public:
     out << style::reset << endl;
   }
 
+  /**
+   * @brief The descriptor that becomes readable when a watched file is
+   * written (kqueue on macOS, inotify on Linux), to be added to the reactor.
+   * publish_change() does not block when it is readable.
+   */
+  int watch_fd() const {
+#ifdef __APPLE__
+    return _kq;
+#else
+    return _infd;
+#endif
+  }
+
   /**
    * @brief Blocks until a write event happens on one of the watched files, 
    * then publishes the binary object.
@@ -132,19 +145,19 @@ public:
 
 #endif
     json meta{{"format", type}};
-    ifstream fin(path);
+    ifstream fin(path, ios::binary);
     // get pointer to associated buffer object
     filebuf *pbuf = fin.rdbuf();
     // get file size using buffer's members
     size_t size = pbuf->pubseekoff(0, fin.end, fin.in);
     pbuf->pubseekpos(0, fin.in);
     // allocate memory to contain file data
-    char *filebuffer = new char[size];
+    unique_ptr<char[]> filebuffer(new char[size]);
     // get file data
-    pbuf->sgetn(filebuffer, size);
-    publish(filebuffer, size, meta, topic);
+    size = pbuf->sgetn(filebuffer.get(), size);
     fin.close();
-    delete[] filebuffer;
+    // the buffer is sent without copies, and freed once sent
+    publish(std::move(filebuffer), size, meta, topic);
   }
 
 private:
@@ -0,0 +1,750 @@
+/*
+      _                              _
+     | | ___  _   _ _ __ _ __   __ _| |
+  _  | |/ _ \| | | | '__| '_ \ / _` | |
+ | |_| | (_) | |_| | |  | | | | (_| | |
+  \___/ \___/ \__,_|_|  |_| |_|\__,_|_|
+
+Append-only traffic journal. Messages are appended to memory-mapped segment
+files in a directory; a segment is closed when it reaches its size limit,
+and the next one is opened. Each segment NNNNNNNN.journal has a sidecar
+NNNNNNNN.index (JSON), written when the segment is closed, with a sparse
+time index, the offsets of the dictionaries and per-topic counters. JournalReader reads the segments back,
+e.g. for mads-replay.
+
+Segment layout (little endian):
+- header, 32 bytes: magic "MADSJRN\0", version (u32), header size (u32),
+  creation time (u64, ns), reserved (u64)
+- records, each aligned to 8 bytes:
+  - size (u32, whole record with padding; 0 marks the end of data)
+  - topic size (u16), frames (u8), flags (u8, see journal_flag)
+  - receive time (u64, ns since the epoch)
+  - topic, then for each frame its size (u32) and bytes
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "wire.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Mads {
+
+/**
+ * @brief Flags of a journal record, from the wire header of its payload.
+ */
+enum journal_flag : uint8_t {
+  blob = 0x01,       // Topic, metadata and blob frames
+  batch = 0x02,      // Batch of payloads
+  dictionary = 0x04, // zstd dictionary for the topic
+  compressed = 0x08, // Compressed payload
+};
+
+namespace journal {
+
+static constexpr char magic[8] = {'M', 'A', 'D', 'S', 'J', 'R', 'N', '\0'};
+static constexpr uint32_t version = 1;
+static constexpr size_t header_size = 32;
+static constexpr size_t record_header_size = 16;
+
+/**
+ * @brief Header of a record.
+ */
+struct record_header {
+  uint32_t size;
+  uint16_t topic_size;
+  uint8_t frames;
+  uint8_t flags;
+  uint64_t timestamp;
+};
+static_assert(sizeof(record_header) == record_header_size);
+
+/**
+ * @brief Size of a record with the given topic and frames, padded.
+ */
+inline size_t record_size(std::string_view topic,
+                          const std::vector<std::string_view> &frames) {
+  size_t size = record_header_size + topic.size();
+  for (auto const &f : frames)
+    size += 4 + f.size();
+  return (size + 7) & ~size_t(7);
+}
+
+/**
+ * @brief Flags of a message, from the wire header of its payload frame.
+ */
+inline uint8_t flags_of(const std::vector<std::string_view> &frames) {
+  uint8_t flags = frames.size() > 1 ? journal_flag::blob : 0;
+  if (frames.empty() || flags)
+    return flags;
+  try {
+    wire::header h = wire::read_header(frames[0]);
+    if (h.batch)
+      flags |= journal_flag::batch;
+    if (h.codec == wire_codec::dictionary)
+      flags |= journal_flag::dictionary;
+    else if (h.codec != wire_codec::none)
+      flags |= journal_flag::compressed;
+  } catch (const std::invalid_argument &) {
+    // Not a MADS payload
+  }
+  return flags;
+}
+
+inline std::string segment_name(uint32_t n, const char *ext) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%08u.%s", n, ext);
+  return name;
+}
+
+inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * @brief A file mapped in memory, read-only or read-write.
+ */
+class mapped_file {
+public:
+  mapped_file() = default;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() { close(); }
+
+  /**
+   * @brief Creates (or truncates) a file of the given size and maps it
+   * read-write.
+   *
+   * @throws std::runtime_error on failure (e.g. disk full).
+   */
+  void create(const std::filesystem::path &path, size_t size) {
+    close();
+#ifdef _WIN32
+    _file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("Cannot create " + path.string());
+    map(size, true);
+#else
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+      throw std::runtime_error("Cannot create " + path.string() + ": " +
+                               std::strerror(errno));
+#ifdef __linux__
+    // Reserve the blocks now: writing to a sparse mapping on a full disk
+    // would raise SIGBUS
+    if (posix_fallocate(_fd, 0, size) != 0) {
+      close();
+      throw std::runtime_error("Cannot allocate " + path.string());
+    }
+#else
+    if (ftruncate(_fd, size) != 0) {
+      close();
+      throw std::runtime_error("Cannot allocate " + path.string());
+    }
+#endif
+    map(size, true);
+#endif
+  }
+
+  /**
+   * @brief Maps an existing file read-only.
+   *
+   * @throws std::runtime_error on failure.
+   */
+  void open(const std::filesystem::path &path) {
+    close();
+    size_t size = std::filesystem::file_size(path);
+#ifdef _WIN32
+    _file = CreateFileW(path.c_str(), GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("Cannot open " + path.string());
+#else
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0)
+      throw std::runtime_error("Cannot open " + path.string() + ": " +
+                               std::strerror(errno));
+#endif
+    if (size > 0)
+      map(size, false);
+  }
+
+  /**
+   * @brief Unmaps and closes the file, truncating it to used bytes if
+   * writable and used is not 0.
+   */
+  void close(size_t used = 0) {
+#ifdef _WIN32
+    if (_data)
+      UnmapViewOfFile(_data);
+    if (_mapping)
+      CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE) {
+      if (_writable && used > 0) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = (LONGLONG)used;
+        SetFilePointerEx(_file, pos, NULL, FILE_BEGIN);
+        SetEndOfFile(_file);
+      }
+      CloseHandle(_file);
+    }
+    _mapping = NULL;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if (_data)
+      munmap(_data, _size);
+    if (_fd >= 0) {
+      if (_writable && used > 0 && ftruncate(_fd, used) != 0) {
+        // The file keeps its full size, with zeroes after the last record
+      }
+      ::close(_fd);
+    }
+    _fd = -1;
+#endif
+    _data = nullptr;
+    _size = 0;
+  }
+
+  char *data() { return _data; }
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  void map(size_t size, bool writable) {
+    _writable = writable;
+    _size = size;
+#ifdef _WIN32
+    LARGE_INTEGER sz;
+    sz.QuadPart = (LONGLONG)size;
+    _mapping = CreateFileMappingW(_file, NULL,
+                                  writable ? PAGE_READWRITE : PAGE_READONLY,
+                                  sz.HighPart, sz.LowPart, NULL);
+    if (_mapping)
+      _data = (char *)MapViewOfFile(
+          _mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    if (!_data) {
+      close();
+      throw std::runtime_error("Cannot map journal segment");
+    }
+#else
+    void *p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+      close();
+      throw std::runtime_error("Cannot map journal segment: " +
+                               std::string(std::strerror(errno)));
+    }
+    _data = (char *)p;
+#endif
+  }
+
+  char *_data = nullptr;
+  size_t _size = 0;
+  bool _writable = false;
+#ifdef _WIN32
+  HANDLE _file = INVALID_HANDLE_VALUE;
+  HANDLE _mapping = NULL;
+#else
+  int _fd = -1;
+#endif
+};
+
+} // namespace journal
+
+/**
+ * @brief Appends messages to a segmented journal. Not thread-safe: meant to
+ * be owned by a single writer thread.
+ *
+ * @example
+ * JournalWriter journal;
+ * journal.open("journal", 256 << 20);
+ * journal.append(journal::now_ns(), topic, {payload});
+ * journal.close();
+ */
+class JournalWriter {
+public:
+  JournalWriter() = default;
+  JournalWriter(const JournalWriter &) = delete;
+  JournalWriter &operator=(const JournalWriter &) = delete;
+  ~JournalWriter() { close(); }
+
+  /**
+   * @brief Opens a journal directory (created if needed). Segments are
+   * numbered after the existing ones.
+   *
+   * @param dir The directory.
+   * @param segment_size Size limit of the segments (bytes).
+   * @param index_interval Bytes between entries of the sparse time index.
+   * @throws std::runtime_error on failure.
+   */
+  void open(const std::filesystem::path &dir, size_t segment_size,
+            size_t index_interval = 1 << 20) {
+    close();
+    std::filesystem::create_directories(dir);
+    _dir = dir;
+    _segment_size = std::max<size_t>(segment_size, 1 << 16);
+    _index_interval = index_interval;
+    _next = 1;
+    _dictionaries.clear();
+    _total_records = _total_bytes = _segments = 0;
+    _rejected = _dropped = 0;
+    for (auto const &e : std::filesystem::directory_iterator(dir)) {
+      if (e.path().extension() != ".journal")
+        continue;
+      try {
+        _next = std::max<uint32_t>(_next, std::stoul(e.path().stem()) + 1);
+      } catch (const std::exception &) {
+        // Not a segment
+      }
+    }
+  }
+
+  bool is_open() const { return !_dir.empty(); }
+
+  /**
+   * @brief Appends a message. Messages that do not fit the record layout
+   * (topics over 64 KiB, more than 255 frames, records over 4 GiB) are
+   * rejected, and counted.
+   *
+   * @param timestamp Receive time, ns since the epoch.
+   * @param topic The topic.
+   * @param frames The frames after the topic.
+   * @return false if the message was rejected.
+   * @throws std::runtime_error if a new segment cannot be created.
+   */
+  bool append(uint64_t timestamp, std::string_view topic,
+              const std::vector<std::string_view> &frames) {
+    if (!is_open())
+      return false;
+    size_t size = journal::record_size(topic, frames);
+    if (topic.size() > std::numeric_limits<uint16_t>::max() ||
+        frames.size() > std::numeric_limits<uint8_t>::max() ||
+        size > std::numeric_limits<uint32_t>::max()) {
+      _rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (!_file.data() || _offset + size > _file.size())
+      roll(size);
+    uint8_t flags = journal::flags_of(frames);
+    write(timestamp, topic, frames, flags, size);
+    // Dictionaries are written again at the start of each segment, so that
+    // segments can be read on their own
+    if (flags & journal_flag::dictionary && frames.size() == 1)
+      _dictionaries[std::string(topic)] = {timestamp, std::string(frames[0])};
+    return true;
+  }
+
+  /**
+   * @brief Sets the number of messages lost before reaching the writer
+   * (e.g. at the high water mark of the socket it reads from), as counted
+   * by the caller. Can be called from threads other than the writer.
+   */
+  void set_dropped(uint64_t n) {
+    _dropped.store(n, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Closes the current segment, writing its index.
+   */
+  void close() {
+    finish_segment();
+    _dir.clear();
+  }
+
+  /**
+   * @brief Records, bytes and segments written since open(), and messages
+   * rejected or dropped. Can be called from threads other than the writer.
+   */
+  nlohmann::json stats() const {
+    return {{"records", _total_records.load(std::memory_order_relaxed)},
+            {"bytes", _total_bytes.load(std::memory_order_relaxed)},
+            {"segments", _segments.load(std::memory_order_relaxed)},
+            {"rejected", _rejected.load(std::memory_order_relaxed)},
+            {"dropped", _dropped.load(std::memory_order_relaxed)}};
+  }
+
+private:
+  struct topic_entry {
+    uint64_t count = 0, bytes = 0, first = 0, last = 0, offset = 0;
+  };
+
+  void write(uint64_t timestamp, std::string_view topic,
+             const std::vector<std::string_view> &frames, uint8_t flags,
+             size_t size) {
+    char *p = _file.data() + _offset;
+    journal::record_header h{(uint32_t)size, (uint16_t)topic.size(),
+                             (uint8_t)frames.size(), flags, timestamp};
+    std::memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    std::memcpy(p, topic.data(), topic.size());
+    p += topic.size();
+    for (auto const &f : frames) {
+      uint32_t len = (uint32_t)f.size();
+      std::memcpy(p, &len, 4);
+      std::memcpy(p + 4, f.data(), f.size());
+      p += 4 + f.size();
+    }
+    // Index
+    if (flags & journal_flag::dictionary)
+      _dictionary_offsets.push_back(_offset);
+    if (_records == 0)
+      _first = timestamp;
+    _last = timestamp;
+    if (_offset >= _next_index) {
+      _time_index.push_back({timestamp, _offset});
+      _next_index = _offset + _index_interval;
+    }
+    auto &t = _topics[std::string(topic)];
+    if (t.count == 0) {
+      t.first = timestamp;
+      t.offset = _offset;
+    }
+    t.count++;
+    t.bytes += size;
+    t.last = timestamp;
+    _offset += size;
+    _records++;
+    _total_records.fetch_add(1, std::memory_order_relaxed);
+    _total_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  void roll(size_t min_size) {
+    finish_segment();
+    size_t dict_size = 0;
+    for (auto const &[topic, d] : _dictionaries)
+      dict_size += journal::record_size(topic, {d.second});
+    size_t size = std::max(_segment_size,
+                           min_size + dict_size + journal::header_size);
+    _file.create(_dir / journal::segment_name(_next, "journal"), size);
+    char *p = _file.data();
+    std::memset(p, 0, journal::header_size);
+    std::memcpy(p, journal::magic, sizeof(journal::magic));
+    std::memcpy(p + 8, &journal::version, 4);
+    uint32_t hs = journal::header_size;
+    std::memcpy(p + 12, &hs, 4);
+    uint64_t created = journal::now_ns();
+    std::memcpy(p + 16, &created, 8);
+    _offset = journal::header_size;
+    _next_index = _offset;
+    _next++;
+    _segments.fetch_add(1, std::memory_order_relaxed);
+    for (auto const &[topic, d] : _dictionaries) {
+      std::vector<std::string_view> frames{d.second};
+      write(d.first, topic, frames, journal_flag::dictionary,
+            journal::record_size(topic, frames));
+    }
+  }
+
+  void finish_segment() {
+    if (!_file.data())
+      return;
+    uint32_t n = _next - 1;
+    size_t used = _offset;
+    if (_offset + 4 <= _file.size())
+      std::memset(_file.data() + _offset, 0, 4); // End of data
+    _file.close(used);
+    nlohmann::json index{{"segment", journal::segment_name(n, "journal")},
+                         {"records", _records},
+                         {"bytes", used},
+                         {"first", _first},
+                         {"last", _last}};
+    index["time"] = nlohmann::json::array();
+    for (auto const &[ts, off] : _time_index)
+      index["time"].push_back({ts, off});
+    index["dictionaries"] = _dictionary_offsets;
+    index["topics"] = nlohmann::json::object();
+    for (auto const &[topic, t] : _topics)
+      index["topics"][topic] = {{"count", t.count}, {"bytes", t.bytes},
+                                {"first", t.first}, {"last", t.last},
+                                {"offset", t.offset}};
+    std::ofstream out(_dir / journal::segment_name(n, "index"));
+    out << index.dump();
+    _time_index.clear();
+    _dictionary_offsets.clear();
+    _topics.clear();
+    _records = 0;
+    _first = _last = 0;
+  }
+
+  std::filesystem::path _dir;
+  journal::mapped_file _file;
+  size_t _segment_size = 256 << 20;
+  size_t _index_interval = 1 << 20;
+  size_t _offset = 0, _next_index = 0;
+  uint32_t _next = 1;
+  uint64_t _records = 0, _first = 0, _last = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> _time_index;
+  std::vector<uint64_t> _dictionary_offsets;
+  std::map<std::string, topic_entry> _topics;
+  std::map<std::string, std::pair<uint64_t, std::string>> _dictionaries;
+  std::atomic<uint64_t> _total_records{0}, _total_bytes{0}, _segments{0};
+  std::atomic<uint64_t> _rejected{0}, _dropped{0};
+};
+
+/**
+ * @brief Reads a journal, segment after segment. Not thread-safe.
+ *
+ * @example
+ * JournalReader journal("journal");
+ * journal.seek(start_ns);
+ * JournalReader::record r;
+ * while (journal.next(r)) { ... r.topic, r.frames ... }
+ */
+class JournalReader {
+public:
+  /**
+   * @brief A record. Views are valid until the next call to next() or
+   * seek().
+   */
+  struct record {
+    uint64_t timestamp = 0;
+    uint8_t flags = 0;
+    std::string_view topic;
+    std::vector<std::string_view> frames;
+  };
+
+  JournalReader() = default;
+
+  /**
+   * @brief Opens a journal.
+   *
+   * @param path A journal directory, or a single segment.
+   * @throws std::runtime_error if there are no segments.
+   */
+  explicit JournalReader(const std::filesystem::path &path) { open(path); }
+
+  void open(const std::filesystem::path &path) {
+    _segments.clear();
+    if (std::filesystem::is_directory(path)) {
+      for (auto const &e : std::filesystem::directory_iterator(path)) {
+        if (e.path().extension() == ".journal")
+          _segments.push_back(e.path());
+      }
+      std::sort(_segments.begin(), _segments.end());
+    } else if (std::filesystem::exists(path)) {
+      _segments.push_back(path);
+    }
+    if (_segments.empty())
+      throw std::runtime_error("No journal segments in " + path.string());
+    load(0);
+  }
+
+  size_t segments() const { return _segments.size(); }
+
+  /**
+   * @brief Receive time of the first record (0 if the journal is empty).
+   */
+  uint64_t first_timestamp() {
+    for (size_t i = 0; i < _segments.size(); i++) {
+      uint64_t first = span(i).first;
+      if (first > 0)
+        return first;
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Moves to the first record received at or after timestamp. The
+   * segment is found with the indexes, and the scan starts from the nearest
+   * entry of its time index; then, the last dictionary of each topic
+   * preceding that record is returned first by next().
+   */
+  void seek(uint64_t timestamp) {
+    size_t i = 0;
+    while (i < _segments.size() && span(i).second < timestamp)
+      i++;
+    if (!load(i))
+      return;
+    std::map<std::string_view, size_t> dictionaries;
+    record r;
+    size_t size;
+    // Older indexes have no dictionary offsets: scan the whole segment
+    auto idx = index(i);
+    if (idx.contains("time") && idx.contains("dictionaries")) {
+      try {
+        auto time =
+            idx["time"].get<std::vector<std::pair<uint64_t, uint64_t>>>();
+        auto it = std::partition_point(
+            time.begin(), time.end(),
+            [&](auto const &e) { return e.first < timestamp; });
+        if (it != time.begin() && std::prev(it)->second < _file.size()) {
+          size_t start = std::prev(it)->second;
+          for (auto const &d : idx["dictionaries"]) {
+            size_t offset = d.get<uint64_t>();
+            if (offset < start && read(offset, r, size))
+              dictionaries[r.topic] = offset;
+          }
+          _offset = start;
+        }
+      } catch (const nlohmann::json::exception &) {
+        // Scan the whole segment
+        dictionaries.clear();
+        _offset = journal::header_size;
+      }
+    }
+    while (read(_offset, r, size) && r.timestamp < timestamp) {
+      if (r.flags & journal_flag::dictionary)
+        dictionaries[r.topic] = _offset;
+      _offset += size;
+    }
+    for (auto const &[topic, offset] : dictionaries)
+      _pending.push_back(offset);
+  }
+
+  /**
+   * @brief Reads the next record.
+   *
+   * @return false at the end of the journal.
+   */
+  bool next(record &r) {
+    size_t size;
+    if (!_pending.empty()) {
+      size_t offset = _pending.front();
+      _pending.erase(_pending.begin());
+      if (read(offset, r, size))
+        return true;
+    }
+    while (_current < _segments.size()) {
+      if (read(_offset, r, size)) {
+        _offset += size;
+        return true;
+      }
+      load(_current + 1);
+    }
+    return false;
+  }
+
+private:
+  // Maps segment i; false past the last one
+  bool load(size_t i) {
+    _file.close();
+    _pending.clear();
+    _current = i;
+    _offset = journal::header_size;
+    if (i >= _segments.size())
+      return false;
+    _file.open(_segments[i]);
+    if (_file.size() < journal::header_size ||
+        std::memcmp(_file.data(), journal::magic, sizeof(journal::magic)) != 0)
+      throw std::runtime_error("Not a journal segment: " +
+                               _segments[i].string());
+    uint32_t version;
+    std::memcpy(&version, _file.data() + 8, 4);
+    if (version != journal::version)
+      throw std::runtime_error("Unsupported journal version in " +
+                               _segments[i].string());
+    return true;
+  }
+
+  // Parses the record at offset; false at the end of data (or if truncated)
+  bool read(size_t offset, record &r, size_t &size) const {
+    if (offset + journal::record_header_size > _file.size())
+      return false;
+    const char *p = _file.data() + offset;
+    journal::record_header h;
+    std::memcpy(&h, p, sizeof(h));
+    if (h.size < journal::record_header_size + h.topic_size ||
+        offset + h.size > _file.size())
+      return false;
+    const char *end = p + h.size;
+    p += sizeof(h);
+    r.timestamp = h.timestamp;
+    r.flags = h.flags;
+    r.topic = std::string_view(p, h.topic_size);
+    p += h.topic_size;
+    r.frames.clear();
+    for (uint8_t i = 0; i < h.frames; i++) {
+      uint32_t len;
+      if (p + 4 > end)
+        return false;
+      std::memcpy(&len, p, 4);
+      if (p + 4 + len > end)
+        return false;
+      r.frames.emplace_back(p + 4, len);
+      p += 4 + len;
+    }
+    size = h.size;
+    return true;
+  }
+
+  // The index of segment i; null if missing or unreadable (e.g. segments
+  // not closed properly)
+  nlohmann::json index(size_t i) const {
+    std::filesystem::path path = _segments[i];
+    path.replace_extension(".index");
+    std::ifstream in(path);
+    if (!in)
+      return nullptr;
+    try {
+      auto j = nlohmann::json::parse(in);
+      if (j.is_object())
+        return j;
+    } catch (const std::exception &) {
+      // Unreadable
+    }
+    return nullptr;
+  }
+
+  // First and last receive time of segment i, from its index or by reading
+  // it
+  std::pair<uint64_t, uint64_t> span(size_t i) {
+    auto j = index(i);
+    try {
+      if (!j.is_null())
+        return {j.at("first").get<uint64_t>(), j.at("last").get<uint64_t>()};
+    } catch (const std::exception &) {
+      // Read the segment instead
+    }
+    JournalReader segment(_segments[i]);
+    record r;
+    uint64_t first = 0, last = 0;
+    while (segment.next(r)) {
+      if (first == 0)
+        first = r.timestamp;
+      last = r.timestamp;
+    }
+    return {first, last};
+  }
+
+  std::vector<std::filesystem::path> _segments;
+  journal::mapped_file _file;
+  size_t _current = 0;
+  size_t _offset = journal::header_size;
+  std::vector<size_t> _pending; // Offsets of the dictionaries to resend
+};
+
+} // namespace Mads
+
+#endif // JOURNAL_HPP
@@ -267,20 +267,20 @@ private:
     }
     auto now = chrono::system_clock::now();
     auto doc = make_document();
-    auto msg = message ? *message : _last_message;
-    auto topic = get<0>(msg);
+    string_view topic = message ? get<0>(*message) : last_topic_view();
+    string_view payload = message ? get<1>(*message) : last_payload_view();
     if (topic.empty() || topic == LOGGER_STATUS_TOPIC) {
       return;
     }
     try {
-      auto j = from_json(get<1>(msg));
+      auto j = from_json(payload);
       doc = make_document(kvp("timestamp", b_date(now)), kvp("message", j));
     } catch (const bsoncxx::exception &e) {
       cerr << "Error while parsing JSON: " << e.what() << endl;
       doc =
           make_document(kvp("timestamp", b_date(now)), kvp("error", e.what()));
     }
-    auto coll = _db[topic];
+    auto coll = _db[string(topic)];
     try {
       coll.insert_one(doc.view());
     } catch (const mongocxx::bulk_write_exception &e) {
@@ -293,15 +293,17 @@ private:
     if (paused) {
       return;
     }
-    uint32_t blob_size = get<2>(_last_blob).size();
+    auto data = last_blob_view();
+    uint32_t blob_size = data.size();
     auto now = chrono::system_clock::now();
-    bsoncxx::types::b_binary blob{bsoncxx::binary_sub_type::k_binary,
-                                  blob_size, get<2>(_last_blob).data()};
+    bsoncxx::types::b_binary blob{
+        bsoncxx::binary_sub_type::k_binary, blob_size,
+        reinterpret_cast<const uint8_t *>(data.data())};
     auto doc =
         make_document(kvp("timestamp", b_date(now)),
-                      kvp("message", from_json(get<1>(_last_blob))), 
+                      kvp("message", from_json(last_blob_meta_view())), 
                       kvp("data", blob));
-    auto coll = _db[get<0>(_last_blob)];
+    auto coll = _db[string(last_blob_topic_view())];
     try {
       coll.insert_one(doc.view());
     } catch (const mongocxx::bulk_write_exception &e) {
@@ -313,8 +315,9 @@ private:
     if (paused) {
       return;
     }
-    auto msg = message ? *message : _last_message;
-    _log_file << "{\"" << get<0>(msg) << "\":" << get<1>(msg) << "}"
+    string_view topic = message ? get<0>(*message) : last_topic_view();
+    string_view payload = message ? get<1>(*message) : last_payload_view();
+    _log_file << "{\"" << topic << "\":" << payload << "}"
               << (_log_array ? "," : "") << endl;
   }
 
@@ -71,7 +71,16 @@ int main(int argc, char const *argv[]) {
     // Main loop
     cout << fg::green << "Bridge process started, send 'exit' to stop"
          << fg::reset << endl;
+#ifdef _WIN32
     bridge.loop([&]() { bridge.route(); }, sleep_time);
+#else
+    // At the end of input, keep running until interrupted
+    bridge.reactor().add(STDIN_FILENO, [&]() {
+      if (!bridge.route_input())
+        bridge.reactor().remove(STDIN_FILENO);
+    });
+    bridge.run();
+#endif
     cout << fg::green << "Bridge process stopped" << fg::reset << endl;
     bridge.register_event(event_type::shutdown);
   }
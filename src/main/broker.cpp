@@ -16,15 +16,26 @@ Author(s): Paolo Bosetti
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #endif
+#include "../backpressure.hpp"
 #include "../exec_path.hpp"
+#include "../federation.hpp"
+#include "../history.hpp"
+#include "../journal.hpp"
 #include "../keypress.hpp"
 #include "../mads.hpp"
+#include "../reactor.hpp"
+#include "../shards.hpp"
+#include "../traffic.hpp"
 #include "../watcher.hpp"
+#include <atomic>
 #include <cstring>
 #include <cxxopts.hpp>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <rang.hpp>
 #include <regex>
 #include <string>
@@ -43,6 +54,7 @@ Author(s): Paolo Bosetti
 #include <ifaddrs.h>
 #include <sys/ioctl.h>
 #endif
+#include "../httplib.h"
 
 
 
@@ -180,8 +192,528 @@ template <typename T> constexpr unsigned long long htonll(T value) noexcept {
 #endif
 
 void proxy(zmqpp::socket &frontend, zmqpp::socket &backend,
-           zmqpp::socket &ctrl) {
-  zmqpp::proxy_steerable(frontend, backend, ctrl);
+           zmqpp::socket &ctrl, zmqpp::socket &capture) {
+  zmqpp::proxy_steerable(frontend, backend, ctrl, capture);
+}
+
+/*
+  ____  _                   _
+ / ___|| |__   __ _ _ __ __| |___
+ \___ \| '_ \ / _` | '__/ _` / __|
+  ___) | | | | (_| | | | (_| \__ \
+ |____/|_| |_|\__,_|_|  \__,_|___/
+*/
+
+// An address bound by a socket, and the actual endpoint (with wildcards
+// resolved), which is needed to unbind it
+struct Binding {
+  void bind(zmqpp::socket &socket, const string &to) {
+    socket.bind(to);
+    address = to;
+    socket.get(zmqpp::socket_option::last_endpoint, endpoint);
+  }
+
+  // Moves to a new address (none if empty), without closing the connections
+  // made to other endpoints of the socket; on failure, the old address is
+  // bound again
+  void rebind(zmqpp::socket &socket, const string &to) {
+    string old = address;
+    if (!endpoint.empty())
+      socket.unbind(endpoint);
+    address.clear();
+    endpoint.clear();
+    if (to.empty())
+      return;
+    try {
+      bind(socket, to);
+    } catch (const zmqpp::zmq_internal_exception &) {
+      if (!old.empty())
+        bind(socket, old);
+      throw;
+    }
+  }
+
+  string address, endpoint;
+};
+
+// A proxy between a pair of XSUB/XPUB sockets, serving a subset of topics
+// (see shards.hpp). With a single shard, this is the classic broker.
+struct Shard {
+  Shard(zmqpp::context &context, size_t index)
+      : index(index), frontend(context, zmqpp::socket_type::xsub),
+        backend(context, zmqpp::socket_type::xpub),
+        controlled(context, zmqpp::socket_type::rep),
+        controller(context, zmqpp::socket_type::req),
+        capture(context, zmqpp::socket_type::pub) {
+    // The proxy copies every message to the capture socket, for traffic
+    // statistics; being a PUB, it drops rather than stalling the proxy
+    capture.set(zmqpp::socket_option::send_high_water_mark, 100000);
+    capture.bind(capture_endpoint(index));
+    // The broker itself publishes (e.g. broker_status) on this endpoint
+    frontend.bind(inproc_endpoint(index));
+    // ...and subscribes on this one (e.g. for the federation endpoint)
+    backend.bind(backend_inproc_endpoint(index));
+    // Connections and disconnections of the peers, for PeerMonitor
+    int events = ZMQ_EVENT_ACCEPTED | ZMQ_EVENT_DISCONNECTED | ZMQ_EVENT_CLOSED;
+    frontend.monitor(monitor_endpoint(index, Mads::PeerMonitor::frontend),
+                     events);
+    backend.monitor(monitor_endpoint(index, Mads::PeerMonitor::backend),
+                    events);
+  }
+
+  static string capture_endpoint(size_t index) {
+    return "inproc://broker-capture-" + to_string(index);
+  }
+
+  static string inproc_endpoint(size_t index) {
+    return "inproc://broker-frontend-" + to_string(index);
+  }
+
+  static string backend_inproc_endpoint(size_t index) {
+    return "inproc://broker-backend-" + to_string(index);
+  }
+
+  static string monitor_endpoint(size_t index,
+                                 Mads::PeerMonitor::side_t side) {
+    return "inproc://broker-monitor-" +
+           string(side == Mads::PeerMonitor::frontend ? "frontend-"
+                                                      : "backend-") +
+           to_string(index);
+  }
+
+  // Sets the socket options; they apply to the peers connecting afterwards
+  void configure(const Mads::SocketOptions &frontend_options,
+                 const Mads::SocketOptions &backend_options) {
+    frontend_options.apply(frontend, false);
+    backend_options.apply(backend, true);
+  }
+
+  // Starts the steerable proxy thread
+  void start() {
+    string ctrl = "inproc://broker-ctrl-" + to_string(index);
+    controlled.bind(ctrl);
+    controller.connect(ctrl);
+    proxy_thread =
+        thread(proxy, ref(frontend), ref(backend), ref(controlled), ref(capture));
+  }
+
+  // Stops the proxy, runs fn while the calling thread owns the sockets, and
+  // starts the proxy again. Connections stay up, and messages wait in the
+  // socket queues meanwhile
+  void suspend(const function<void()> &fn) {
+    command("TERMINATE");
+    proxy_thread.join();
+    try {
+      fn();
+    } catch (...) {
+      proxy_thread = thread(proxy, ref(frontend), ref(backend),
+                            ref(controlled), ref(capture));
+      throw;
+    }
+    proxy_thread =
+        thread(proxy, ref(frontend), ref(backend), ref(controlled), ref(capture));
+  }
+
+  // Subscribes the frontend to the add prefixes, and unsubscribes it from
+  // the remove ones, so that publishers send those topics even with no
+  // subscriber (e.g. for the history cache). Only while the proxy is not
+  // running, i.e. before start() or within suspend()
+  void subscribe(const vector<string> &add, const vector<string> &remove) {
+    for (auto const &prefix : add)
+      frontend.send(string(1, '\x01') + prefix);
+    for (auto const &prefix : remove)
+      frontend.send(string(1, '\x00') + prefix);
+  }
+
+  // Sends a command to the steerable proxy, returns the reply
+  zmqpp::message command(const string &cmd) {
+    zmqpp::message msg;
+    controller.send(cmd);
+    controller.receive(msg);
+    return msg;
+  }
+
+  // Message and byte counters, in the order of desc (see main())
+  vector<uint64_t> statistics() {
+    zmqpp::message msg = command("STATISTICS");
+    vector<uint64_t> stats;
+    for (size_t i = 0; i < msg.parts(); i++) {
+      stats.push_back(htonll(msg.get<uint64_t>(i)));
+    }
+    stats.resize(8, 0);
+    return stats;
+  }
+
+  void close() {
+    if (proxy_thread.joinable())
+      proxy_thread.join();
+    frontend.close();
+    backend.close();
+    controller.close();
+    controlled.close();
+    capture.close();
+  }
+
+  size_t index;
+  zmqpp::socket frontend, backend, controlled, controller, capture;
+  Binding frontend_binding, backend_binding;
+  Binding frontend_ipc, backend_ipc; // For the agents on this host
+  thread proxy_thread;
+};
+
+// Runs the plain (non steerable) proxies of all the shards, shard 0 in the
+// calling thread
+void proxy_all(vector<unique_ptr<Shard>> &shards) {
+  for (size_t i = 1; i < shards.size(); i++) {
+    Shard &s = *shards[i];
+    thread([&s]() { zmqpp::proxy(s.frontend, s.backend, s.capture); })
+        .detach();
+  }
+  zmqpp::proxy(shards[0]->frontend, shards[0]->backend, shards[0]->capture);
+}
+
+// Counts (and caches, for late subscribers) the messages copied by the
+// proxies on their capture sockets, until running becomes false
+void capture_traffic(zmqpp::context &context, const Mads::ShardMap &map,
+                     Mads::TrafficStats &traffic, Mads::HistoryCache &history,
+                     bool &running) {
+  zmqpp::socket sub(context, zmqpp::socket_type::sub);
+  sub.set(zmqpp::socket_option::receive_high_water_mark, 100000);
+  sub.set(zmqpp::socket_option::receive_timeout, 500);
+  for (size_t i = 0; i < map.count(); i++)
+    sub.connect(Shard::capture_endpoint(i));
+  sub.subscribe("");
+  zmqpp::message msg;
+  while (running) {
+    if (!sub.receive(msg))
+      continue;
+    // Single frames are subscriptions going upstream
+    if (msg.parts() < 2)
+      continue;
+    string_view topic(static_cast<const char *>(msg.raw_data(0)),
+                      msg.size(0));
+    size_t bytes = 0;
+    for (size_t i = 1; i < msg.parts(); i++)
+      bytes += msg.size(i);
+    traffic.add(topic, map.shard(topic), bytes);
+    // Control commands are for the agents alive when they are sent
+    if (topic != "control")
+      history.add(msg);
+  }
+  sub.close();
+}
+
+// Appends the messages copied by the proxies to the journal, until running
+// becomes false. The proxies hand messages over through the inproc capture
+// pipes: if the disk cannot keep up, the capture sockets drop messages
+// rather than stalling the proxies. Messages read are counted in received,
+// see count_journal_drops()
+void record_journal(zmqpp::context &context, size_t shards,
+                    Mads::JournalWriter &journal, atomic<uint64_t> &received,
+                    bool &running) {
+  zmqpp::socket sub(context, zmqpp::socket_type::sub);
+  sub.set(zmqpp::socket_option::receive_high_water_mark, 100000);
+  sub.set(zmqpp::socket_option::receive_timeout, 500);
+  for (size_t i = 0; i < shards; i++)
+    sub.connect(Shard::capture_endpoint(i));
+  sub.subscribe("");
+  zmqpp::message msg;
+  vector<string_view> frames;
+  try {
+    while (running) {
+      if (!sub.receive(msg))
+        continue;
+      received.fetch_add(1, memory_order_relaxed);
+      // Single frames are subscriptions going upstream
+      if (msg.parts() < 2)
+        continue;
+      uint64_t now = Mads::journal::now_ns();
+      frames.clear();
+      for (size_t i = 1; i < msg.parts(); i++)
+        frames.emplace_back(static_cast<const char *>(msg.raw_data(i)),
+                            msg.size(i));
+      journal.append(now,
+                     string_view(static_cast<const char *>(msg.raw_data(0)),
+                                 msg.size(0)),
+                     frames);
+    }
+  } catch (const std::exception &e) {
+    cerr << fg::red << "Journal stopped: " << e.what() << fg::reset << endl;
+  }
+  journal.close();
+  sub.close();
+}
+
+// Tracks the peers of all the shards, samples their queues every second,
+// and publishes the broker_status topic every period seconds (0 disables),
+// until running becomes false
+void watch_peers(zmqpp::context &context, const Mads::ShardMap &map,
+                 Mads::PeerMonitor &peers, Mads::TrafficStats &traffic,
+                 const atomic<double> &period, bool &running) {
+  vector<unique_ptr<zmqpp::socket>> monitors;
+  Mads::Reactor reactor;
+  for (size_t i = 0; i < map.count(); i++) {
+    for (auto side : {Mads::PeerMonitor::frontend, Mads::PeerMonitor::backend}) {
+      auto &m = monitors.emplace_back(
+          make_unique<zmqpp::socket>(context, zmqpp::socket_type::pair));
+      m->connect(Shard::monitor_endpoint(i, side));
+      zmqpp::socket *socket = m.get();
+      reactor.add(*socket, [socket, &peers, side, i]() {
+        zmqpp::message msg;
+        while (socket->receive(msg, true))
+          peers.event(msg, side, i);
+      });
+    }
+  }
+  zmqpp::socket status(context, zmqpp::socket_type::pub);
+  status.connect(Shard::inproc_endpoint(map.shard(BROKER_STATUS_TOPIC)));
+  char hostname[HOST_NAME_MAX];
+  if (gethostname(hostname, HOST_NAME_MAX))
+    strcpy(hostname, "unknown");
+  auto last_status = chrono::steady_clock::now();
+  reactor.add_timer(1s, [&]() {
+    for (auto const &p : peers.sample()) {
+      cout << fg::yellow << "Slow consumer: " << p.address << " (shard "
+           << p.shard << ", " << p.queued << " bytes queued)" << fg::reset
+           << endl;
+    }
+    auto now = chrono::steady_clock::now();
+    double p = period.load();
+    if (p <= 0 || now - last_status < chrono::duration<double>(p))
+      return;
+    last_status = now;
+    nlohmann::json payload = peers.json();
+    payload["topics"] = nlohmann::json::array();
+    for (auto const &r : traffic.top(10))
+      payload["topics"].push_back(
+          {{"topic", r.topic}, {"rate", r.rate}, {"byte_rate", r.byte_rate}});
+    auto sys_now = chrono::system_clock::now();
+    payload["hostname"] = hostname;
+    payload["timestamp"]["$date"] = Mads::get_ISODate_time(sys_now);
+    payload["timecode"] = Mads::timecode(sys_now);
+    zmqpp::message msg;
+    msg << BROKER_STATUS_TOPIC << payload.dump();
+    status.send(msg, true);
+  });
+  reactor.run(running);
+  status.close();
+  for (auto &m : monitors)
+    m->close();
+}
+
+// Serves the messages of the shard backends to other brokers on the
+// federation endpoint, until running becomes false. Only the topics that
+// some broker subscribed to are received and packed; batches are flushed by
+// a timer
+void serve_federation(zmqpp::context &context, size_t shards,
+                      zmqpp::socket &endpoint,
+                      Mads::FederationExporter &exporter,
+                      chrono::milliseconds latency, bool &running) {
+  // Subscribes to the shard backends on behalf of the remote brokers: their
+  // subscriptions then reach the publishers, like those of any agent
+  zmqpp::socket sub(context, zmqpp::socket_type::xsub);
+  sub.set(zmqpp::socket_option::receive_high_water_mark, 100000);
+  for (size_t i = 0; i < shards; i++)
+    sub.connect(Shard::backend_inproc_endpoint(i));
+  vector<string_view> frames;
+  Mads::Reactor reactor;
+  reactor.add(sub, [&]() {
+    zmqpp::message msg;
+    while (sub.receive(msg, true)) {
+      if (msg.parts() < 2)
+        continue;
+      string_view topic(static_cast<const char *>(msg.raw_data(0)),
+                        msg.size(0));
+      if (!exporter.wanted(topic))
+        continue;
+      frames.clear();
+      for (size_t i = 1; i < msg.parts(); i++)
+        frames.emplace_back(static_cast<const char *>(msg.raw_data(i)),
+                            msg.size(i));
+      exporter.add(topic, frames);
+    }
+  });
+  reactor.add(endpoint, [&]() {
+    zmqpp::message msg;
+    while (endpoint.receive(msg, true)) {
+      exporter.subscription(string_view(
+          static_cast<const char *>(msg.raw_data(0)), msg.size(0)));
+      // The XSUB socket sends the subscription frame to every shard
+      sub.send(msg, true);
+    }
+  });
+  reactor.add_timer(latency, [&]() { exporter.flush(); });
+  reactor.run(running);
+  exporter.flush();
+  sub.close();
+  endpoint.close();
+}
+
+// Pulls topics from another broker and injects them into the frontend of
+// their shards, until running becomes false
+void pull_federation(zmqpp::context &context, const Mads::ShardMap &map,
+                     const Mads::FederationLink &link,
+                     Mads::FederationImporter &importer, bool &running) {
+  zmqpp::socket sub(context, zmqpp::socket_type::sub);
+  sub.set(zmqpp::socket_option::receive_high_water_mark, 100000);
+  sub.set(zmqpp::socket_option::receive_timeout, 500);
+  sub.connect(link.address);
+  if (link.topics.empty())
+    sub.subscribe("");
+  for (auto const &t : link.topics)
+    sub.subscribe(t);
+  vector<unique_ptr<zmqpp::socket>> frontends;
+  for (size_t i = 0; i < map.count(); i++) {
+    auto &s = frontends.emplace_back(
+        make_unique<zmqpp::socket>(context, zmqpp::socket_type::pub));
+    s->connect(Shard::inproc_endpoint(i));
+  }
+  zmqpp::message msg;
+  vector<string_view> frames;
+  while (running) {
+    if (!sub.receive(msg))
+      continue;
+    if (msg.parts() < 2)
+      continue;
+    string_view topic(static_cast<const char *>(msg.raw_data(0)),
+                      msg.size(0));
+    frames.clear();
+    for (size_t i = 1; i < msg.parts(); i++)
+      frames.emplace_back(static_cast<const char *>(msg.raw_data(i)),
+                          msg.size(i));
+    zmqpp::socket &frontend = *frontends[map.shard(topic)];
+    bool packed = importer.unpack(
+        topic, frames, [&](string_view t, const vector<string_view> &fs) {
+          zmqpp::message out;
+          out.add_raw(t.data(), t.size());
+          for (auto const &f : fs)
+            out.add_raw(f.data(), f.size());
+          frontend.send(out, true);
+        });
+    if (!packed)
+      frontend.send(msg, true);
+  }
+  sub.close();
+  for (auto &s : frontends)
+    s->close();
+}
+
+void print_federation(
+    const Mads::FederationExporter *exporter,
+    const vector<Mads::FederationLink> &links,
+    const vector<unique_ptr<Mads::FederationImporter>> &importers) {
+  if (exporter) {
+    auto j = exporter->stats().json();
+    cout << "Federation endpoint: " << style::bold << j["messages"]
+         << style::reset << " messages in " << j["batches"] << " batches, "
+         << j["bytes"] << " bytes, " << exporter->subscriptions()
+         << " prefixes subscribed" << endl;
+  }
+  for (size_t i = 0; i < importers.size(); i++) {
+    auto j = importers[i]->stats().json();
+    cout << "Federation link " << style::bold << links[i].name
+         << style::reset << ": " << j["messages"] << " messages, "
+         << j["bytes"] << " bytes, dropped " << j["looped"] << " looped and "
+         << j["expired"] << " over max_hops";
+    if (j["invalid"] > 0)
+      cout << fg::yellow << ", " << j["invalid"] << " invalid" << fg::reset;
+    cout << endl;
+  }
+}
+
+void print_peers(Mads::PeerMonitor &peers) {
+  auto j = peers.json();
+  size_t subscribers = 0;
+  for (auto const &p : j["peers"])
+    subscribers += p["side"] == "subscriber";
+  cout << "Peers: " << style::bold << j["peers"].size() - subscribers
+       << style::reset << " publishers, " << style::bold << subscribers
+       << style::reset << " subscribers" << endl;
+  for (auto const &p : peers.slow_consumers()) {
+    cout << fg::yellow << "  Slow consumer " << p.address << " (shard "
+         << p.shard << "): " << p.queued << " of " << p.buffer
+         << " bytes queued, saturated for " << fixed << setprecision(1)
+         << p.saturated_time << " s" << fg::reset << endl;
+  }
+}
+
+// Serves the traffic statistics over HTTP, in the Prometheus text format at
+// /metrics and as JSON at /metrics.json
+void serve_metrics(httplib::Server &server, Mads::TrafficStats &traffic) {
+  server.Get("/metrics", [&](const httplib::Request &req,
+                             httplib::Response &res) {
+    UNUSED(req);
+    res.set_content(traffic.prometheus(), "text/plain; version=0.0.4");
+  });
+  server.Get("/metrics.json", [&](const httplib::Request &req,
+                                  httplib::Response &res) {
+    UNUSED(req);
+    res.set_content(traffic.json().dump(), "application/json");
+  });
+  server.listen_after_bind();
+}
+
+void print_topics(Mads::TrafficStats &traffic, size_t n = 20) {
+  auto rows = traffic.top(n);
+  if (rows.empty())
+    return;
+  cout << style::bold << left << setw(24) << "Topic" << right << setw(7)
+       << "Shard" << setw(13) << "Messages" << setw(15) << "Bytes"
+       << setw(12) << "Msg/s" << setw(14) << "Bytes/s" << style::reset
+       << " (last 10 s)" << endl;
+  for (auto const &r : rows) {
+    cout << left << setw(24) << r.topic << right << setw(7) << r.shard
+         << setw(13) << r.messages << setw(15) << r.bytes << setw(12)
+         << fixed << setprecision(1) << r.rate << setw(14) << r.byte_rate
+         << endl;
+  }
+}
+
+// The proxies copy every message they forward, both ways, to the capture
+// sockets: those the journal thread did not receive were dropped at the
+// high water mark (or are still queued)
+void count_journal_drops(vector<unique_ptr<Shard>> &shards,
+                         Mads::JournalWriter &journal,
+                         const atomic<uint64_t> &received) {
+  uint64_t captured = 0;
+  for (auto &shard : shards) {
+    auto stats = shard->statistics();
+    captured += stats[0] + stats[4];
+  }
+  uint64_t n = received.load(memory_order_relaxed);
+  journal.set_dropped(captured > n ? captured - n : 0);
+}
+
+void print_statistics(vector<unique_ptr<Shard>> &shards) {
+  vector<uint64_t> stats(8, 0);
+  vector<vector<uint64_t>> per_shard;
+  for (auto &shard : shards) {
+    per_shard.push_back(shard->statistics());
+    for (size_t i = 0; i < stats.size(); i++)
+      stats[i] += per_shard.back()[i];
+  }
+  cout << setw(13) << " " << style::bold << setw(13) << "FRONTEND"
+       << setw(13) << "BACKEND" << style::reset << endl;
+  cout << fg::green << setw(13) << "Messages in:" << setw(13) << stats[0]
+       << setw(13) << stats[4] << fg::reset << endl;
+  cout << fg::green << setw(13) << "Bytes in:" << setw(13) << stats[1]
+       << setw(13) << stats[5] << fg::reset << endl;
+  cout << fg::yellow << setw(13) << "Messages out:" << setw(13) << stats[2]
+       << setw(13) << stats[6] << fg::reset << endl;
+  cout << fg::yellow << setw(13) << "Bytes out:" << setw(13) << stats[3]
+       << setw(13) << stats[7] << fg::reset << endl;
+  if (shards.size() < 2)
+    return;
+  cout << style::bold << setw(13) << "Shard" << setw(13) << "Msg in"
+       << setw(13) << "Bytes in" << setw(13) << "Msg out" << setw(13)
+       << "Bytes out" << setw(9) << "Load" << style::reset << endl;
+  for (size_t i = 0; i < shards.size(); i++) {
+    auto &st = per_shard[i];
+    double load = stats[0] > 0 ? 100.0 * st[0] / stats[0] : 0.0;
+    cout << setw(13) << i << setw(13) << st[0] << setw(13) << st[1]
+         << setw(13) << st[6] << setw(13) << st[7] << setw(8) << fixed
+         << setprecision(1) << load << "%" << endl;
+  }
 }
 
 void send_char(char c) {
@@ -201,6 +733,268 @@ void send_char(char c) {
 #endif
 }
 
+/*
+  ____       _   _   _
+ / ___|  ___| |_| |_(_)_ __   __ _ ___
+ \___ \ / _ \ __| __| | '_ \ / _` / __|
+  ___) |  __/ |_| |_| | | | | (_| \__ \
+ |____/ \___|\__|\__|_|_| |_|\__, |___/
+                             |___/
+*/
+
+// Settings service. A ROUTER socket at the settings address load-balances
+// the requests of the agents (REQ) over a pool of REP workers, so that many
+// agents starting together are served concurrently. Replies are built from
+// in-memory copies: the INI text (whole, or scoped to the agent), and the
+// attachments, cached by path and modification time.
+class SettingsServer {
+public:
+  SettingsServer(zmqpp::context &context, Mads::HistoryCache &history)
+      : _context(context), _history(history),
+        _frontend(context, zmqpp::socket_type::router),
+        _backend(context, zmqpp::socket_type::dealer),
+        _controlled(context, zmqpp::socket_type::rep),
+        _controller(context, zmqpp::socket_type::req) {}
+
+  // Reads the settings file. With scoped, agents only get the sections
+  // [agents], [broker], [compression] and their own.
+  void load(const string &path, bool scoped) {
+    std::ifstream t(path);
+    std::stringstream buffer;
+    buffer << t.rdbuf();
+    auto ini = make_shared<const string>(buffer.str());
+    toml::table config = (toml::table)toml::parse(*ini);
+    std::lock_guard lock(_mtx);
+    _ini = ini;
+    _config = std::move(config);
+    _scoped = scoped;
+    _timecode_fps = _config["agents"]["timecode_fps"].value_or(MADS_FPS);
+    _scoped_ini.clear();
+  }
+
+  void start(const string &address, size_t workers, bool &running) {
+    _binding.bind(_frontend, address);
+    _backend.bind("inproc://broker-settings-workers");
+    _controlled.bind("inproc://broker-settings-ctrl");
+    _controller.connect("inproc://broker-settings-ctrl");
+    start_proxy();
+    for (size_t i = 0; i < workers; i++)
+      _workers.emplace_back([this, &running]() { work(running); });
+  }
+
+  // Moves the service to a new address; the workers keep running
+  void rebind(const string &address) {
+    zmqpp::message msg;
+    _controller.send("TERMINATE");
+    _controller.receive(msg);
+    _proxy_thread.join();
+    try {
+      _binding.rebind(_frontend, address);
+    } catch (...) {
+      start_proxy();
+      throw;
+    }
+    start_proxy();
+  }
+
+  const string &address() const { return _binding.address; }
+
+  // Agents running on this host are told to use the ipc endpoints in dir
+  // (none if empty)
+  void set_ipc(const string &hostname, const string &dir) {
+    std::lock_guard lock(_mtx);
+    _hostname = hostname;
+    _ipc_dir = dir;
+  }
+
+  // Stops the proxy and waits for the workers (after running is false)
+  void stop() {
+    zmqpp::message msg;
+    _controller.send("TERMINATE");
+    _controller.receive(msg);
+    _proxy_thread.join();
+    for (auto &w : _workers)
+      w.join();
+    _frontend.close();
+    _backend.close();
+    _controller.close();
+    _controlled.close();
+  }
+
+private:
+  void start_proxy() {
+    _proxy_thread = thread([this]() {
+      zmqpp::proxy_steerable(_frontend, _backend, _controlled);
+    });
+  }
+
+  void work(bool &running) {
+    zmqpp::socket socket(_context, zmqpp::socket_type::rep);
+    socket.set(zmqpp::socket_option::receive_timeout, 500);
+    socket.connect("inproc://broker-settings-workers");
+    zmqpp::message msg;
+    while (running) {
+      if (!socket.receive(msg))
+        continue;
+      zmqpp::message reply;
+      handle(msg, reply);
+      socket.send(reply);
+    }
+    socket.close();
+  }
+
+  // Every request gets a reply, so that the REP worker stays usable
+  void handle(zmqpp::message &msg, zmqpp::message &content) {
+    if (msg.parts() < 2) {
+      cerr << fg::red << "Received malformed message from agent, "
+           << "expected at least 2 parts" << fg::reset << endl;
+      content << LIB_VERSION;
+      return;
+    }
+    string agent_version = msg.get(0);
+    string cmd = msg.get(1);
+    string agent_name = "unknown";
+    if (msg.parts() >= 3) {
+      agent_name = msg.get(2);
+    }
+    if (cmd == "timecode") {
+      chrono::system_clock::time_point now = chrono::system_clock::now();
+      content << to_string(Mads::timecode(now, timecode_fps()));
+      return;
+    }
+    content << LIB_VERSION;
+    if (cmd == "settings") {
+      if (!Mads::check_version(agent_version)) {
+        cerr << fg::red
+             << "Received settings request from agent with wrong version: "
+             << agent_version << " (vs. " << LIB_VERSION << ")" << fg::reset
+             << endl;
+        return;
+      }
+      cout << "Sending settings to agent " << agent_name << " ("
+           << agent_version << ")" << endl;
+      add_shared(content, settings_for(agent_name));
+      if (auto attachment = attachment_for(agent_name))
+        add_shared(content, attachment);
+    } else if (cmd == "endpoints") {
+      // The ipc directory, if the agent (hostname after its name) runs on
+      // this host; otherwise just the version, and the agent uses TCP
+      std::lock_guard lock(_mtx);
+      if (msg.parts() >= 4 && !_ipc_dir.empty() && msg.get(3) == _hostname)
+        content << _ipc_dir;
+    } else if (cmd == "history") {
+      // Cached messages of the topics after the agent name, each as a
+      // frame count followed by the message frames
+      vector<string> prefixes;
+      for (size_t i = 3; i < msg.parts(); i++)
+        prefixes.push_back(msg.get(i));
+      if (Mads::check_version(agent_version)) {
+        auto replay = _history.replay(prefixes);
+        cout << "Replaying " << replay.size() << " cached messages to agent "
+             << agent_name << endl;
+        for (auto &m : replay) {
+          content << to_string(m.parts());
+          for (size_t i = 0; i < m.parts(); i++)
+            content.add_raw(m.raw_data(i), m.size(i));
+        }
+      }
+    } else {
+      cerr << fg::yellow << "Got unexpected command " << cmd << fg::reset
+           << endl;
+    }
+  }
+
+  double timecode_fps() {
+    std::lock_guard lock(_mtx);
+    return _timecode_fps;
+  }
+
+  // Adds a frame without copying the data, which is kept alive by the
+  // message
+  static void add_shared(zmqpp::message &msg, shared_ptr<const string> data) {
+    auto owner = new shared_ptr<const string>(std::move(data));
+    msg.add_nocopy_const((*owner)->data(), (*owner)->size(),
+                         [](void *data, void *hint) {
+                           UNUSED(data);
+                           delete static_cast<shared_ptr<const string> *>(hint);
+                         },
+                         owner);
+  }
+
+  shared_ptr<const string> settings_for(const string &agent) {
+    std::lock_guard lock(_mtx);
+    if (!_scoped)
+      return _ini;
+    auto it = _scoped_ini.find(agent);
+    if (it != _scoped_ini.end())
+      return it->second;
+    toml::table scoped;
+    for (string section : {"agents"s, "broker"s, "compression"s, agent}) {
+      if (auto t = _config[section].as_table())
+        scoped.insert_or_assign(section, *t);
+    }
+    std::stringstream out;
+    out << scoped;
+    auto ini = make_shared<const string>(out.str());
+    _scoped_ini[agent] = ini;
+    return ini;
+  }
+
+  // The attachment of an agent, read again only if changed on disk
+  shared_ptr<const string> attachment_for(const string &agent) {
+    string path;
+    {
+      std::lock_guard lock(_mtx);
+      path = _config[agent]["attachment"].value_or("");
+    }
+    if (path.empty())
+      return nullptr;
+    if (filesystem::path(path).is_relative()) {
+      path = Mads::exec_dir(path);
+    }
+    std::error_code ec;
+    auto mtime = filesystem::last_write_time(path, ec);
+    if (ec) {
+      cerr << fg::red << "attachment path does not exist: " << path
+           << fg::reset << endl;
+      return nullptr;
+    }
+    std::lock_guard lock(_attachments_mtx);
+    auto &entry = _attachments[path];
+    if (!entry.data || entry.mtime != mtime) {
+      ifstream attachment_file(path, ios::in | ios::binary);
+      stringstream attachment_content;
+      attachment_content << attachment_file.rdbuf();
+      entry.data = make_shared<const string>(attachment_content.str());
+      entry.mtime = mtime;
+    }
+    cout << fg::yellow << "  Attaching binary object: " << style::bold << path
+         << " (" << entry.data->size() << " bytes)" << fg::reset << endl;
+    return entry.data;
+  }
+
+  struct attachment {
+    filesystem::file_time_type mtime;
+    shared_ptr<const string> data;
+  };
+
+  zmqpp::context &_context;
+  Mads::HistoryCache &_history;
+  zmqpp::socket _frontend, _backend, _controlled, _controller;
+  Binding _binding;
+  thread _proxy_thread;
+  vector<thread> _workers;
+  std::mutex _mtx; // Guards the settings below
+  shared_ptr<const string> _ini;
+  toml::table _config;
+  bool _scoped = false;
+  double _timecode_fps = MADS_FPS;
+  map<string, shared_ptr<const string>> _scoped_ini;
+  string _hostname, _ipc_dir;
+  std::mutex _attachments_mtx;
+  map<string, attachment> _attachments;
+};
+
 /*
   __  __       _
  |  \/  | __ _(_)_ __
@@ -225,6 +1019,8 @@ int main(int argc, char **argv) {
     ("n,nic", "Network interface name (-n list to list'em all)",
       value<string>())
     ("s,settings", "Settings file path", value<string>())
+    ("r,record", "Record all traffic to a journal in this directory",
+      value<string>()->implicit_value("journal"))
     ("d,daemon", "Run as daemon")
     ("docker", "Run as in container (don't check for file changes)")
     ("v,version", "Print version")
@@ -278,6 +1074,65 @@ int main(int argc, char **argv) {
   backend_address = config[name]["backend_address"].value_or(BROKER_BACKEND);
   settings_address = config[name]["settings_address"].value_or(BROKER_SETTINGS);
   nic = config[name]["nic"].value_or(nic);
+  string metrics_host = config[name]["metrics_host"].value_or("0.0.0.0");
+  int metrics_port = config[name]["metrics_port"].value_or(9094);
+  string ipc_dir = config[name]["ipc_dir"].value_or(BROKER_IPC_DIR);
+  size_t settings_workers = config[name]["settings_workers"].value_or(4);
+  string settings_scope = config[name]["settings_scope"].value_or("full");
+  if (settings_scope != "full" && settings_scope != "agent") {
+    cerr << fg::red << "Invalid settings_scope: " << settings_scope
+         << " (must be \"full\" or \"agent\")" << fg::reset << endl;
+    exit(EXIT_FAILURE);
+  }
+  vector<string> history_topics;
+  if (auto a = config[name]["history_topics"].as_array()) {
+    a->for_each([&](auto &&el) { history_topics.push_back(el.value_or("")); });
+  }
+  Mads::HistoryCache history(config[name]["history"].value_or(0),
+                             history_topics,
+                             config[name]["history_max_topics"].value_or(0));
+  string journal_path = config[name]["journal_path"].value_or("");
+  if (options_parsed.count("record") != 0)
+    journal_path = options_parsed["record"].as<string>();
+  size_t journal_segment_size =
+      config[name]["journal_segment_size"].value_or(256);
+  size_t journal_index_interval =
+      config[name]["journal_index_interval"].value_or(1024);
+  Mads::ShardMap shard_map;
+  try {
+    shard_map = Mads::ShardMap(config[name].as_table());
+  } catch (const std::invalid_argument &e) {
+    cerr << fg::red << "Invalid shard settings: " << e.what() << fg::reset
+         << endl;
+    exit(EXIT_FAILURE);
+  }
+  Mads::SocketOptions frontend_options, backend_options;
+  try {
+    frontend_options = Mads::SocketOptions(config[name]["frontend"].as_table());
+    backend_options = Mads::SocketOptions(config[name]["backend"].as_table());
+  } catch (const std::invalid_argument &e) {
+    cerr << fg::red << "Invalid socket options: " << e.what() << fg::reset
+         << endl;
+    exit(EXIT_FAILURE);
+  }
+  atomic<double> status_period =
+      config[name]["broker_status_period"].value_or(5.0);
+  Mads::PeerMonitor peers(
+      config[name]["slow_consumer_threshold"].value_or(0.8),
+      chrono::milliseconds(
+          (int64_t)(config[name]["slow_consumer_time"].value_or(2.0) * 1000)));
+  char hostname[HOST_NAME_MAX];
+  if (gethostname(hostname, HOST_NAME_MAX))
+    strcpy(hostname, "unknown");
+  Mads::FederationSettings federation;
+  try {
+    federation = Mads::FederationSettings(
+        config[name]["federation"].as_table(), hostname);
+  } catch (const std::invalid_argument &e) {
+    cerr << fg::red << "Invalid federation settings: " << e.what()
+         << fg::reset << endl;
+    exit(EXIT_FAILURE);
+  }
   if (options_parsed.count("nic") != 0) {
     nic = options_parsed["nic"].as<string>();
     cout << "Using network interface " << style::bold << nic << style::reset
@@ -288,93 +1143,377 @@ int main(int argc, char **argv) {
          << endl;
   }
 
-  // Create broker sockets
+  // Create broker sockets, one pair per shard
   zmqpp::context context;
-  zmqpp::socket frontend(context, zmqpp::socket_type::xsub);
-  zmqpp::socket backend(context, zmqpp::socket_type::xpub);
+  context.set(zmqpp::context_option::io_threads, (int)shard_map.count());
+  vector<unique_ptr<Shard>> shards;
 
   try {
-    std::cout << "Binding broker frontend (XSUB) at " << style::bold
-              << frontend_address << style::reset << endl;
-    frontend.bind(frontend_address);
-    std::cout << "Binding broker backend (XPUB) at " << style::bold
-              << backend_address << style::reset << endl;
-    backend.bind(backend_address);
+    for (size_t i = 0; i < shard_map.count(); i++) {
+      auto &shard = shards.emplace_back(make_unique<Shard>(context, i));
+      shard->configure(frontend_options, backend_options);
+      string label = shard_map.enabled() ? " shard " + to_string(i) : "";
+      string f_address = shard_map.endpoint(frontend_address, i);
+      string b_address = shard_map.endpoint(backend_address, i);
+      std::cout << "Binding broker" << label << " frontend (XSUB) at "
+                << style::bold << f_address << style::reset << endl;
+      shard->frontend_binding.bind(shard->frontend, f_address);
+      std::cout << "Binding broker" << label << " backend (XPUB) at "
+                << style::bold << b_address << style::reset << endl;
+      shard->backend_binding.bind(shard->backend, b_address);
+    }
   } catch (const zmqpp::zmq_internal_exception &e) {
     cerr << fg::red << "ZMQ error, could not connect: " << e.what() << fg::reset
          << endl;
     exit(EXIT_FAILURE);
   }
-  // Create Settings socket (Req/Rep)
-  zmqpp::socket settings(context, zmqpp::socket_type::rep);
-  settings.bind(settings_address);
-  settings.set(zmqpp::socket_option::receive_timeout, 1000);
-  cout << "Binding broker shared settings (REP) at " << style::bold
-       << settings_address << style::reset << endl;
-  thread settings_thread([&]() {
-    zmqpp::message msg;
-    std::ifstream t(settings_path);
-    std::stringstream buffer;
-    buffer << t.rdbuf();
-    string ini_table = buffer.str();
-    while (running) {
-      zmqpp::message content;
-      content << LIB_VERSION;
-      if (settings.receive(msg)) {
-        if (msg.parts() < 2) {
-          cerr << fg::red << "Received malformed message from agent, "
-               << "expected at least 2 parts" << fg::reset << endl;
-          continue;
-        }
-        string agent_version = msg.get(0);
-        string cmd = msg.get(1);
-        string agent_name = "unknown";
-        if (msg.parts() == 3) {
-          agent_name = msg.get(2);
-        } 
-        if (cmd == "settings") {
-          if (!Mads::check_version(agent_version)) {
-            cerr << fg::red
-                 << "Received settings request from agent with wrong version: "
-                 << agent_version << " (vs. " << LIB_VERSION << ")" << fg::reset
-                 << endl;
-            continue;
+  // Unix domain sockets for the agents on this host; TCP still works
+  auto bind_ipc = [&](Shard &shard, const string &f_address,
+                      const string &b_address) {
+    try {
+      shard.frontend_ipc.rebind(shard.frontend,
+                                Mads::ipc_endpoint(ipc_dir, f_address));
+      shard.backend_ipc.rebind(shard.backend,
+                               Mads::ipc_endpoint(ipc_dir, b_address));
+    } catch (const zmqpp::zmq_internal_exception &e) {
+      cerr << fg::yellow << "Cannot bind ipc endpoints in " << ipc_dir << ": "
+           << e.what() << ", agents on this host will use TCP" << fg::reset
+           << endl;
+      return false;
+    }
+    return true;
+  };
+  if (!ipc_dir.empty()) {
+    bool bound = true;
+    for (auto &shard : shards)
+      bound = bind_ipc(*shard, shard->frontend_binding.address,
+                       shard->backend_binding.address) && bound;
+    if (bound)
+      cout << "Binding ipc endpoints for local agents at " << style::bold
+           << shards[0]->frontend_ipc.address << style::reset << " and "
+           << style::bold << shards[0]->backend_ipc.address << style::reset
+           << endl;
+    else
+      ipc_dir.clear();
+  }
+  if (!(backend_options == Mads::SocketOptions()) ||
+      !(frontend_options == Mads::SocketOptions())) {
+    cout << "Socket options: frontend " << style::bold
+         << frontend_options.json() << style::reset << ", backend "
+         << style::bold << backend_options.json() << style::reset << endl;
+  }
+  if (shard_map.enabled()) {
+    cout << "Topics partitioned over " << style::bold << shard_map.count()
+         << " shards" << style::reset;
+    for (auto const &[prefix, i] : shard_map.prefixes())
+      cout << ", " << prefix << "* -> " << i;
+    cout << " (others by hash)" << endl;
+  }
+  // Create Settings service (Router/Rep workers)
+  SettingsServer settings(context, history);
+  settings.set_ipc(hostname, ipc_dir);
+  try {
+    settings.load(settings_path, settings_scope == "agent");
+    settings.start(settings_address, settings_workers, running);
+  } catch (const std::exception &e) {
+    cerr << fg::red << "Cannot start settings service: " << e.what()
+         << fg::reset << endl;
+    exit(EXIT_FAILURE);
+  }
+  cout << "Binding broker shared settings (ROUTER, " << settings_workers
+       << " workers) at " << style::bold << settings_address << style::reset
+       << endl;
+
+  // Per-topic traffic statistics
+  Mads::TrafficStats traffic;
+  thread capture_thread(capture_traffic, ref(context), cref(shard_map),
+                        ref(traffic), ref(history), ref(running));
+  if (history.enabled()) {
+    cout << "Caching the last " << style::bold << history.depth()
+         << style::reset << " messages of ";
+    if (history.topics().empty())
+      cout << "all topics";
+    for (auto const &t : history.topics())
+      cout << t << "* ";
+    if (history.max_topics() > 0)
+      cout << "(up to " << history.max_topics() << " topics)";
+    cout << endl;
+  }
+  // The cached topics are needed even if no agent subscribes to them
+  vector<string> history_subscriptions = history.subscriptions();
+  for (auto &shard : shards)
+    shard->subscribe(history_subscriptions, {});
+  // Peers and slow consumers
+  thread peers_thread(watch_peers, ref(context), cref(shard_map), ref(peers),
+                      ref(traffic), cref(status_period), ref(running));
+  if (status_period > 0) {
+    cout << "Publishing broker status on topic " << style::bold
+         << BROKER_STATUS_TOPIC << style::reset << " every " << status_period
+         << " s" << endl;
+  }
+
+  // Traffic journal (opt-in)
+  Mads::JournalWriter journal;
+  atomic<uint64_t> journal_received = 0;
+  thread journal_thread;
+  if (!journal_path.empty()) {
+    try {
+      journal.open(journal_path, journal_segment_size << 20,
+                   journal_index_interval << 10);
+      journal_thread = thread(record_journal, ref(context), shard_map.count(),
+                              ref(journal), ref(journal_received),
+                              ref(running));
+      cout << "Recording traffic to " << style::bold << journal_path
+           << style::reset << " (" << journal_segment_size
+           << " MB segments)" << endl;
+    } catch (const std::exception &e) {
+      cerr << fg::red << "Cannot open journal " << journal_path << ": "
+           << e.what() << fg::reset << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  // Federation with other brokers (opt-in)
+  Mads::FederationLedger ledger;
+  unique_ptr<zmqpp::socket> federation_endpoint;
+  unique_ptr<Mads::FederationExporter> exporter;
+  thread federation_thread;
+  if (!federation.address.empty()) {
+    federation_endpoint =
+        make_unique<zmqpp::socket>(context, zmqpp::socket_type::xpub);
+    try {
+      federation_endpoint->bind(federation.address);
+    } catch (const zmqpp::zmq_internal_exception &e) {
+      cerr << fg::red << "Cannot bind federation endpoint "
+           << federation.address << ": " << e.what() << fg::reset << endl;
+      exit(EXIT_FAILURE);
+    }
+    exporter = make_unique<Mads::FederationExporter>(
+        federation, ledger,
+        [&](const string &topic, string &&envelope, string &&body) {
+          zmqpp::message msg;
+          msg << topic << envelope << body;
+          federation_endpoint->send(msg, true);
+        });
+    federation_thread =
+        thread(serve_federation, ref(context), shard_map.count(),
+               ref(*federation_endpoint), ref(*exporter),
+               federation.batch.latency, ref(running));
+    cout << "Serving federation as " << style::bold << federation.name
+         << style::reset << " at " << style::bold << federation.address
+         << style::reset << " (compression "
+         << Mads::wire_codec_map.at(federation.codec) << ", batches of "
+         << federation.batch.size << " bytes)" << endl;
+  }
+  vector<unique_ptr<Mads::FederationImporter>> importers;
+  vector<thread> link_threads;
+  for (auto const &link : federation.links) {
+    // Without endpoint, the origins of pulled messages are not needed
+    auto &importer = importers.emplace_back(
+        make_unique<Mads::FederationImporter>(federation, link,
+                                              exporter ? &ledger : nullptr));
+    link_threads.emplace_back(pull_federation, ref(context), cref(shard_map),
+                              cref(link), ref(*importer), ref(running));
+    cout << "Pulling ";
+    if (link.topics.empty())
+      cout << "all topics ";
+    for (auto const &t : link.topics)
+      cout << t << "* ";
+    cout << "from " << style::bold << link.name << style::reset << " at "
+         << style::bold << link.address << style::reset << endl;
+  }
+
+  unique_ptr<httplib::Server> metrics;
+  thread metrics_thread;
+  // (Re)starts the metrics server; port 0 stops it
+  auto start_metrics = [&](const string &host, int port) {
+    if (metrics_thread.joinable()) {
+      metrics->stop();
+      metrics_thread.join();
+    }
+    metrics.reset();
+    if (port <= 0)
+      return;
+    metrics = make_unique<httplib::Server>();
+    if (metrics->bind_to_port(host, port)) {
+      cout << "Serving traffic metrics at " << style::bold << "http://" << ip
+           << ":" << port << "/metrics" << style::reset << endl;
+      metrics_thread = thread(serve_metrics, ref(*metrics), ref(traffic));
+    } else {
+      cerr << fg::yellow << "Cannot serve metrics on port " << port
+           << fg::reset << endl;
+    }
+  };
+  start_metrics(metrics_host, metrics_port);
+
+  // Reloads the settings file in place, without closing the connections:
+  // agents get the new settings with their next request, and only changed
+  // endpoints are rebound. Returns false if the shard layout changed, which
+  // needs a restart (agents must reconnect anyway).
+  auto reload_settings = [&]() -> bool {
+    toml::table new_config;
+    Mads::ShardMap new_map;
+    try {
+      new_config = toml::parse_file(settings_path);
+      new_map = Mads::ShardMap(new_config[name].as_table());
+    } catch (const toml::parse_error &err) {
+      cerr << fg::red << "Cannot reload settings file " << settings_path
+           << ", " << err << fg::reset << endl;
+      return true;
+    } catch (const std::invalid_argument &e) {
+      cerr << fg::red << "Invalid shard settings: " << e.what() << fg::reset
+           << endl;
+      return true;
+    }
+    if (!(new_map == shard_map))
+      return false;
+    auto cfg = new_config[name];
+    string scope = cfg["settings_scope"].value_or("full");
+    if (scope != "full" && scope != "agent") {
+      cerr << fg::red << "Invalid settings_scope: " << scope
+           << ", settings not reloaded" << fg::reset << endl;
+      return true;
+    }
+
+    // Settings and attachments served to agents
+    try {
+      settings.load(settings_path, scope == "agent");
+    } catch (const std::exception &e) {
+      cerr << fg::red << "Cannot reload settings: " << e.what() << fg::reset
+           << endl;
+      return true;
+    }
+    settings_scope = scope;
+    timecode_fps = new_config["agents"]["timecode_fps"].value_or(MADS_FPS);
+
+    // Endpoints
+    string f_address = cfg["frontend_address"].value_or(BROKER_FRONTEND);
+    string b_address = cfg["backend_address"].value_or(BROKER_BACKEND);
+    string new_ipc_dir = cfg["ipc_dir"].value_or(BROKER_IPC_DIR);
+    bool ipc_bound = true;
+    for (size_t i = 0; i < shards.size(); i++) {
+      Shard &shard = *shards[i];
+      string f = shard_map.endpoint(f_address, i);
+      string b = shard_map.endpoint(b_address, i);
+      bool ipc_changed =
+          Mads::ipc_endpoint(new_ipc_dir, f) != shard.frontend_ipc.address ||
+          Mads::ipc_endpoint(new_ipc_dir, b) != shard.backend_ipc.address;
+      if (f == shard.frontend_binding.address &&
+          b == shard.backend_binding.address && !ipc_changed)
+        continue;
+      try {
+        shard.suspend([&]() {
+          if (ipc_changed) {
+            ipc_dir = new_ipc_dir;
+            ipc_bound = bind_ipc(shard, f, b) && ipc_bound;
           }
-          cout << "Sending settings to agent " << agent_name << " ("
-               << agent_version << ")" << endl;
-          content << ini_table;
-          string attachment_path = config[agent_name]["attachment"].value_or("");
-          if (!attachment_path.empty()) {
-            if (filesystem::path(attachment_path).is_relative()) {
-              attachment_path = Mads::exec_dir(attachment_path);
-            }
-            if (!filesystem::exists(attachment_path)) {
-              cerr << fg::red << "attachment path does not exist: "
-                   << attachment_path << fg::reset << endl;
-            } else {
-              ifstream attachment_file(attachment_path, ios::in | ios::binary);
-              stringstream attachment_content;
-              cout << fg::yellow << "  Attaching binary object: "
-                   << style::bold << attachment_path
-                   << " (" << filesystem::file_size(attachment_path) << " bytes)"
-                   << fg::reset << endl;
-              attachment_content << attachment_file.rdbuf();
-              content << attachment_content.str();
-            }
+          if (f != shard.frontend_binding.address) {
+            shard.frontend_binding.rebind(shard.frontend, f);
+            cout << "Rebound broker frontend (XSUB) at " << style::bold << f
+                 << style::reset << endl;
           }
-          settings.send(content);
-        } else if (cmd == "timecode") {
-          chrono::system_clock::time_point now = chrono::system_clock::now();
-          settings.send(to_string(Mads::timecode(now, timecode_fps)));
-        } else {
-          cerr << fg::yellow << "Got unexpected command " << cmd << fg::reset
-               << endl;
-          settings.send(content);
-        }
+          if (b != shard.backend_binding.address) {
+            shard.backend_binding.rebind(shard.backend, b);
+            cout << "Rebound broker backend (XPUB) at " << style::bold << b
+                 << style::reset << endl;
+          }
+        });
+      } catch (const zmqpp::zmq_internal_exception &e) {
+        cerr << fg::red << "Cannot rebind shard " << i << ": " << e.what()
+             << fg::reset << endl;
       }
     }
-    settings.close();
-  });
+    frontend_address = f_address;
+    backend_address = b_address;
+    if (!ipc_bound)
+      ipc_dir.clear();
+    settings.set_ipc(hostname, ipc_dir);
+    string s_address = cfg["settings_address"].value_or(BROKER_SETTINGS);
+    if (s_address != settings.address()) {
+      try {
+        settings.rebind(s_address);
+        settings_address = s_address;
+        cout << "Rebound broker shared settings at " << style::bold
+             << s_address << style::reset << endl;
+      } catch (const zmqpp::zmq_internal_exception &e) {
+        cerr << fg::red << "Cannot rebind settings to " << s_address << ": "
+             << e.what() << fg::reset << endl;
+      }
+    }
+
+    // Backpressure, for the peers connecting from now on
+    try {
+      Mads::SocketOptions f_options(cfg["frontend"].as_table());
+      Mads::SocketOptions b_options(cfg["backend"].as_table());
+      if (!(f_options == frontend_options) ||
+          !(b_options == backend_options)) {
+        for (auto &shard : shards)
+          shard->suspend([&]() { shard->configure(f_options, b_options); });
+        frontend_options = f_options;
+        backend_options = b_options;
+        cout << "Socket options: frontend " << style::bold
+             << frontend_options.json() << style::reset << ", backend "
+             << style::bold << backend_options.json() << style::reset
+             << " (for new connections)" << endl;
+      }
+    } catch (const std::invalid_argument &e) {
+      cerr << fg::red << "Invalid socket options: " << e.what() << fg::reset
+           << endl;
+    }
+    status_period = cfg["broker_status_period"].value_or(5.0);
+    peers.configure(
+        cfg["slow_consumer_threshold"].value_or(0.8),
+        chrono::milliseconds(
+            (int64_t)(cfg["slow_consumer_time"].value_or(2.0) * 1000)));
+
+    // Statistics
+    history_topics.clear();
+    if (auto a = cfg["history_topics"].as_array()) {
+      a->for_each(
+          [&](auto &&el) { history_topics.push_back(el.value_or("")); });
+    }
+    history.configure(cfg["history"].value_or(0), history_topics,
+                      cfg["history_max_topics"].value_or(0));
+    if (history.subscriptions() != history_subscriptions) {
+      auto old_subscriptions = history_subscriptions;
+      history_subscriptions = history.subscriptions();
+      for (auto &shard : shards)
+        shard->suspend([&]() {
+          shard->subscribe(history_subscriptions, old_subscriptions);
+        });
+    }
+    string m_host = cfg["metrics_host"].value_or("0.0.0.0");
+    int m_port = cfg["metrics_port"].value_or(9094);
+    if (m_host != metrics_host || m_port != metrics_port) {
+      metrics_host = m_host;
+      metrics_port = m_port;
+      start_metrics(metrics_host, metrics_port);
+    }
+
+    // Needing a restart
+    auto old_cfg = config[name];
+    try {
+      if (!(Mads::FederationSettings(cfg["federation"].as_table(),
+                                     hostname) == federation))
+        cout << fg::yellow
+             << "Changes to federation take effect at the next restart"
+             << fg::reset << endl;
+    } catch (const std::invalid_argument &e) {
+      cerr << fg::red << "Invalid federation settings: " << e.what()
+           << fg::reset << endl;
+    }
+    if (cfg["settings_workers"].value_or(4) !=
+            old_cfg["settings_workers"].value_or(4) ||
+        cfg["journal_path"].value_or(""s) !=
+            old_cfg["journal_path"].value_or(""s)) {
+      cout << fg::yellow
+           << "Changes to settings_workers and journal_path take effect "
+              "at the next restart"
+           << fg::reset << endl;
+    }
+    config = std::move(new_config);
+    cout << fg::green << "Settings reloaded" << fg::reset << endl;
+    return true;
+  };
 
   cout << "Timecode FPS: " << style::bold << timecode_fps << style::reset
        << endl;
@@ -389,39 +1528,46 @@ int main(int argc, char **argv) {
     cout << fg::yellow
          << "Running in container mode, remember to restart if mads.ini changes"
          << fg::reset << endl;
-    zmqpp::proxy(frontend, backend);
+    proxy_all(shards);
     exit(EXIT_SUCCESS);
   }
   thread watcher_thread;
   // Run as a daemon
   if (options_parsed.count("daemon") != 0) {
-    thread watcher_thread([&]() {
+    atomic<bool> reload_requested = false;
+    watcher_thread = thread([&]() {
       Mads::Watcher watcher(settings_path);
       watcher.watch(&running, [&](const std::string &file_name) {
         cout << fg::yellow << "Settings file " << file_name
-             << " has been modified, exiting..." << fg::reset << endl;
-        raise(SIGUSR1);
+             << " has been modified, reloading..." << fg::reset << endl;
+        reload_requested = true;
       });
     });
     cout << "Running as daemon with PID " << getpid()
-         << ", will exit upon changes to " << settings_path << endl;
-    zmqpp::proxy(frontend, backend);
+         << ", will reload upon changes to " << settings_path << endl;
+    for (auto &shard : shards)
+      shard->start();
+    // Sockets are only steered from this thread
+    while (running) {
+      this_thread::sleep_for(250ms);
+      if (reload_requested.exchange(false) && !reload_settings()) {
+        cout << fg::yellow << "Shard layout changed, exiting..." << fg::reset
+             << endl;
+        raise(SIGUSR1);
+      }
+    }
     cerr << "Proxy exited" << endl;
   }
 #else
   if (options_parsed.count("daemon") != 0) {
     cout << "Running as daemon with PID " << getpid << endl;
-    zmqpp::proxy(frontend, backend);
+    proxy_all(shards);
     cerr << "Proxy exited" << endl;
   }
 #endif
 
   // Run interactively as a steerable proxy
   else {
-    zmqpp::socket controlled(context, zmqpp::socket_type::rep);
-    controlled.bind("inproc://broker-ctrl");
-    zmqpp::socket controller(context, zmqpp::socket_type::req);
-    controller.connect("inproc://broker-ctrl");
 
 #ifndef _WIN32
     // to stop this thread on Q, need implementing
@@ -436,7 +1582,8 @@ int main(int argc, char **argv) {
     });
 #endif
 
-    thread proxy_thread(proxy, ref(frontend), ref(backend), ref(controlled));
+    for (auto &shard : shards)
+      shard->start();
     cout << style::italic << "CTRL-C to immediate exit" << style::reset << endl;
 #ifdef _WIN32
     cout << fg::green
@@ -445,12 +1592,16 @@ int main(int argc, char **argv) {
 #else
     cout << fg::green
          << "Type P to pause, R to resume, I for information, Q to clean "
-            "quit, X to restart and reload settings"
+            "quit, X to reload settings"
          << fg::reset << endl;
 #endif
 
+    // Commands are broadcast to all the shards
+    auto command = [&](const string &cmd) {
+      for (auto &shard : shards)
+        shard->command(cmd);
+    };
     while (running) {
-      zmqpp::message msg;
       char c = key_press();
       switch (c) {
 #ifndef _WIN32
@@ -458,52 +1609,52 @@ int main(int argc, char **argv) {
       // key_press() function does not work anymore
       case 'x':
       case 'X':
+        // A new shard layout needs a restart, anything else is applied in
+        // place
+        if (reload_settings())
+          break;
+        cout << fg::yellow << "Shard layout changed" << fg::reset << endl;
         reload = true;
 #endif
       case 'q':
       case 'Q':
-        controller.send("TERMINATE");
-        controller.receive(msg);
+        // Last count, while the proxies still answer
+        if (journal_thread.joinable())
+          count_journal_drops(shards, journal, journal_received);
+        command("TERMINATE");
         running = false;
         break;
       case 'r':
       case 'R':
         // NOTE: there is a bug in zmqpp lib and PAUSE and RESUME commands
         // have inverted meanings
-        controller.send("RESUME");
-        controller.receive(msg);
+        command("RESUME");
         cout << "Resuming operation" << endl;
         break;
       case 'p':
       case 'P':
-        controller.send("PAUSE");
-        controller.receive(msg);
+        command("PAUSE");
         cout << "Pausing operation" << endl;
         break;
       case 'i':
-      case 'I': {
-        controller.send("STATISTICS");
-        controller.receive(msg);
-        vector<uint64_t> stats;
-        for (size_t i = 0; i < msg.parts(); i++) {
-          stats.push_back(msg.get<uint64_t>(i));
+      case 'I':
+        print_statistics(shards);
+        print_topics(traffic);
+        print_peers(peers);
+        print_federation(exporter.get(), federation.links, importers);
+        if (journal_thread.joinable()) {
+          count_journal_drops(shards, journal, journal_received);
+          auto j = journal.stats();
+          cout << "Journal: " << style::bold << j["records"] << style::reset
+               << " records, " << j["bytes"] << " bytes, " << j["segments"]
+               << " segments";
+          if (j["dropped"] > 0 || j["rejected"] > 0)
+            cout << fg::yellow << ", " << j["dropped"]
+                 << " dropped (capture queue full), " << j["rejected"]
+                 << " rejected (too large)" << fg::reset;
+          cout << endl;
         }
-        cout << setw(13) << " " << style::bold << setw(13) << "FRONTEND"
-             << setw(13) << "BACKEND" << style::reset << endl;
-        cout << fg::green << setw(13) << "Messages in:" << setw(13)
-             << htonll(stats[0]) << setw(13) << htonll(stats[4]) << fg::reset
-             << endl;
-        cout << fg::green << setw(13) << "Bytes in:" << setw(13)
-             << htonll(stats[1]) << setw(13) << htonll(stats[5]) << fg::reset
-             << endl;
-        cout << fg::yellow << setw(13) << "Messages out:" << setw(13)
-             << htonll(stats[2]) << setw(13) << htonll(stats[6]) << fg::reset
-             << endl;
-        cout << fg::yellow << setw(13) << "Bytes out:" << setw(13)
-             << htonll(stats[3]) << setw(13) << htonll(stats[7]) << fg::reset
-             << endl;
         break;
-      }
       default:
 #ifdef _WIN32
         cout << fg::green
@@ -513,7 +1664,7 @@ int main(int argc, char **argv) {
 #else
         cout << fg::green
              << "Type P to pause, R to resume, I for information, Q to clean "
-                "quit, X to restart and reload settings"
+                "quit, X to reload settings"
              << fg::reset << endl;
 #endif
         break;
@@ -522,15 +1673,27 @@ int main(int argc, char **argv) {
 
     cout << fg::green << "Closing sockets..." << fg::reset << endl;
     running = false;
-    proxy_thread.join();
-    settings_thread.join();
+    Mads::Reactor::wake_all(); // Peers and federation threads
+    for (auto &shard : shards)
+      shard->close();
+    capture_thread.join();
+    peers_thread.join();
+    if (federation_thread.joinable())
+      federation_thread.join();
+    for (auto &t : link_threads)
+      t.join();
+    if (journal_thread.joinable()) {
+      journal_thread.join();
+      auto j = journal.stats();
+      cout << "Journal closed after " << j["records"] << " records, "
+           << j["bytes"] << " bytes, " << j["dropped"] << " dropped, "
+           << j["rejected"] << " rejected" << endl;
+    }
+    start_metrics("", 0);
+    settings.stop();
 #ifndef _WIN32
     watcher_thread.join();
 #endif
-    frontend.close();
-    backend.close();
-    controller.close();
-    controlled.close();
     context.terminate();
     if (reload) {
       cout << fg::yellow << "Restarting..." << fg::reset << endl;
@@ -45,17 +45,16 @@ int main(int argc, char *argv[]) {
   dealer.loop([&]() {
     json j;
     message_type type = dealer.receive();
-    auto msg = dealer.last_message();
     dealer.remote_control();
     switch (type) {
     case message_type::json:
       try {
-        j = json::parse(get<1>(msg));
+        j = dealer.last_json();
       } catch (const std::exception &e) {
         count_err++;
         break;
       }
-      dealer.push(get<1>(msg));
+      dealer.push(string(dealer.last_payload_view()));
       dealer.publish(j);
       break;
     case message_type::none:
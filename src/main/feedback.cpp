@@ -56,19 +56,18 @@ int main(int argc, char *argv[]) {
   cout << fg::green << "Feedback process started" << fg::reset << endl;
   agent.loop([&]() {
     message_type type = agent.receive();
-    auto msg = agent.last_message();
     agent.remote_control();
-    if (get<0>(msg) == LOGGER_STATUS_TOPIC) {
+    if (agent.last_topic_view() == LOGGER_STATUS_TOPIC) {
       return;
     }
     switch (type) {
     case message_type::json:
       if (width > 0) {
-        cout << style::bold << agent.last_topic() << ": " << style::reset 
-             << get<1>(msg).substr(0, width) << "..." << endl;
+        cout << style::bold << agent.last_topic_view() << ": " << style::reset 
+             << agent.last_payload_view().substr(0, width) << "..." << endl;
       } else {
-        cout << style::bold << agent.last_topic() << ": " << style::reset 
-             << json::parse(get<1>(msg)).dump(indent) << endl;
+        cout << style::bold << agent.last_topic_view() << ": " << style::reset 
+             << agent.last_json().dump(indent) << endl;
       }
       break;
     case message_type::blob:
@@ -22,17 +22,17 @@ using namespace Mads;
 
 int main(int argc, char *argv[]) {
   string settings_uri = SETTINGS_URI;
-  chrono::milliseconds sampling_time{500};
 
   // CLI options
   Options options(argv[0]);
   options.add_options()
-      ("p", "Sampling period (default 500 ms)", value<size_t>());
+      ("p", "Sampling period (deprecated and ignored, changes are published "
+            "as they happen)",
+       value<size_t>());
   SETUP_OPTIONS(options, Image);
-
-  // Settings
   if (options_parsed.count("p") != 0) {
-    sampling_time = chrono::milliseconds(options_parsed["p"].as<size_t>());
+    cout << fg::yellow << "Option -p is deprecated and ignored: changes are "
+         << "published as they happen" << fg::reset << endl;
   }
 
   // Core stuff
@@ -51,9 +51,14 @@ int main(int argc, char *argv[]) {
 
   // Main loop
   cout << fg::green << "Image process started" << fg::reset << endl;
-  image.loop([&]() {
-    image.publish_change();
-  }, sampling_time);
+  image.reactor().add(image.watch_fd(), [&]() {
+    try {
+      image.publish_change();
+    } catch (const std::exception &e) {
+      cerr << fg::red << e.what() << fg::reset << endl;
+    }
+  });
+  image.run();
   cout << fg::green << "Image process stopped" << fg::reset << endl;
 
   // Cleanup
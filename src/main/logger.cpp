@@ -75,29 +75,25 @@ int main(int argc, char *argv[]) {
   logger.register_event(Mads::event_type::startup);
   logger.info();
 
-  // Create and start the thread
-  std::thread logger_status_thread([&logger] {
+  // Publish the logger status every second
+  auto publish_status = [&logger] {
     json j;
-    while (Mads::running) {
-      j["logger_paused"] = logger.paused;
-      logger.publish(j, LOGGER_STATUS_TOPIC);
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-    }
-    cout << "Logger thread stopped" << endl;
-  });
+    j["logger_paused"] = logger.paused;
+    logger.publish(j, LOGGER_STATUS_TOPIC);
+  };
+  publish_status();
+  logger.reactor().add_timer(std::chrono::seconds(1), publish_status);
 
 
   // Main loop
+  uint64_t echo_version = 0;
   cout << fg::green << "Logger process started" << fg::reset << endl;
   if (logger.paused) 
     cout << fg::yellow << "Logging is paused" << fg::reset << endl;
-  logger.loop([&] {
-    message_type type = logger.receive();
-    if (type == message_type::none) return;
-    auto msg = logger.last_message();
+  logger.on_receive([&](message_type type) {
     // check for pause/unpause message
-    if (get<0>(msg) == "metadata") {
-      auto j = json::parse(get<1>(msg));
+    if (type == message_type::json && logger.last_topic_view() == "metadata") {
+      auto j = logger.last_json();
       if (!j["pause"].is_null()) {
         logger.paused = j["pause"].get<bool>();
         if (logger.paused) 
@@ -110,16 +106,20 @@ int main(int argc, char *argv[]) {
     // if echo is on, provide feedback
     if (echo) {
       if (type == message_type::json) {
-        for (auto const &[k, v] : logger.status()) {
+        // only the topics updated since the last echo
+        auto changes = logger.status_changes(echo_version);
+        echo_version = logger.status_version();
+        for (auto const &[k, rec] : changes.entries) {
           cout << (logger.paused ? fg::yellow : fg::green)
                 << style::bold << k << ": " << style::reset << fg::reset
-                << logger.truncated_message(v) << endl;
+                << logger.truncated_message(string(rec->value.payload()))
+                << endl;
         }
       } else if (type == message_type::blob) {
         cout << (logger.paused ? fg::yellow : fg::green)
-              << style::bold << get<0>(logger.last_blob()) << ": "
-              << style::reset << get<1>(logger.last_blob()) << "("
-              << get<2>(logger.last_blob()).size() << " bytes)" << endl;
+              << style::bold << logger.last_blob_topic_view() << ": "
+              << style::reset << logger.last_blob_meta_view() << "("
+              << logger.last_blob_view().size() << " bytes)" << endl;
       } 
       cout << fg::reset << style::reset << endl;
     }
@@ -131,10 +131,10 @@ int main(int argc, char *argv[]) {
       cout << e.what() << endl;
     }
   });
+  logger.run();
   cout << fg::green << "Logger process stopped" << fg::reset << endl;
 
   // Cleanup
-  logger_status_thread.join();
   logger.register_event(Mads::event_type::shutdown);
   logger.disconnect(); // Not necessary, called by destructor
   logger.close_db();      // Not necessary, called by destructor
@@ -63,6 +63,7 @@ int main(int argc, char *argv[]) {
     }
   }, time);
   cout << fg::green << "Metadata process stopped" << fg::reset << endl;
+  cout << "Loop statistics: " << metadata.loop_stats().json().dump() << endl;
 
   // Cleanup
   metadata.register_event(event_type::shutdown);
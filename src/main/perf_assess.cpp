@@ -7,19 +7,252 @@
  |_|              |_____|
 
 
-Assess network performance.
+Assess network performance. With -c, compares the latency and throughput
+of the transports: TCP, ipc and inproc sockets, and the broker reached over
+TCP and over its ipc endpoints.
 
 Author(s): Paolo Bosetti
 */
 #include "../mads.hpp"
 #include "../agent.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <cxxopts.hpp>
+#include <filesystem>
+#include <future>
+#include <iomanip>
 
 using namespace std;
 using namespace cxxopts;
 using json = nlohmann::json;
 using namespace Mads;
 
+// Round trip times and burst rate of a transport
+struct bench_result {
+  vector<double> rtt; // Microseconds
+  double rate = 0;    // Messages per second
+  size_t sent = 0, received = 0, lost = 0;
+};
+
+// Endpoints of a benchmark: pings go from a to b on ping_*, and come back on
+// pong_*. If bind, the publishers bind (direct sockets); otherwise all the
+// sockets connect (through the broker).
+struct bench_endpoints {
+  string ping_pub, ping_sub, pong_pub, pong_sub;
+  bool bind;
+};
+
+// Measures n round trips of len bytes, then sends n messages in a burst
+bench_result bench(zmqpp::context &context, bench_endpoints ep, size_t n,
+                   size_t len) {
+  string tag = to_string(getpid());
+  string ping = "perf_ping_" + tag, pong = "perf_pong_" + tag,
+         burst = "perf_burst_" + tag;
+  zmqpp::socket a_pub(context, zmqpp::socket_type::pub);
+  zmqpp::socket a_sub(context, zmqpp::socket_type::sub);
+  a_pub.set(zmqpp::socket_option::send_high_water_mark, 0);
+  a_sub.set(zmqpp::socket_option::receive_timeout, 1000);
+  if (ep.bind) {
+    a_pub.bind(ep.ping_pub);
+    a_pub.get(zmqpp::socket_option::last_endpoint, ep.ping_sub);
+  } else {
+    a_pub.connect(ep.ping_pub);
+  }
+
+  // The echo side
+  atomic<bool> echoing = true;
+  atomic<size_t> burst_received = 0;
+  atomic<int64_t> burst_end = 0;
+  string pong_endpoint;
+  promise<string> bound;
+  thread echo([&]() {
+    zmqpp::socket b_sub(context, zmqpp::socket_type::sub);
+    zmqpp::socket b_pub(context, zmqpp::socket_type::pub);
+    b_sub.set(zmqpp::socket_option::receive_timeout, 100);
+    b_sub.set(zmqpp::socket_option::receive_high_water_mark, 0);
+    b_sub.connect(ep.ping_sub);
+    b_sub.subscribe(ping);
+    b_sub.subscribe(burst);
+    string endpoint = ep.pong_pub;
+    if (ep.bind) {
+      b_pub.bind(ep.pong_pub);
+      b_pub.get(zmqpp::socket_option::last_endpoint, endpoint);
+    } else {
+      b_pub.connect(ep.pong_pub);
+    }
+    bound.set_value(endpoint);
+    zmqpp::message msg;
+    while (echoing) {
+      if (!b_sub.receive(msg))
+        continue;
+      if (msg.get(0) == burst) {
+        burst_received++;
+        burst_end = chrono::steady_clock::now().time_since_epoch().count();
+        continue;
+      }
+      zmqpp::message reply;
+      reply << pong;
+      reply.add_raw(msg.raw_data(1), msg.size(1));
+      b_pub.send(reply);
+    }
+    b_sub.close();
+    b_pub.close();
+  });
+  pong_endpoint = bound.get_future().get();
+  a_sub.connect(ep.bind ? pong_endpoint : ep.pong_sub);
+  a_sub.subscribe(pong);
+
+  string payload(max<size_t>(len, sizeof(uint64_t)), 'x');
+  auto send = [&](const string &topic, uint64_t id) {
+    memcpy(payload.data(), &id, sizeof(id));
+    zmqpp::message msg;
+    msg << topic << payload;
+    a_pub.send(msg);
+  };
+  // Until subscriptions have propagated, pings are lost
+  zmqpp::message msg;
+  bench_result r;
+  bool joined = false;
+  for (int i = 0; i < 20 && !joined; i++) {
+    send(ping, UINT64_MAX);
+    joined = a_sub.receive(msg);
+  }
+  while (a_sub.receive(msg, true)) {
+  }
+  if (!joined) {
+    echoing = false;
+    echo.join();
+    a_pub.close();
+    a_sub.close();
+    throw AgentError("no echo");
+  }
+
+  // Round trips
+  for (uint64_t i = 0; i < n && Mads::running; i++) {
+    auto t0 = chrono::steady_clock::now();
+    send(ping, i);
+    bool got = false;
+    while (a_sub.receive(msg)) {
+      uint64_t id;
+      memcpy(&id, msg.raw_data(1), sizeof(id));
+      if (id == i) {
+        got = true;
+        break;
+      }
+    }
+    if (!got) {
+      r.lost++;
+      continue;
+    }
+    r.rtt.push_back(chrono::duration<double, micro>(
+                        chrono::steady_clock::now() - t0)
+                        .count());
+  }
+
+  // Burst
+  auto t0 = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < n && Mads::running; i++, r.sent++)
+    send(burst, i);
+  size_t last = 0;
+  do {
+    last = burst_received;
+    this_thread::sleep_for(200ms);
+  } while (burst_received != last && burst_received < r.sent);
+  r.received = burst_received;
+  chrono::duration<double> elapsed =
+      chrono::steady_clock::time_point(
+          chrono::steady_clock::duration(burst_end.load())) -
+      t0;
+  if (elapsed.count() > 0)
+    r.rate = r.received / elapsed.count();
+
+  echoing = false;
+  echo.join();
+  a_pub.close();
+  a_sub.close();
+  return r;
+}
+
+void print_result(const string &name, bench_result &r, size_t len) {
+  cout << left << setw(20) << name << right << fixed << setprecision(1);
+  if (r.rtt.empty()) {
+    cout << fg::red << "  no replies" << fg::reset << endl;
+    return;
+  }
+  sort(r.rtt.begin(), r.rtt.end());
+  double mean = 0;
+  for (double t : r.rtt)
+    mean += t;
+  mean /= r.rtt.size();
+  auto pct = [&](double p) { return r.rtt[(size_t)(p * (r.rtt.size() - 1))]; };
+  cout << setw(10) << mean << setw(10) << pct(0.5) << setw(10) << pct(0.99)
+       << setw(12) << setprecision(0) << r.rate << setw(10)
+       << setprecision(1) << r.rate * len / 1e6 << setw(8)
+       << r.lost + (r.sent - r.received) << endl;
+  cout.unsetf(ios::floatfield);
+}
+
+// Compares the transports, and the broker endpoints of agent
+void compare(Agent &agent, size_t n, size_t len) {
+  zmqpp::context context;
+  string tag = to_string(getpid());
+  vector<pair<string, bench_endpoints>> cases;
+  cases.push_back(
+      {"tcp (loopback)",
+       {"tcp://127.0.0.1:*", "", "tcp://127.0.0.1:*", "", true}});
+#ifndef _WIN32
+  string dir = filesystem::temp_directory_path().string();
+  cases.push_back({"ipc",
+                   {"ipc://" + dir + "/mads-perf-" + tag + "-a.ipc", "",
+                    "ipc://" + dir + "/mads-perf-" + tag + "-b.ipc", "",
+                    true}});
+#endif
+  cases.push_back({"inproc",
+                   {"inproc://perf-" + tag + "-a", "",
+                    "inproc://perf-" + tag + "-b", "", true}});
+  if (!agent.settings_are_local()) {
+    // Each topic goes to its own shard
+    auto [frontend, backend] = agent.endpoints();
+    auto &shards = agent.shards();
+    size_t ping = shards.shard("perf_ping_" + tag),
+           pong = shards.shard("perf_pong_" + tag);
+    bench_endpoints tcp{shards.endpoint(frontend, ping),
+                        shards.endpoint(backend, ping),
+                        shards.endpoint(frontend, pong),
+                        shards.endpoint(backend, pong), false};
+    cases.push_back({"broker, tcp", tcp});
+    bench_endpoints ipc{agent.route(tcp.ping_pub), agent.route(tcp.ping_sub),
+                        agent.route(tcp.pong_pub), agent.route(tcp.pong_sub),
+                        false};
+    if (ipc.ping_pub.rfind("ipc://", 0) == 0)
+      cases.push_back({"broker, ipc", ipc});
+    else
+      cout << fg::yellow << "Broker ipc endpoints not available "
+           << "(broker on another host, or ipc_dir empty)" << fg::reset
+           << endl;
+  }
+  cout << "Comparing transports: " << n << " round trips and " << n
+       << " messages in a burst, " << len << " bytes each" << endl;
+  cout << style::bold << left << setw(20) << "Transport" << right << setw(10)
+       << "mean" << setw(10) << "p50" << setw(10) << "p99" << setw(12)
+       << "msg/s" << setw(10) << "MB/s" << setw(8) << "lost" << style::reset
+       << endl;
+  cout << left << setw(20) << "" << right << setw(30) << "round trip (us)"
+       << endl;
+  for (auto &[name, ep] : cases) {
+    try {
+      auto r = bench(context, ep, n, len);
+      print_result(name, r, len);
+    } catch (const std::exception &e) {
+      cout << left << setw(20) << name << right << fg::red << "  failed: "
+           << e.what() << fg::reset << endl;
+    }
+    if (!Mads::running)
+      break;
+  }
+  context.terminate();
+}
 
 int main(int argc, char *argv[]) {
   string settings_uri = SETTINGS_URI;
@@ -32,7 +265,9 @@ int main(int argc, char *argv[]) {
   Options options(argv[0]);
   options.add_options()
     ("p", "Sampling period (default 100 ms)", value<size_t>())
-    ("l", "Byte length of Payload", value<size_t>());
+    ("l", "Byte length of Payload", value<size_t>())
+    ("c,compare", "Compare the transports with this many messages, and exit",
+      value<size_t>()->implicit_value("1000"));
   SETUP_OPTIONS(options, Agent);
 
   // Settings
@@ -59,6 +294,10 @@ int main(int argc, char *argv[]) {
               << fg::reset << endl;
     exit(EXIT_FAILURE);
   }
+  if (options_parsed.count("compare") != 0) {
+    compare(agent, options_parsed["compare"].as<size_t>(), len);
+    return 0;
+  }
   agent.enable_remote_control();
   agent.connect();
   agent.register_event(event_type::startup);
@@ -13,10 +13,16 @@ Author(s): Paolo Bosetti
 #include "../agent.hpp"
 #include "../exec_path.hpp"
 #include "../mads.hpp"
+#include "../plugin_chain.hpp"
+#include "../pipeline.hpp"
+#include "../plugin_batch.hpp"
+#include "../plugin_blob.hpp"
+#include "../plugin_pool.hpp"
 #include <cxxopts.hpp>
 #include <filesystem>
 #include <pugg/Kernel.h>
 #include <regex>
+#include <set>
 
 #if defined(PLUGIN_LOADER_SOURCE)
 #include <chrono>
@@ -47,15 +53,27 @@ using namespace Mads;
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
+// A message handed to the plugins in another thread
+struct plugin_job {
+  json data;
+  string topic;
+  return_type rt = return_type::success;
+  json failure; // Set by the worker pool if the chain failed
+};
+
 #if defined(PLUGIN_LOADER_SOURCE)
 using Plugin = Source<json>;
 using PluginDriver = SourceDriver<json>;
 #elif defined(PLUGIN_LOADER_FILTER)
 using Plugin = Filter<json, json>;
 using PluginDriver = FilterDriver<json, json>;
+using BlobPlugin = BlobFilter;
+using BlobPluginDriver = BlobFilterDriver;
 #elif defined(PLUGIN_LOADER_SINK)
 using Plugin = Sink<json>;
 using PluginDriver = SinkDriver<json>;
+using BlobPlugin = BlobSink;
+using BlobPluginDriver = BlobSinkDriver;
 #endif
 
 #include <cctype>
@@ -115,11 +133,64 @@ json str_to_num(const string &s) {
   return str;
 }
 
+// Looks for a plugin file, then for an installed plugin with that name
+string find_plugin(string plugin_file) {
+  if (!fs::exists(plugin_file)) {
+    cerr << style::italic
+         << "  Searching for installed plugin in the default location "
+         << style::reset;
+#ifdef _WIN32
+    cerr << Mads::exec_dir("../bin/") << endl;
+    plugin_file = Mads::exec_dir("../bin/" + plugin_file);
+#else
+    cerr << Mads::exec_dir("../lib/") << endl;
+    plugin_file = Mads::exec_dir("../lib/" + plugin_file);
+#endif
+  }
+  if (!fs::exists(plugin_file)) {
+    cerr << fg::red << "Error: cannot find plugin file " << plugin_file
+         << " (extension .plugin is required!)" << fg::reset << endl;
+    exit(1);
+  }
+  return plugin_file;
+}
+
+// Loads a plugin file (once) and returns the driver named after it
+pugg::Driver *load_driver(pugg::Kernel &kernel, set<string> &loaded,
+                          const string &server, const string &plugin_file) {
+  string plugin_name = fs::path(plugin_file).stem().string();
+  if (loaded.insert(plugin_file).second)
+    kernel.load_plugin(plugin_file);
+  auto driver = kernel.get_driver<pugg::Driver>(server, plugin_name);
+  if (driver == nullptr) {
+    cerr << fg::red << "Error: cannot find plugin driver " << plugin_name
+         << " in plugin at " << plugin_file << fg::reset << endl;
+    auto drivers = kernel.get_all_drivers<pugg::Driver>(server);
+    cerr << "Available drivers:" << endl;
+    for (auto &d : drivers) {
+      cerr << "- " << d->name() << endl;
+    }
+    exit(1);
+  }
+  return driver;
+}
+
+// Loads a plugin file (once) and creates an instance of the driver named
+// after it
+template <class Driver>
+auto create_plugin(pugg::Kernel &kernel, set<string> &loaded,
+                   const string &server, const string &plugin_file) {
+  return static_cast<Driver *>(
+             load_driver(kernel, loaded, server, plugin_file))
+      ->create();
+}
+
 int main(int argc, char *argv[]) {
   string settings_uri = SETTINGS_URI;
   string plugin_name, plugin_file = PLUGIN_DEFAULT,
                       agent_name = AGENT_NAME_DEFAULT;
-  size_t count = 0, count_err = 0;
+  size_t count = 0;
+  atomic<size_t> count_err{0};
   size_t delay = 0;
   chrono::milliseconds time{0};
 
@@ -220,25 +291,30 @@ int main(int argc, char *argv[]) {
   }
 #endif
 
-  if (options_parsed.count("plugin") != 0) {
-    plugin_file = options_parsed["plugin"].as<string>();
-    if (!fs::exists(plugin_file)) {
-      cerr << style::italic 
-           << "  Searching for installed plugin in the default location "
-           << style::reset;
-#ifdef _WIN32
-      cerr << Mads::exec_dir("../bin/") << endl;
-      plugin_file = Mads::exec_dir("../bin/" + plugin_file);
-#else
-      cerr << Mads::exec_dir("../lib/") << endl;
-      plugin_file = Mads::exec_dir("../lib/" + plugin_file);
-#endif
-    }
-    if (!fs::exists(plugin_file)) {
-      cerr << fg::red << "Error: cannot find plugin file " << plugin_file
-           << " (extension .plugin is required!)" << fg::reset << endl;
+  // A chain lists all the stages, overriding the plugin file: the first
+  // stage is the source (or the first filter), the last one is the sink
+  vector<string> chain_files;
+  if (settings.contains("chain")) {
+    try {
+      chain_files = settings["chain"].get<vector<string>>();
+    } catch (const json::exception &) {
+      cerr << fg::red << "Error: chain must be a list of plugin files"
+           << fg::reset << endl;
       exit(1);
     }
+    for (auto &f : chain_files)
+      f = find_plugin(f);
+  }
+  if (!chain_files.empty()) {
+#if defined(PLUGIN_LOADER_SINK)
+    plugin_file = chain_files.back();
+    chain_files.pop_back();
+#else
+    plugin_file = chain_files.front();
+    chain_files.erase(chain_files.begin());
+#endif
+  } else if (options_parsed.count("plugin") != 0) {
+    plugin_file = find_plugin(options_parsed["plugin"].as<string>());
   } else if (!agent.attachment_path().empty()) {
     plugin_file = agent.attachment_path().string();
   }
@@ -246,31 +322,258 @@ int main(int argc, char *argv[]) {
 
   // Loading plugin
   pugg::Kernel kernel;
+  set<string> loaded;
   kernel.add_server<PLUGIN_CLASS<>>();
-  kernel.load_plugin(plugin_file);
-  PluginDriver *plugin_driver =
-      kernel.get_driver<PluginDriver>(Plugin::server_name(), plugin_name);
-  if (plugin_driver == nullptr) {
-    cerr << fg::red << "Error: cannot find plugin driver " << plugin_name
-         << " in plugin at " << plugin_file << fg::reset << endl;
-    auto drivers = kernel.get_all_drivers<PluginDriver>(Plugin::server_name());
-    cerr << "Available drivers:" << endl;
-    for (auto &d : drivers) {
-      cerr << "- " << d->name() << endl;
-    }
-    exit(1);
-  }
-  // Create the class from the plugin:
-  Plugin *plugin = plugin_driver->create();
+#if !defined(PLUGIN_LOADER_FILTER)
+  if (!chain_files.empty())
+    kernel.add_server<Filter<>>();
+#endif
+  // Create the class from the plugin: plugins taking blobs are told apart
+  // by the type of their driver
+  pugg::Driver *driver =
+      load_driver(kernel, loaded, Plugin::server_name(), plugin_file);
+  Plugin *plugin = nullptr;
+  PluginBase *base = nullptr;
+#if defined(PLUGIN_LOADER_FILTER) or defined(PLUGIN_LOADER_SINK)
+  BlobPlugin *blob_plugin = nullptr;
+  if (auto blob_driver = dynamic_cast<BlobPluginDriver *>(driver))
+    base = blob_plugin = blob_driver->create();
+#endif
+  if (!base)
+    base = plugin = static_cast<PluginDriver *>(driver)->create();
 
   cerr << "  Plugin:           " << style::bold << plugin_file << " (loaded as "
        << agent_name << ")" << style::reset << endl;
+#if defined(PLUGIN_LOADER_FILTER) or defined(PLUGIN_LOADER_SINK)
+  if (blob_plugin) {
+    cerr << "  Payload:          " << style::bold << "blobs" << style::reset
+         << endl;
+  }
+#if defined(PLUGIN_LOADER_SINK)
+  if (blob_plugin && !chain_files.empty()) {
+    cerr << fg::red << "Error: a chain of JSON filters cannot feed a blob sink"
+         << fg::reset << endl;
+    exit(1);
+  }
+#endif
+#endif
 
-  plugin->set_params((void *)&settings);
-  for (auto &[k, v] : plugin->info()) {
+  base->set_params((void *)&settings);
+  for (auto &[k, v] : base->info()) {
     cerr << "  " << left << setw(18) << k << style::bold << v << style::reset
          << endl;
   }
+
+  // Other stages of the chain, each with the agent settings patched by the
+  // table named after the stage, if any
+  auto build_chain = [&](FilterChain &c) {
+    for (auto &f : chain_files) {
+      string name = fs::path(f).stem().string();
+      auto stage = create_plugin<FilterChain::driver_t>(
+          kernel, loaded, FilterChain::filter_t::server_name(), f);
+      json stage_settings = settings;
+      if (settings.contains(name) && settings[name].is_object())
+        stage_settings.merge_patch(settings[name]);
+      stage->set_params((void *)&stage_settings);
+      c.add(name, stage);
+    }
+  };
+  FilterChain chain;
+  build_chain(chain);
+  if (!chain.empty()) {
+    cerr << "  Chain:            " << style::bold;
+#if defined(PLUGIN_LOADER_SINK)
+    for (auto &s : chain.stages())
+      cerr << s.name << " -> ";
+    cerr << plugin_name;
+#else
+    cerr << plugin_name;
+    for (auto &s : chain.stages())
+      cerr << " -> " << s.name;
+#endif
+    cerr << style::reset << endl;
+  }
+  // Handles a chain that stopped on an error (failure as in
+  // FilterChain::failure())
+  auto chain_error = [&](const json &failure, return_type rt) {
+    json err = {{"error", failure}};
+    agent.register_event(event_type::message, err);
+    count_err++;
+    if (rt == return_type::critical) {
+      cerr << fg::red << "Critical error in plugin chain: " << failure.dump()
+           << fg::reset << endl;
+      Mads::running = false;
+    }
+  };
+
+#if defined(PLUGIN_LOADER_FILTER)
+  // Parallel execution: each worker runs its own instances of all the
+  // plugins, which must be declared stateless or keyed
+  size_t parallelism = settings.value("parallelism", 1);
+  string parallel_key = settings.value("parallel_key", "");
+  bool ordered = settings.value("ordered", true);
+  if (parallelism > 1 && blob_plugin) {
+    cerr << fg::yellow
+         << "  Parallelism disabled: not available for blob plugins"
+         << fg::reset << endl;
+    parallelism = 1;
+  }
+  if (parallelism > 1) {
+    vector<plugin_concurrency> declared{plugin_concurrency_of(plugin->info())};
+    for (auto &s : chain.stages())
+      declared.push_back(plugin_concurrency_of(s.plugin->info()));
+    auto has = [&](plugin_concurrency c) {
+      return find(declared.begin(), declared.end(), c) != declared.end();
+    };
+    if (has(plugin_concurrency::serial)) {
+      cerr << fg::yellow
+           << "  Parallelism disabled: plugins are not declared stateless "
+              "or keyed"
+           << fg::reset << endl;
+      parallelism = 1;
+    } else if (has(plugin_concurrency::keyed) && parallel_key.empty()) {
+      cerr << fg::yellow
+           << "  Parallelism disabled: keyed plugins need a parallel_key"
+           << fg::reset << endl;
+      parallelism = 1;
+    } else if (dont_block) {
+      cerr << fg::yellow
+           << "  Parallelism disabled: not available in non-blocking mode"
+           << fg::reset << endl;
+      parallelism = 1;
+    }
+  }
+  vector<FilterChain> workers(parallelism > 1 ? parallelism : 0);
+  if (!workers.empty()) {
+    workers[0].add(plugin_name, plugin);
+    plugin = nullptr;
+    workers[0].append(std::move(chain));
+    for (size_t w = 1; w < workers.size(); w++) {
+      Plugin *p = create_plugin<PluginDriver>(kernel, loaded,
+                                              Plugin::server_name(),
+                                              plugin_file);
+      p->set_params((void *)&settings);
+      workers[w].add(plugin_name, p);
+      build_chain(workers[w]);
+    }
+    cerr << "  Parallelism:      " << style::bold << workers.size()
+         << " workers, ";
+    if (parallel_key.empty())
+      cerr << "round-robin";
+    else
+      cerr << "by " << parallel_key;
+    cerr << (ordered ? ", ordered" : ", unordered") << style::reset << endl;
+  }
+#endif
+
+#if defined(PLUGIN_LOADER_FILTER) or defined(PLUGIN_LOADER_SINK)
+  // Pipelined execution: receiving, running the plugins and publishing
+  // overlap, in threads linked by bounded queues
+  bool pipelined = settings.value("pipeline", false);
+  size_t pipeline_depth = settings.value("pipeline_depth", 256);
+  StageMeter receive_meter("receive");
+  unique_ptr<PipelineStage<plugin_job>> process_stage;
+  if (pipelined && blob_plugin) {
+    cerr << fg::yellow << "  Pipeline disabled: not available for blob plugins"
+         << fg::reset << endl;
+    pipelined = false;
+  }
+#if defined(PLUGIN_LOADER_FILTER)
+  unique_ptr<PipelineStage<json>> send_stage;
+  FilterChain piped;
+  if (pipelined && (dont_block || !workers.empty())) {
+    cerr << fg::yellow
+         << "  Pipeline disabled: not available in non-blocking or parallel "
+            "mode"
+         << fg::reset << endl;
+    pipelined = false;
+  }
+  if (pipelined) {
+    piped.add(plugin_name, plugin);
+    plugin = nullptr;
+    piped.append(std::move(chain));
+  }
+#endif
+  if (pipelined) {
+    cerr << "  Pipeline:         " << style::bold << "receive -> process";
+#if defined(PLUGIN_LOADER_FILTER)
+    cerr << " -> send";
+#endif
+    cerr << ", queues of " << pipeline_depth << style::reset << endl;
+  }
+
+  // Batch entry points, if the plugin implements them: the messages already
+  // waiting are loaded together (not with the pool or the pipeline, which
+  // hand the messages on one at a time)
+  size_t plugin_batch = settings.value("plugin_batch", 32);
+#if defined(PLUGIN_LOADER_FILTER)
+  BatchFilter *batch_plugin =
+      dont_block ? nullptr : dynamic_cast<BatchFilter *>(plugin);
+#else
+  BatchSink *batch_plugin = dynamic_cast<BatchSink *>(plugin);
+#endif
+  if (plugin_batch < 2 || pipelined)
+    batch_plugin = nullptr;
+  if (batch_plugin) {
+    cerr << "  Plugin batches:   " << style::bold << "up to " << plugin_batch
+         << " messages" << style::reset << endl;
+  }
+  vector<json> batch_in;
+  vector<string> batch_topics;
+  // Collects the message just received and those already waiting
+  auto collect_batch = [&]() {
+    batch_in.clear();
+    batch_topics.clear();
+    batch_in.push_back(agent.last_json());
+    batch_topics.push_back(agent.last_topic());
+    while (batch_in.size() < plugin_batch) {
+      message_type t;
+      try {
+        t = agent.receive(true);
+      } catch (const AgentError &e) {
+        cerr << fg::red << "Error receiving message: " << e.what()
+             << fg::reset << endl;
+        break;
+      }
+      if (t == message_type::none)
+        break;
+      agent.remote_control();
+      if (agent.last_topic_view() == "control" || t != message_type::json)
+        continue;
+      batch_in.push_back(agent.last_json());
+      batch_topics.push_back(agent.last_topic());
+    }
+  };
+  // Handles the return code of a batch or blob call; false if the message
+  // stops here
+  auto plugin_ok = [&](return_type rt, const char *method, json &warnings) {
+    json err;
+    switch (rt) {
+    case return_type::success:
+      return true;
+    case return_type::warning:
+      warnings[method] = base->error();
+      return true;
+    case return_type::retry:
+      return false;
+    case return_type::error:
+      err = {{"error", {method, base->error()}}};
+      agent.register_event(event_type::message, err);
+      count_err++;
+      return false;
+    case return_type::critical:
+      cerr << fg::red << "Critical error in " << method << ": "
+           << base->error() << fg::reset << endl;
+      err = {{"error", {method, base->error()}}};
+      agent.register_event(event_type::message, err);
+      count_err++;
+      Mads::running = false;
+      return false;
+    }
+    return false;
+  };
+#endif
+
 #if defined(PLUGIN_LOADER_SOURCE)
   string out_format = plugin->blob_format();
   cerr << "  Blob format:      " << style::bold << out_format << style::reset
@@ -303,10 +606,21 @@ int main(int argc, char *argv[]) {
           }
           [[fallthrough]];
         case return_type::success:
+          if (!chain.empty()) {
+            rt = chain.feed(out, "");
+            if (rt == return_type::retry)
+              return;
+            if (rt == return_type::error || rt == return_type::critical) {
+              chain_error(chain.failure(), rt);
+              if (!Mads::running)
+                return;
+              break;
+            }
+          }
           agent.publish(out);
           if (blob.size() > 0) {
             json meta{{"format", out_format}};
-            agent.publish(blob, meta);
+            agent.publish(std::move(blob), meta);
           }
           break;
         case return_type::retry:
@@ -337,7 +651,128 @@ int main(int argc, char *argv[]) {
   json in, out = {}, err;
   return_type rt;
   message_type type;
-  tuple<string, string> msg;
+  unique_ptr<WorkerPool<plugin_job>> pool;
+  if (!workers.empty()) {
+    pool = make_unique<WorkerPool<plugin_job>>(
+        workers.size(), settings.value("parallel_depth", 64), ordered,
+        [&](size_t w, plugin_job &j) {
+          // Failures are reported by the done callback, in their turn
+          try {
+            j.rt = workers[w].feed(j.data, j.topic);
+          } catch (const std::exception &e) {
+            j.rt = return_type::error;
+            j.failure = {{"stage", "worker " + to_string(w)},
+                         {"error", e.what()}};
+            return true;
+          }
+          if (j.rt == return_type::error || j.rt == return_type::critical) {
+            j.failure = workers[w].failure();
+            return true;
+          }
+          return j.rt != return_type::retry;
+        },
+        // Called by one worker at a time
+        [&](plugin_job &j) {
+          if (j.rt == return_type::error || j.rt == return_type::critical)
+            chain_error(j.failure, j.rt);
+          else
+            agent.publish(j.data);
+          if (!silent) {
+            cerr << "\r\x1b[0KMessages processed: " << fg::green << ++count
+                 << fg::reset << " total, " << fg::red << count_err
+                 << fg::reset << " with errors ";
+            cerr.flush();
+          }
+        });
+  }
+  if (pipelined) {
+    send_stage = make_unique<PipelineStage<json>>(
+        "send", pipeline_depth, [&](json &out) {
+          agent.publish(out);
+          if (!silent) {
+            cerr << "\r\x1b[0KMessages processed: " << fg::green << ++count
+                 << fg::reset << " total, " << fg::red << count_err
+                 << fg::reset << " with errors ";
+            cerr.flush();
+          }
+        });
+    process_stage = make_unique<PipelineStage<plugin_job>>(
+        "process", pipeline_depth, [&](plugin_job &j) {
+          return_type rt = piped.feed(j.data, j.topic);
+          if (rt == return_type::error || rt == return_type::critical)
+            chain_error(piped.failure(), rt);
+          if (rt == return_type::success || rt == return_type::warning)
+            send_stage->push(j.data, &process_stage->meter());
+        });
+  }
+  // Runs the plugins on the last blob received
+  auto filter_blob = [&]() {
+    json meta = json::parse(agent.last_blob_meta_view(), nullptr, false);
+    if (meta.is_discarded())
+      meta = json::object();
+    blob_view blob{agent.last_blob_view(), std::move(meta)};
+    string topic(agent.last_blob_topic_view());
+    json warnings, out;
+    if (!plugin_ok(blob_plugin->load_data(blob, topic), "load_data",
+                   warnings) ||
+        !plugin_ok(blob_plugin->process(out), "process", warnings))
+      return;
+    if (!warnings.empty() && out.is_object())
+      out["warning"] = warnings;
+    if (!chain.empty()) {
+      return_type rt = chain.feed(out, topic);
+      if (rt == return_type::retry)
+        return;
+      if (rt == return_type::error || rt == return_type::critical) {
+        chain_error(chain.failure(), rt);
+        return;
+      }
+    }
+    agent.publish(out);
+    if (!silent) {
+      cerr << "\r\x1b[0KMessages processed: " << fg::green << ++count
+           << fg::reset << " total, " << fg::red << count_err << fg::reset
+           << " with errors ";
+      cerr.flush();
+    }
+  };
+  // Runs the plugins on a batch of messages
+  auto filter_batch = [&]() {
+    collect_batch();
+    json warnings;
+    vector<json> outputs;
+    if (!plugin_ok(batch_plugin->load_batch(batch_in, batch_topics),
+                  "load_batch", warnings) ||
+        !plugin_ok(batch_plugin->process_batch(outputs), "process_batch",
+                  warnings))
+      return;
+    // One output per input: each goes on with the topic of its input;
+    // otherwise, with the topic of the last input
+    bool paired = outputs.size() == batch_topics.size();
+    for (size_t i = 0; i < outputs.size(); i++) {
+      auto &o = outputs[i];
+      if (!warnings.empty() && o.is_object())
+        o["warning"] = warnings;
+      if (!chain.empty()) {
+        return_type rt =
+            chain.feed(o, paired ? batch_topics[i] : batch_topics.back());
+        if (rt == return_type::retry)
+          continue;
+        if (rt == return_type::error || rt == return_type::critical) {
+          chain_error(chain.failure(), rt);
+          continue;
+        }
+      }
+      agent.publish(o);
+    }
+    count += batch_in.size();
+    if (!silent) {
+      cerr << "\r\x1b[0KMessages processed: " << fg::green << count
+           << fg::reset << " total, " << fg::red << count_err << fg::reset
+           << " with errors ";
+      cerr.flush();
+    }
+  };
   agent.loop(
       [&]() {
         err.clear();
@@ -348,14 +783,53 @@ int main(int argc, char *argv[]) {
                << fg::reset << endl;
         }
         agent.remote_control();
-        if (agent.last_topic() == "control") {
+        // blobs to a blob plugin, which gets no JSON messages
+        if (blob_plugin) {
+          if (type == message_type::blob)
+            filter_blob();
+          return;
+        }
+        if (agent.last_topic_view() == "control") {
           return; // Control message, already handled
         }
 
+        // handing data to the worker pool
+        if (pool) {
+          if (type != message_type::json)
+            return;
+          plugin_job job{agent.last_json(), agent.last_topic()};
+          size_t w = pool->next();
+          if (!parallel_key.empty()) {
+            json key;
+            if (job.data.is_object() && job.data.contains(parallel_key))
+              key = job.data[parallel_key];
+            w = pool->worker_for(key);
+          }
+          pool->submit(std::move(job), w);
+          return; // Counted when done
+        }
+
+        // handing data to the pipeline
+        if (process_stage) {
+          if (type != message_type::json)
+            return;
+          receive_meter.begin();
+          plugin_job job{agent.last_json(), agent.last_topic()};
+          process_stage->push(job, &receive_meter);
+          receive_meter.end();
+          return;
+        }
+
+        // loading a batch into the plugin
+        if (batch_plugin) {
+          if (type == message_type::json)
+            filter_batch();
+          return;
+        }
+
         // loading data into plugin
         if (type != message_type::none) {
-          msg = agent.last_message();
-          in = json::parse(get<1>(msg));
+          in = agent.last_json();
           rt = plugin->load_data(in, agent.last_topic());
         } else {
           goto process_output;
@@ -410,6 +884,18 @@ int main(int argc, char *argv[]) {
           Mads::running = false;
           return;
         }
+        // running the other stages of the chain
+        if (!chain.empty()) {
+          rt = chain.feed(out, agent.last_topic());
+          if (rt == return_type::retry)
+            return; // next iteration
+          if (rt == return_type::error || rt == return_type::critical) {
+            chain_error(chain.failure(), rt);
+            if (!Mads::running)
+              return;
+            goto status_line;
+          }
+        }
         // publishing data
         agent.publish(out);
       status_line:
@@ -424,24 +910,19 @@ int main(int argc, char *argv[]) {
 #elif defined(PLUGIN_LOADER_SINK)
   message_type type;
   json in;
-  return_type rt;
-  agent.loop([&]() {
-    try {
-      type = agent.receive();
-    } catch (const AgentError &e) {
-      cerr << fg::red << "Error receiving message: " << e.what() << fg::reset
-           << endl;
-    }
-    auto msg = agent.last_message();
-    agent.remote_control();
-    if (agent.last_topic() == "control") {
-      return; // Control message, already handled
-    }
-    if (type != message_type::json) {
-      return; // No message received
+  // Runs the plugins on a message
+  auto sink_message = [&](json &in, const string &topic) {
+    return_type rt;
+    if (!chain.empty()) {
+      rt = chain.feed(in, topic);
+      if (rt == return_type::retry)
+        return;
+      if (rt == return_type::error || rt == return_type::critical) {
+        chain_error(chain.failure(), rt);
+        return;
+      }
     }
-    in = json::parse(get<1>(msg));
-    rt = plugin->load_data(in, agent.last_topic());
+    rt = plugin->load_data(in, topic);
     switch (rt) {
     case return_type::warning:
       cerr << fg::yellow << "Warning loading data: " << plugin->error()
@@ -471,14 +952,155 @@ int main(int argc, char *argv[]) {
            << " with errors ";
       cerr.flush();
     }
+  };
+  // Runs the plugin on the last blob received
+  auto sink_blob = [&]() {
+    json meta = json::parse(agent.last_blob_meta_view(), nullptr, false);
+    if (meta.is_discarded())
+      meta = json::object();
+    blob_view blob{agent.last_blob_view(), std::move(meta)};
+    json warnings;
+    if (!plugin_ok(
+            blob_plugin->load_data(blob, string(agent.last_blob_topic_view())),
+            "load_data", warnings))
+      return;
+    if (!warnings.empty()) {
+      cerr << fg::yellow << "Warning loading data: " << base->error()
+           << fg::reset << endl;
+    }
+    if (!silent) {
+      cerr << "\r\x1b[0KMessages processed: " << fg::green << ++count
+           << fg::reset << " total, " << fg::red << count_err << fg::reset
+           << " with errors ";
+      cerr.flush();
+    }
+  };
+  // Runs the plugins on a batch of messages
+  auto sink_batch = [&]() {
+    collect_batch();
+    if (!chain.empty()) {
+      size_t n = 0;
+      for (size_t i = 0; i < batch_in.size(); i++) {
+        return_type rt = chain.feed(batch_in[i], batch_topics[i]);
+        if (rt == return_type::error || rt == return_type::critical)
+          chain_error(chain.failure(), rt);
+        if (rt != return_type::success && rt != return_type::warning)
+          continue;
+        if (n != i) {
+          batch_in[n] = std::move(batch_in[i]);
+          batch_topics[n] = std::move(batch_topics[i]);
+        }
+        n++;
+      }
+      batch_in.resize(n);
+      batch_topics.resize(n);
+      if (n == 0)
+        return;
+    }
+    json warnings;
+    if (!plugin_ok(batch_plugin->load_batch(batch_in, batch_topics),
+                  "load_batch", warnings))
+      return;
+    if (!warnings.empty()) {
+      cerr << fg::yellow << "Warning loading data: " << plugin->error()
+           << fg::reset << endl;
+    }
+    count += batch_in.size();
+    if (!silent) {
+      cerr << "\r\x1b[0KMessages processed: " << fg::green << count
+           << fg::reset << " total, " << fg::red << count_err << fg::reset
+           << " with errors ";
+      cerr.flush();
+    }
+  };
+  if (pipelined) {
+    process_stage = make_unique<PipelineStage<plugin_job>>(
+        "process", pipeline_depth,
+        [&](plugin_job &j) { sink_message(j.data, j.topic); });
+  }
+  agent.loop([&]() {
+    try {
+      type = agent.receive();
+    } catch (const AgentError &e) {
+      cerr << fg::red << "Error receiving message: " << e.what() << fg::reset
+           << endl;
+    }
+    agent.remote_control();
+    // blobs to a blob plugin, which gets no JSON messages
+    if (blob_plugin) {
+      if (type == message_type::blob)
+        sink_blob();
+      return;
+    }
+    if (agent.last_topic_view() == "control") {
+      return; // Control message, already handled
+    }
+    if (type != message_type::json) {
+      return; // No message received
+    }
+    if (process_stage) {
+      receive_meter.begin();
+      plugin_job job{agent.last_json(), agent.last_topic()};
+      process_stage->push(job, &receive_meter);
+      receive_meter.end();
+      return;
+    }
+    if (batch_plugin) {
+      sink_batch();
+      return;
+    }
+    in = agent.last_json();
+    sink_message(in, agent.last_topic());
   });
+#endif
+#if defined(PLUGIN_LOADER_FILTER)
+  if (pool) {
+    pool->stop();
+    cerr << "Worker pool statistics: " << pool->stats().dump() << endl;
+  }
+#endif
+#if defined(PLUGIN_LOADER_FILTER) or defined(PLUGIN_LOADER_SINK)
+  if (process_stage) {
+    process_stage->stop();
+    json stages = json::array({receive_meter.json(), process_stage->json()});
+#if defined(PLUGIN_LOADER_FILTER)
+    send_stage->stop();
+    stages.push_back(send_stage->json());
+#endif
+    cerr << "Pipeline statistics: " << stages.dump() << endl;
+  }
 #endif
   cerr << fg::green << PLUGIN_NAME " plugin stopped" << fg::reset << endl;
+#if defined(PLUGIN_LOADER_SOURCE) or defined(PLUGIN_LOADER_FILTER)
+  if (time.count() > 0) {
+    cerr << "Loop statistics: " << agent.loop_stats().json().dump() << endl;
+  }
+#endif
+  if (agent.queue_stats()["dropped"] > 0) {
+    cerr << fg::yellow << "Outbound queue: " << agent.queue_stats().dump()
+         << fg::reset << endl;
+  }
+  if (!agent.batch_stats().empty()) {
+    cerr << "Batching statistics: " << agent.batch_stats().dump() << endl;
+  }
+  if (!agent.compression_stats().empty()) {
+    cerr << "Compression statistics: " << agent.compression_stats().dump()
+         << endl;
+  }
 
   // Cleanup
   agent.register_event(event_type::shutdown);
   agent.disconnect();
   delete plugin;
+#if defined(PLUGIN_LOADER_FILTER) or defined(PLUGIN_LOADER_SINK)
+  delete blob_plugin;
+#endif
+  chain.clear();
+#if defined(PLUGIN_LOADER_FILTER)
+  for (auto &w : workers)
+    w.clear();
+  piped.clear();
+#endif
   kernel.clear_drivers();
 
   if (agent.restart()) {
@@ -0,0 +1,116 @@
+/*
+  ____            _
+ |  _ \ ___ _ __ | | __ _ _   _
+ | |_) / _ \ '_ \| |/ _` | | | |
+ |  _ <  __/ |_) | | (_| | |_| |
+ |_| \_\___| .__/|_|\__,_|\__, |
+           |_|            |___/
+Replay agent: publishes recorded traffic (a broker journal, or a logger JSON
+file) with its original timing, or faster.
+Run this like:
+  mads replay -i journal -x 10 -t sensors
+
+Author: Paolo Bosetti
+*/
+#include "../replay.hpp"
+#include <cxxopts.hpp>
+
+using namespace std;
+using namespace cxxopts;
+using json = nlohmann::json;
+using namespace Mads;
+
+int main(int argc, char *argv[]) {
+  string settings_uri = SETTINGS_URI;
+  string input, from, to;
+  double speed = 1.0;
+  vector<string> topics;
+
+  // CLI options
+  Options options(argv[0]);
+  // clang-format off
+  options.add_options()
+    ("i,input", "Journal directory or segment, or logger JSON file",
+      value<string>())
+    ("x,speed", "Playback speed (default 1, 0 for as fast as possible)",
+      value<double>())
+    ("t,topic", "Replay only topics with this prefix (repeatable)",
+      value<vector<string>>())
+    ("f,from", "Start time: ISO date or seconds from the beginning",
+      value<string>())
+    ("u,until", "End time: ISO date or seconds from the beginning",
+      value<string>());
+  // clang-format on
+  SETUP_OPTIONS(options, Replay);
+
+  // Core stuff
+  Replay replay(argv[0], settings_uri);
+  try {
+    replay.init();
+  } catch (const std::exception &e) {
+    std::cout << fg::red << "Error initializing agent: " << e.what()
+              << fg::reset << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Settings, overridden by CLI options
+  json settings = replay.get_settings();
+  if (settings.contains("input"))
+    input = settings["input"].get<string>();
+  if (settings.contains("speed"))
+    speed = settings["speed"].get<double>();
+  if (settings.contains("topics"))
+    topics = settings["topics"].get<vector<string>>();
+  if (options_parsed.count("input") != 0)
+    input = options_parsed["input"].as<string>();
+  if (options_parsed.count("speed") != 0)
+    speed = options_parsed["speed"].as<double>();
+  if (options_parsed.count("topic") != 0)
+    topics = options_parsed["topic"].as<vector<string>>();
+  if (options_parsed.count("from") != 0)
+    from = options_parsed["from"].as<string>();
+  if (options_parsed.count("until") != 0)
+    to = options_parsed["until"].as<string>();
+  if (input.empty()) {
+    cout << fg::red << "No recording given (use -i)" << fg::reset << endl;
+    exit(EXIT_FAILURE);
+  }
+  try {
+    replay.open(input);
+  } catch (const AgentError &e) {
+    cout << fg::red << "Cannot open recording: " << e.what() << fg::reset
+         << endl;
+    exit(EXIT_FAILURE);
+  }
+  replay.set_speed(speed);
+  replay.set_topics(topics);
+  replay.set_range(from, to);
+
+  replay.enable_remote_control();
+  replay.connect(CONNECT_DELAY);
+  replay.register_event(event_type::startup);
+  replay.info();
+
+  // Main loop
+  cout << fg::green << "Replay started" << fg::reset << endl;
+  auto start = chrono::steady_clock::now();
+  replay.loop(
+      [&]() {
+        try {
+          if (!replay.play_next())
+            Mads::running = false;
+        } catch (const AgentError &e) {
+          cout << fg::red << "Error: " << e.what() << fg::reset << endl;
+          Mads::running = false;
+        }
+      },
+      0ms);
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  cout << fg::green << "Replay stopped: " << replay.published()
+       << " messages in " << elapsed.count() << " s" << fg::reset << endl;
+
+  // Cleanup
+  replay.register_event(event_type::shutdown);
+  replay.disconnect();
+  return 0;
+}
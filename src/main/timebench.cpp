@@ -0,0 +1,125 @@
+/*
+  _   _                _                     _
+ | |_(_)_ __ ___   ___| |__   ___ _ __   ___| |__
+ | __| | '_ ` _ \ / _ \ '_ \ / _ \ '_ \ / __| '_ \
+ | |_| | | | | | |  __/ |_) |  __/ | | | (__| | | |
+  \__|_|_| |_| |_|\___|_.__/ \___|_| |_|\___|_| |_|
+
+Microbenchmark of the cached timestamp/timecode formatter against the
+original localtime + stringstream implementation.
+
+Author(s): Paolo Bosetti
+*/
+#include "../mads.hpp"
+#include <cxxopts.hpp>
+#include <iostream>
+#include <rang.hpp>
+
+using namespace std;
+using namespace cxxopts;
+using namespace rang;
+using namespace Mads;
+
+// Reference implementations (as they were before the cached formatter)
+namespace reference {
+
+static string get_ISODate_time(const chrono::system_clock::time_point &time) {
+  time_t tt = chrono::system_clock::to_time_t(time);
+  tm *tt2 = localtime(&tt);
+  stringstream ss;
+  auto timeTruncated = chrono::system_clock::from_time_t(tt);
+  long long ms =
+      chrono::duration_cast<chrono::milliseconds>(time - timeTruncated)
+          .count();
+  ss << put_time(tt2, "%FT%T") << "." << setw(3) << setfill('0') << ms
+     << put_time(tt2, "%z");
+  return ss.str();
+}
+
+static double timecode(const chrono::system_clock::time_point &now,
+                       unsigned int fps = 25) {
+  time_t now_c = chrono::system_clock::to_time_t(now);
+  tm *lt = localtime(&now_c);
+  double fct = 1000.0 / fps;
+  auto tt = chrono::system_clock::from_time_t(now_c);
+  long long ms = chrono::duration_cast<chrono::milliseconds>(now - tt).count();
+  ms = floor(ms / fct) * fct;
+  return lt->tm_hour * 3600 + lt->tm_min * 60 + lt->tm_sec + ms / 1000.0;
+}
+
+} // namespace reference
+
+template <typename F> static double bench(size_t n, F &&f) {
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    f(i);
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, nano>(t1 - t0).count() / n;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = 1000000;
+  unsigned int fps = MADS_FPS;
+  Options options(argv[0]);
+  // clang-format off
+  options.add_options()
+    ("n", "Number of iterations", value<size_t>())
+    ("f,fps", "Timecode FPS", value<unsigned int>())
+    ("h,help", "Print usage");
+  // clang-format on
+  auto options_parsed = options.parse(argc, argv);
+  if (options_parsed.count("help")) {
+    cout << options.help() << endl;
+    return 0;
+  }
+  if (options_parsed.count("n"))
+    n = options_parsed["n"].as<size_t>();
+  if (options_parsed.count("fps"))
+    fps = options_parsed["fps"].as<unsigned int>();
+
+  // Time points spread over ~3 s, so that the per-second cache is exercised
+  // both on hits and on misses
+  auto start = chrono::system_clock::now();
+  auto tp = [&](size_t i) { return start + chrono::microseconds(i * 3); };
+
+  // Correctness check
+  size_t mismatches = 0;
+  for (size_t i = 0; i < n; i += 997) {
+    if (reference::get_ISODate_time(tp(i)) != get_ISODate_time(tp(i)) ||
+        reference::timecode(tp(i), fps) != timecode(tp(i), fps))
+      mismatches++;
+  }
+  if (mismatches) {
+    cout << fg::red << "Mismatches with reference implementation: "
+         << mismatches << fg::reset << endl;
+  }
+
+  size_t sink = 0;
+  double tc_sink = 0;
+  double ref_iso = bench(n, [&](size_t i) {
+    sink += reference::get_ISODate_time(tp(i)).size();
+  });
+  double new_iso =
+      bench(n, [&](size_t i) { sink += get_ISODate_time(tp(i)).size(); });
+  double new_view =
+      bench(n, [&](size_t i) { sink += time_formatter().iso(tp(i)).size(); });
+  double ref_tc =
+      bench(n, [&](size_t i) { tc_sink += reference::timecode(tp(i), fps); });
+  double new_tc = bench(n, [&](size_t i) { tc_sink += timecode(tp(i), fps); });
+
+  cout << style::bold << "Timestamp formatting (" << n
+       << " iterations):" << style::reset << endl
+       << "  reference ISODate:     " << fg::yellow << ref_iso << " ns"
+       << fg::reset << endl
+       << "  cached ISODate:        " << fg::green << new_iso << " ns"
+       << fg::reset << " (x" << ref_iso / new_iso << ")" << endl
+       << "  cached ISODate (view): " << fg::green << new_view << " ns"
+       << fg::reset << " (x" << ref_iso / new_view << ")" << endl
+       << "  reference timecode:    " << fg::yellow << ref_tc << " ns"
+       << fg::reset << endl
+       << "  cached timecode:       " << fg::green << new_tc << " ns"
+       << fg::reset << " (x" << ref_tc / new_tc << ")" << endl
+       << style::dim << "  (checksum " << sink + size_t(tc_sink) << ")"
+       << style::reset << endl;
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
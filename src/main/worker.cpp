@@ -136,12 +136,11 @@ int main(int argc, char *argv[]) {
   // Main loop
   agent.register_event(event_type::startup);
   cout << fg::green << "Filter plugin process started" << fg::reset << endl;
-  agent.loop([&]() {
-    json payload = agent.pull();
+  // Work is done as soon as it is pulled; subscriptions (if any) only update
+  // the last topic, and control messages are handled by the agent
+  agent.on_receive(nullptr);
+  agent.on_pull([&](json &payload) {
     return_type rt;
-    if (payload.empty() && !Mads::running) return;
-    message_type type = agent.receive();
-    agent.remote_control();
     json out;
     rt = filter->load_data(payload, agent.last_topic());
     if (rt != return_type::success) {
@@ -160,6 +159,7 @@ int main(int argc, char *argv[]) {
          << " with errors";
     cout.flush();
   });
+  agent.run();
   cout << fg::green << "Filter plugin process stopped" << fg::reset << endl;
 
   // Cleanup
@@ -0,0 +1,369 @@
+/*
+   ___        _   _
+  / _ \ _   _| |_| |__   _____  __
+ | | | | | | | __| '_ \ / _ \ \/ /
+ | |_| | |_| | |_| |_) | (_) >  <
+  \___/ \__,_|\__|_.__/ \___/_/\_\
+
+Outbound message queue. ZeroMQ sockets are not thread-safe, so messages
+published from any thread are pushed into a bounded lock-free MPSC queue,
+which is drained by a single I/O thread that owns the publisher socket.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef OUTBOX_HPP
+#define OUTBOX_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <zmqpp/zmqpp.hpp>
+
+namespace Mads {
+
+/**
+ * @brief What to do when the outbound queue is full.
+ *
+ * - block: the publishing thread waits for room in the queue
+ * - drop: the message is discarded (and counted)
+ */
+enum class queue_policy { block = 0, drop };
+
+/**
+ * @brief Map of queue policies to strings (as used in the INI file).
+ *
+ */
+static const std::map<queue_policy, std::string> queue_policy_map = {
+    {queue_policy::block, "block"},
+    {queue_policy::drop, "drop"},
+};
+
+/**
+ * @brief Parses a queue policy name.
+ *
+ * @param name One of "block", "drop".
+ * @return The queue policy.
+ * @throws std::invalid_argument if the name is unknown.
+ */
+static queue_policy queue_policy_from(const std::string &name) {
+  for (auto const &[k, v] : queue_policy_map) {
+    if (v == name)
+      return k;
+  }
+  throw std::invalid_argument("Unknown queue policy: " + name);
+}
+
+/**
+ * @brief Bounded lock-free multi-producer, single-consumer queue.
+ *
+ * Ring of cells with sequence numbers (D. Vyukov's bounded queue): producers
+ * claim a slot with a CAS on the head, the consumer owns the tail.
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T> class MPSCQueue {
+public:
+  explicit MPSCQueue(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity)
+      n <<= 1;
+    _mask = n - 1;
+    _cells = std::make_unique<cell[]>(n);
+    for (size_t i = 0; i < n; i++)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return _mask + 1; }
+
+  /**
+   * @brief Pushes an item (any thread).
+   *
+   * @return false if the queue is full; item is left untouched.
+   */
+  bool try_push(T &item) {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    for (;;) {
+      cell &c = _cells[pos & _mask];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (_head.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          c.data = std::move(item);
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * @brief Pops an item (consumer thread only).
+   *
+   * @return false if the queue is empty.
+   */
+  bool try_pop(T &item) {
+    cell &c = _cells[_tail & _mask];
+    size_t seq = c.seq.load(std::memory_order_acquire);
+    if ((intptr_t)seq - (intptr_t)(_tail + 1) < 0)
+      return false;
+    item = std::move(c.data);
+    c.seq.store(_tail + _mask + 1, std::memory_order_release);
+    _tail++;
+    return true;
+  }
+
+private:
+  struct cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+  std::unique_ptr<cell[]> _cells;
+  size_t _mask;
+  alignas(64) std::atomic<size_t> _head{0};
+  alignas(64) size_t _tail = 0;
+};
+
+/**
+ * @brief Outbound queue drained by an I/O thread that owns a socket.
+ *
+ * Messages can be scheduled for later transmission (e.g. startup events,
+ * sent after the connection has settled) without spawning threads.
+ *
+ * @example
+ * Outbox outbox(1024, queue_policy::block);
+ * socket.connect(endpoint);
+ * outbox.start(socket); // from now on, only the I/O thread uses socket
+ * outbox.push(msg); // from any thread
+ * outbox.stop(); // sends what is queued, then joins
+ */
+class Outbox {
+public:
+  using clock = std::chrono::steady_clock;
+  using router_t = std::function<size_t(const zmqpp::message &msg)>;
+
+  Outbox(size_t capacity = 1024, queue_policy policy = queue_policy::block)
+      : _queue(std::make_unique<MPSCQueue<entry>>(capacity)),
+        _policy(policy) {}
+
+  ~Outbox() { stop(); }
+
+  /**
+   * @brief Sets capacity and policy. Only effective when stopped.
+   */
+  void configure(size_t capacity, queue_policy policy) {
+    if (_running)
+      return;
+    _queue = std::make_unique<MPSCQueue<entry>>(capacity);
+    _policy = policy;
+  }
+
+  size_t capacity() const { return _queue->capacity(); }
+  queue_policy policy() const { return _policy; }
+  bool running() const { return _running; }
+
+  /**
+   * @brief Starts the I/O thread, which takes ownership of the socket.
+   */
+  void start(zmqpp::socket &socket) { start({&socket}, nullptr); }
+
+  /**
+   * @brief Starts the I/O thread, which takes ownership of the sockets. Each
+   * message is sent on the socket chosen by the router (e.g. by topic, for a
+   * partitioned broker).
+   *
+   * @param sockets The sockets.
+   * @param router Returns the index of the socket for a message (the first
+   * socket if null).
+   */
+  void start(std::vector<zmqpp::socket *> sockets, router_t router) {
+    if (_running)
+      return;
+    _sockets = std::move(sockets);
+    _router = std::move(router);
+    _stop = false;
+    _running = true;
+    _thread = std::thread([this]() { run(); });
+  }
+
+  /**
+   * @brief Sends all queued messages (also the delayed ones), then stops
+   * the I/O thread. The socket can then be used by the caller.
+   */
+  void stop() {
+    if (!_running)
+      return;
+    _stop = true;
+    wake();
+    _thread.join();
+    _running = false;
+  }
+
+  /**
+   * @brief Queues a message (thread-safe).
+   *
+   * @param msg The message (moved from).
+   * @param delay Do not send before this delay has elapsed.
+   * @return false if the message was dropped (queue full with drop policy,
+   * or I/O thread not running).
+   */
+  bool push(zmqpp::message &msg,
+            std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+    entry e;
+    e.msg = std::move(msg);
+    return enqueue(e, 1, delay);
+  }
+
+  /**
+   * @brief Queues two messages as a single entry (thread-safe): they are
+   * sent back-to-back in this order, or dropped together.
+   *
+   * @param first The message sent first (moved from), e.g. a dictionary.
+   * @param msg The message sent next (moved from).
+   * @param delay Do not send before this delay has elapsed.
+   * @return false if the messages were dropped.
+   */
+  bool push(zmqpp::message &first, zmqpp::message &msg,
+            std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+    entry e;
+    e.first = std::move(first);
+    e.msg = std::move(msg);
+    return enqueue(e, 2, delay);
+  }
+
+  /**
+   * @brief Waits until all queued messages have been handed to the socket.
+   */
+  void flush() {
+    while (_running && _sent.load() + _discarded.load() < _pushed.load())
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  /**
+   * @brief Queue statistics: messages sent and dropped, maximum depth.
+   */
+  nlohmann::json stats() const {
+    return {{"capacity", capacity()},
+            {"policy", queue_policy_map.at(_policy)},
+            {"sent", _sent.load()},
+            {"dropped", _dropped.load() + _discarded.load()},
+            {"high_water", _high_water.load()}};
+  }
+
+private:
+  struct entry {
+    zmqpp::message first; // Optional, sent before msg
+    zmqpp::message msg;
+    clock::time_point not_before;
+  };
+
+  bool enqueue(entry &e, int64_t count, std::chrono::milliseconds delay) {
+    if (delay.count() > 0)
+      e.not_before = clock::now() + delay;
+    // Counted before pushing, so that _sent never exceeds _pushed; depth is
+    // approximate, as other producers may push and get served meanwhile
+    int64_t pushed = _pushed.fetch_add(count) + count;
+    uint64_t depth = std::clamp<int64_t>(pushed - (int64_t)_sent.load(), 0,
+                                         _queue->capacity());
+    auto drop = [&]() {
+      _pushed.fetch_sub(count);
+      _dropped.fetch_add(count, std::memory_order_relaxed);
+      return false;
+    };
+    // With no I/O thread, nothing would send it (or only on a later start)
+    if (!_running || _stop)
+      return drop();
+    while (!_queue->try_push(e)) {
+      if (_policy == queue_policy::drop || !_running || _stop)
+        return drop();
+      wake();
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    uint64_t hw = _high_water.load(std::memory_order_relaxed);
+    while (depth > hw && !_high_water.compare_exchange_weak(hw, depth))
+      ;
+    wake();
+    return true;
+  }
+
+  void wake() {
+    _signal.fetch_add(1, std::memory_order_release);
+    _signal.notify_one();
+  }
+
+  void run() {
+    std::vector<entry> delayed;
+    entry e;
+    for (;;) {
+      uint32_t signal = _signal.load(std::memory_order_acquire);
+      bool idle = true;
+      while (_queue->try_pop(e)) {
+        idle = false;
+        if (e.not_before > clock::now())
+          delayed.push_back(std::move(e));
+        else
+          send(e);
+      }
+      auto now = clock::now();
+      for (auto it = delayed.begin(); it != delayed.end();) {
+        if (it->not_before <= now || _stop) {
+          send(*it);
+          it = delayed.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (_stop && delayed.empty() && idle)
+        break;
+      if (!idle)
+        continue;
+      if (delayed.empty())
+        _signal.wait(signal, std::memory_order_acquire);
+      else
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  void send(entry &e) {
+    if (e.first.parts() > 0)
+      send(e.first);
+    send(e.msg);
+  }
+
+  void send(zmqpp::message &msg) {
+    try {
+      size_t i = _router ? _router(msg) : 0;
+      _sockets.at(i)->send(msg);
+      _sent.fetch_add(1, std::memory_order_relaxed);
+    } catch (const std::exception &) {
+      _discarded.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  std::unique_ptr<MPSCQueue<entry>> _queue;
+  queue_policy _policy;
+  std::vector<zmqpp::socket *> _sockets;
+  router_t _router;
+  std::thread _thread;
+  std::atomic<bool> _running{false}, _stop{false};
+  std::atomic<uint32_t> _signal{0};
+  std::atomic<uint64_t> _pushed{0}, _sent{0}, _dropped{0}, _discarded{0};
+  std::atomic<uint64_t> _high_water{0};
+};
+
+} // namespace Mads
+
+#endif // OUTBOX_HPP
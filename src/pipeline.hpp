@@ -0,0 +1,279 @@
+/*
+  ____  _            _ _
+ |  _ \(_)_ __   ___| (_)_ __   ___
+ | |_) | | '_ \ / _ \ | | '_ \ / _ \
+ |  __/| | |_) |  __/ | | | | |  __/
+ |_|   |_| .__/ \___|_|_|_| |_|\___|
+         |_|
+
+Stages of a pipelined agent: each stage is a thread fed by a bounded
+lock-free single-producer, single-consumer ring, so that network I/O and
+plugin computations overlap. Every stage measures its utilization, i.e. the
+fraction of time spent working rather than waiting for input or for room
+downstream.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Bounded lock-free single-producer, single-consumer queue.
+ *
+ * Each side caches the index of the other one, so that the shared indexes
+ * are only read when the queue looks full (or empty). Capacity is rounded up
+ * to a power of two.
+ */
+template <typename T> class SPSCQueue {
+public:
+  explicit SPSCQueue(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity)
+      n <<= 1;
+    _mask = n - 1;
+    _slots = std::make_unique<T[]>(n);
+  }
+
+  size_t capacity() const { return _mask + 1; }
+
+  /**
+   * @brief Number of queued items (approximate, from any thread).
+   */
+  size_t size() const {
+    return _head.load(std::memory_order_acquire) -
+           _tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief Pushes an item (producer thread only).
+   *
+   * @return false if the queue is full; item is left untouched.
+   */
+  bool try_push(T &item) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail_cache > _mask) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if (head - _tail_cache > _mask)
+        return false;
+    }
+    _slots[head & _mask] = std::move(item);
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Pops an item (consumer thread only).
+   *
+   * @return false if the queue is empty.
+   */
+  bool try_pop(T &item) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head_cache) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      if (tail == _head_cache)
+        return false;
+    }
+    item = std::move(_slots[tail & _mask]);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::unique_ptr<T[]> _slots;
+  size_t _mask;
+  alignas(64) std::atomic<size_t> _head{0};
+  size_t _tail_cache = 0; // Producer side
+  alignas(64) std::atomic<size_t> _tail{0};
+  size_t _head_cache = 0; // Consumer side
+};
+
+/**
+ * @brief Time accounting of a pipeline stage.
+ *
+ * The stage is busy between begin() and end(), except for the time it is
+ * blocked waiting for room in the next stage. Totals can be read from any
+ * thread.
+ */
+class StageMeter {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit StageMeter(std::string name) : _name(std::move(name)) {}
+
+  void begin() {
+    _t0 = clock::now();
+    _pending_block = 0;
+  }
+
+  void block(clock::duration d) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    _pending_block += ns;
+    _blocked_ns += ns;
+  }
+
+  void end() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  clock::now() - _t0)
+                  .count();
+    _busy_ns += std::max<int64_t>(ns - _pending_block, 0);
+    _items++;
+  }
+
+  const std::string &name() const { return _name; }
+
+  /**
+   * @brief Items, busy and blocked seconds, and utilization (busy fraction
+   * of the time since the meter was created).
+   */
+  nlohmann::json json() const {
+    double elapsed =
+        std::chrono::duration<double>(clock::now() - _start).count();
+    double busy = _busy_ns.load() / 1e9;
+    return {{"stage", _name},
+            {"items", _items.load()},
+            {"busy_s", busy},
+            {"blocked_s", _blocked_ns.load() / 1e9},
+            {"utilization", elapsed > 0 ? busy / elapsed : 0.0}};
+  }
+
+private:
+  std::string _name;
+  clock::time_point _start = clock::now(), _t0;
+  int64_t _pending_block = 0;
+  std::atomic<uint64_t> _items{0};
+  std::atomic<int64_t> _busy_ns{0}, _blocked_ns{0};
+};
+
+/**
+ * @brief A pipeline stage: a thread running a function on the items pushed
+ * into its queue, in order.
+ *
+ * Only one thread can push into a stage. When the queue is full, the
+ * producer waits (this is how a slow stage pushes back on the previous
+ * ones), and its waiting time is charged to its own meter as blocked time.
+ *
+ * @example
+ * PipelineStage<json> send("send", 256, [&](json &j) { agent.publish(j); });
+ * StageMeter meter("receive");
+ * meter.begin();
+ * send.push(data, &meter);
+ * meter.end();
+ * send.stop(); // runs what is queued, then joins
+ */
+template <typename T> class PipelineStage {
+public:
+  using clock = std::chrono::steady_clock;
+  using work_t = std::function<void(T &item)>;
+
+  PipelineStage(std::string name, size_t depth, work_t work)
+      : _queue(depth), _work(std::move(work)), _meter(std::move(name)) {
+    _thread = std::thread([this]() { run(); });
+  }
+
+  ~PipelineStage() { stop(); }
+
+  /**
+   * @brief Queues an item, waiting while the queue is full (producer thread
+   * only).
+   *
+   * @param item The item (moved from).
+   * @param producer Meter of the producing stage, charged with the wait.
+   * @return false if the stage is stopped.
+   */
+  bool push(T &item, StageMeter *producer = nullptr) {
+    if (_stop)
+      return false;
+    if (!_queue.try_push(item)) {
+      auto t0 = clock::now();
+      do {
+        if (_stop)
+          return false;
+        wake();
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      } while (!_queue.try_push(item));
+      _full++;
+      if (producer)
+        producer->block(clock::now() - t0);
+    }
+    size_t depth = _queue.size();
+    if (depth > _high_water)
+      _high_water = depth;
+    wake();
+    return true;
+  }
+
+  /**
+   * @brief Runs the queued items, then joins the thread.
+   */
+  void stop() {
+    if (_stop.exchange(true))
+      return;
+    wake();
+    if (_thread.joinable())
+      _thread.join();
+  }
+
+  StageMeter &meter() { return _meter; }
+
+  /**
+   * @brief Meter totals, plus capacity, maximum depth and number of times
+   * the queue was found full.
+   */
+  nlohmann::json json() const {
+    auto j = _meter.json();
+    j["queue"] = {{"capacity", _queue.capacity()},
+                  {"high_water", _high_water.load()},
+                  {"full", _full.load()}};
+    return j;
+  }
+
+private:
+  void wake() {
+    _signal.fetch_add(1, std::memory_order_release);
+    _signal.notify_one();
+  }
+
+  void run() {
+    T item;
+    for (;;) {
+      uint32_t signal = _signal.load(std::memory_order_acquire);
+      // Read before popping: items pushed before stop() are then visible
+      bool stopping = _stop.load();
+      if (!_queue.try_pop(item)) {
+        if (stopping)
+          break;
+        _signal.wait(signal, std::memory_order_acquire);
+        continue;
+      }
+      _meter.begin();
+      _work(item);
+      _meter.end();
+    }
+  }
+
+  SPSCQueue<T> _queue;
+  work_t _work;
+  StageMeter _meter;
+  std::thread _thread;
+  std::atomic<bool> _stop{false};
+  std::atomic<uint32_t> _signal{0};
+  std::atomic<size_t> _high_water{0};
+  std::atomic<uint64_t> _full{0};
+};
+
+} // namespace Mads
+
+#endif // PIPELINE_HPP
@@ -0,0 +1,87 @@
+/*
+  ____  _             _         _           _       _
+ |  _ \| |_   _  __ _(_)_ __   | |__   __ _| |_ ___| |__
+ | |_) | | | | |/ _` | | '_ \  | '_ \ / _` | __/ __| '_ \
+ |  __/| | |_| | (_| | | | | | | |_) | (_| | || (__| | | |
+ |_|   |_|\__,_|\__, |_|_| |_| |_.__/ \__,_|\__\___|_| |_|
+                |___/
+
+Optional batch entry points for filter and sink plugins. A plugin that also
+derives from one of these classes gets all the messages that are waiting at
+once, rather than one at a time: vectorized computations, model inference
+or bulk database inserts can then work on the whole batch. Plugins that do
+not implement them keep being called once per message.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef PLUGIN_BATCH_HPP
+#define PLUGIN_BATCH_HPP
+
+#include <common.hpp>
+#include <nlohmann/json.hpp>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace Mads {
+
+/**
+ * @brief Batch entry points of a filter plugin, used by the filter agent in
+ * place of load_data() and process().
+ *
+ * @example
+ * class Inference : public Filter<json, json>, public Mads::BatchFilter {
+ *   return_type load_batch(std::span<const json> inputs,
+ *                          std::span<const std::string> topics) override;
+ *   return_type process_batch(std::vector<json> &outputs) override;
+ *   ...
+ * };
+ */
+class BatchFilter {
+public:
+  virtual ~BatchFilter() = default;
+
+  /**
+   * @brief Loads a batch of inputs, received in this order.
+   *
+   * @param inputs The payloads (valid until the call returns).
+   * @param topics The topic of each payload.
+   */
+  virtual return_type load_batch(std::span<const nlohmann::json> inputs,
+                                 std::span<const std::string> topics) = 0;
+
+  /**
+   * @brief Produces the outputs of the last batch, each published as a
+   * message (none, one per input, or any other number).
+   *
+   * Plugins chained after this one get each output with the topic of its
+   * input when there is one output per input, in the same order; otherwise,
+   * with the topic of the last input of the batch.
+   *
+   * @param outputs Empty on call.
+   */
+  virtual return_type process_batch(std::vector<nlohmann::json> &outputs) = 0;
+};
+
+/**
+ * @brief Batch entry point of a sink plugin, used by the sink agent in place
+ * of load_data().
+ */
+class BatchSink {
+public:
+  virtual ~BatchSink() = default;
+
+  /**
+   * @brief Loads a batch of inputs, received in this order.
+   *
+   * @param inputs The payloads (valid until the call returns).
+   * @param topics The topic of each payload.
+   */
+  virtual return_type load_batch(std::span<const nlohmann::json> inputs,
+                                 std::span<const std::string> topics) = 0;
+};
+
+} // namespace Mads
+
+#endif // PLUGIN_BATCH_HPP
@@ -0,0 +1,61 @@
+/*
+  ____  _             _         _     _       _
+ |  _ \| |_   _  __ _(_)_ __   | |__ | | ___ | |__
+ | |_) | | | | |/ _` | | '_ \  | '_ \| |/ _ \| '_ \
+ |  __/| | |_| | (_| | | | | | | |_) | | (_) | |_) |
+ |_|   |_|\__,_|\__, |_|_| |_| |_.__/|_|\___/|_.__/
+                |___/
+
+Filter and sink plugins specialized on binary payloads. The filter and sink
+agents recognize them by the type of their driver, and hand them the blob
+messages (images, waveforms, ...) as views on the received buffer, with no
+copies and no JSON or base64 encoding.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef PLUGIN_BLOB_HPP
+#define PLUGIN_BLOB_HPP
+
+#include <cstddef>
+#include <filter.hpp>
+#include <nlohmann/json.hpp>
+#include <sink.hpp>
+#include <span>
+
+namespace Mads {
+
+/**
+ * @brief A blob message, as handed to blob plugins.
+ *
+ * The data are a view on the received message, valid only until load_data()
+ * returns: plugins must copy what they need to keep.
+ */
+struct blob_view {
+  std::span<const std::byte> data;
+  nlohmann::json meta; // Header of the blob, e.g. {"format": "jpg"}
+};
+
+/**
+ * @brief A filter taking blobs, producing JSON.
+ *
+ * @example
+ * class Histogram : public Mads::BlobFilter {
+ *   return_type load_data(Mads::blob_view const &blob, string topic) override;
+ *   return_type process(json &out) override;
+ *   ...
+ * };
+ * INSTALL_FILTER_DRIVER(Histogram, Mads::blob_view, json);
+ */
+using BlobFilter = Filter<blob_view, nlohmann::json>;
+using BlobFilterDriver = FilterDriver<blob_view, nlohmann::json>;
+
+/**
+ * @brief A sink taking blobs.
+ */
+using BlobSink = Sink<blob_view>;
+using BlobSinkDriver = SinkDriver<blob_view>;
+
+} // namespace Mads
+
+#endif // PLUGIN_BLOB_HPP
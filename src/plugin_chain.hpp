@@ -0,0 +1,156 @@
+/*
+  ____  _             _              _           _
+ |  _ \| |_   _  __ _(_)_ __     ___| |__   __ _(_)_ __
+ | |_) | | | | |/ _` | | '_ \   / __| '_ \ / _` | | '_ \
+ |  __/| | |_| | (_| | | | | | | (__| | | | (_| | | | | |
+ |_|   |_|\__,_|\__, |_|_| |_|  \___|_| |_|\__,_|_|_| |_|
+                |___/
+
+Chains of filter plugins hosted by a single plugin agent. The output of each
+stage is handed in memory to the next one, so that a pipeline of plugins
+costs no broker hops and no serialization between its stages.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef PLUGIN_CHAIN_HPP
+#define PLUGIN_CHAIN_HPP
+
+#include <filter.hpp>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Mads {
+
+/**
+ * @brief An ordered list of filter plugins, each one fed with the output of
+ * the previous one.
+ *
+ * The chain owns its plugins: they must be released with clear() before the
+ * pugg kernel unloads their libraries.
+ *
+ * @example
+ * FilterChain chain;
+ * chain.add("running_avg", driver->create());
+ * json data = ...;
+ * switch (chain.feed(data, topic)) {
+ *   case return_type::success:
+ *   case return_type::warning: agent.publish(data); break;
+ *   default: cerr << chain.failure().dump() << endl;
+ * }
+ */
+class FilterChain {
+public:
+  using filter_t = Filter<nlohmann::json, nlohmann::json>;
+  using driver_t = FilterDriver<nlohmann::json, nlohmann::json>;
+
+  /**
+   * @brief A stage of the chain.
+   */
+  struct stage {
+    std::string name;
+    filter_t *plugin;
+  };
+
+  FilterChain() = default;
+  FilterChain(const FilterChain &) = delete;
+  FilterChain &operator=(const FilterChain &) = delete;
+  ~FilterChain() { clear(); }
+
+  /**
+   * @brief Appends a stage, taking ownership of the plugin.
+   */
+  void add(std::string name, filter_t *plugin) {
+    _stages.push_back({std::move(name), plugin});
+  }
+
+  /**
+   * @brief Appends the stages of another chain, taking ownership of them.
+   */
+  void append(FilterChain &&other) {
+    for (auto &s : other._stages)
+      _stages.push_back(std::move(s));
+    other._stages.clear();
+  }
+
+  /**
+   * @brief Deletes the plugins of all the stages.
+   */
+  void clear() {
+    for (auto &s : _stages)
+      delete s.plugin;
+    _stages.clear();
+  }
+
+  bool empty() const { return _stages.empty(); }
+  size_t size() const { return _stages.size(); }
+  const std::vector<stage> &stages() const { return _stages; }
+
+  /**
+   * @brief Runs data through all the stages: load_data() then process() on
+   * each of them, the output of a stage becoming the input of the next.
+   *
+   * Warnings do not stop the chain: they are collected and added to the
+   * final output, under "warning" and the stage name. Any other non-success
+   * code stops the chain and is returned, with the details in failure().
+   *
+   * @param data Input of the first stage; on success, output of the last.
+   * @param topic Topic passed to each stage along with its input.
+   * @return success or warning if all the stages completed, otherwise the
+   * code of the failed stage (retry, error or critical).
+   */
+  return_type feed(nlohmann::json &data, const std::string &topic) {
+    nlohmann::json warnings;
+    _failure = nullptr;
+    for (auto &s : _stages) {
+      return_type rt = s.plugin->load_data(data, topic);
+      if (!accept(rt, s, "load_data", warnings))
+        return rt;
+      nlohmann::json out;
+      rt = s.plugin->process(out);
+      if (!accept(rt, s, "process", warnings))
+        return rt;
+      data = std::move(out);
+    }
+    if (warnings.empty())
+      return return_type::success;
+    if (data.is_object()) {
+      auto &w = data["warning"];
+      if (!w.is_null() && !w.is_object())
+        w = {{"plugin", w}};
+      w.update(warnings);
+    }
+    return return_type::warning;
+  }
+
+  /**
+   * @brief The stage that stopped the last feed(), as {"stage", "method",
+   * "error"}; null if the chain completed.
+   */
+  const nlohmann::json &failure() const { return _failure; }
+
+private:
+  bool accept(return_type rt, stage &s, const char *method,
+              nlohmann::json &warnings) {
+    switch (rt) {
+    case return_type::success:
+      return true;
+    case return_type::warning:
+      warnings[s.name] = {{method, s.plugin->error()}};
+      return true;
+    default:
+      _failure = {
+          {"stage", s.name}, {"method", method}, {"error", s.plugin->error()}};
+      return false;
+    }
+  }
+
+  std::vector<stage> _stages;
+  nlohmann::json _failure;
+};
+
+} // namespace Mads
+
+#endif // PLUGIN_CHAIN_HPP
@@ -0,0 +1,271 @@
+/*
+  ____  _             _                           _
+ |  _ \| |_   _  __ _(_)_ __    _ __   ___   ___ | |
+ | |_) | | | | |/ _` | | '_ \  | '_ \ / _ \ / _ \| |
+ |  __/| | |_| | (_| | | | | | | |_) | (_) | (_) | |
+ |_|   |_|\__,_|\__, |_|_| |_| | .__/ \___/ \___/|_|
+                |___/          |_|
+
+Pool of worker threads, each one owning its own instances of the plugins of
+a filter agent, so that CPU-bound plugins can use more than one core within
+a single agent. Messages are dispatched round-robin, or by a key field for
+plugins that keep a state per key, and optionally put back in input order.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef PLUGIN_POOL_HPP
+#define PLUGIN_POOL_HPP
+
+#include "outbox.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief How a plugin can be run concurrently, as declared by the
+ * "concurrency" entry of its info() map.
+ *
+ * - serial: one instance only (default, when not declared)
+ * - stateless: instances are independent, any message can go to any of them
+ * - keyed: instances keep a state per key, so messages with the same key
+ *   must go to the same instance
+ */
+enum class plugin_concurrency { serial = 0, stateless, keyed };
+
+/**
+ * @brief Map of concurrency declarations to strings (as returned by info()).
+ *
+ */
+static const std::map<plugin_concurrency, std::string> plugin_concurrency_map =
+    {
+        {plugin_concurrency::serial, "serial"},
+        {plugin_concurrency::stateless, "stateless"},
+        {plugin_concurrency::keyed, "keyed"},
+};
+
+/**
+ * @brief Reads the concurrency declared in the info() map of a plugin.
+ *
+ * @return serial if undeclared or unknown.
+ */
+static plugin_concurrency
+plugin_concurrency_of(const std::map<std::string, std::string> &info) {
+  auto it = info.find("concurrency");
+  if (it == info.end())
+    return plugin_concurrency::serial;
+  for (auto const &[k, v] : plugin_concurrency_map) {
+    if (v == it->second)
+      return k;
+  }
+  return plugin_concurrency::serial;
+}
+
+/**
+ * @brief Workers running jobs in parallel, each with its own bounded queue.
+ *
+ * Jobs are submitted from a single thread. When ordered, the completed jobs
+ * are handed to the done callback in submission order (the reorder buffer
+ * holds at most the jobs in flight); otherwise, as soon as they complete.
+ * The done callback runs in the worker threads, but never concurrently. A
+ * job whose work throws is counted as an error and hands nothing on, but
+ * still takes its turn.
+ *
+ * @example
+ * WorkerPool<json> pool(4, 64, true,
+ *   [&](size_t w, json &j) { return process(instances[w], j); },
+ *   [&](json &j) { agent.publish(j); });
+ * pool.submit(std::move(data), pool.next());
+ * pool.stop(); // runs what is queued, then joins
+ */
+template <typename Job> class WorkerPool {
+public:
+  /** @brief Runs a job on a worker; false if there is nothing to hand on. */
+  using work_t = std::function<bool(size_t worker, Job &job)>;
+  /** @brief Receives a completed job, one at a time. */
+  using done_t = std::function<void(Job &job)>;
+
+  /**
+   * @brief Starts the workers.
+   *
+   * @param n Number of workers.
+   * @param depth Capacity of the queue of each worker.
+   * @param ordered Hand the completed jobs on in submission order.
+   */
+  WorkerPool(size_t n, size_t depth, bool ordered, work_t work, done_t done)
+      : _ordered(ordered), _work(std::move(work)), _done(std::move(done)) {
+    for (size_t i = 0; i < n; i++)
+      _workers.push_back(std::make_unique<worker>(depth));
+    for (size_t i = 0; i < n; i++)
+      _workers[i]->thread = std::thread([this, i]() { run(i); });
+  }
+
+  ~WorkerPool() { stop(); }
+
+  size_t size() const { return _workers.size(); }
+  bool ordered() const { return _ordered; }
+
+  /**
+   * @brief The next worker, round-robin.
+   */
+  size_t next() { return _next++ % _workers.size(); }
+
+  /**
+   * @brief The worker for a key: always the same for equal keys.
+   */
+  size_t worker_for(const nlohmann::json &key) const {
+    return std::hash<std::string>{}(key.dump()) % _workers.size();
+  }
+
+  /**
+   * @brief Queues a job on a worker, waiting while its queue is full.
+   *
+   * @return false if the pool is stopped.
+   */
+  bool submit(Job &&job, size_t w) {
+    if (_stop)
+      return false;
+    item it{_submitted, std::move(job)};
+    auto &wk = *_workers.at(w);
+    while (!wk.queue.try_push(it)) {
+      if (_stop)
+        return false;
+      wake(wk);
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    _submitted++;
+    wake(wk);
+    return true;
+  }
+
+  /**
+   * @brief Runs the queued jobs, then joins the workers.
+   */
+  void stop() {
+    if (_stop.exchange(true))
+      return;
+    for (auto &wk : _workers) {
+      wake(*wk);
+      if (wk->thread.joinable())
+        wk->thread.join();
+    }
+  }
+
+  /**
+   * @brief Number of jobs run so far.
+   */
+  uint64_t completed() const { return _completed.load(); }
+
+  /**
+   * @brief Number of jobs whose work threw an exception.
+   */
+  uint64_t errors() const { return _errors.load(); }
+
+  /**
+   * @brief Jobs run by each worker, errors, and the maximum size of the
+   * reorder buffer.
+   */
+  nlohmann::json stats() const {
+    nlohmann::json jobs = nlohmann::json::array();
+    for (auto const &wk : _workers)
+      jobs.push_back(wk->jobs.load());
+    nlohmann::json j = {{"workers", _workers.size()},
+                        {"completed", _completed.load()},
+                        {"errors", _errors.load()},
+                        {"jobs", jobs}};
+    if (_ordered) {
+      std::lock_guard lock(_done_mtx);
+      j["reorder_high_water"] = _reorder_high_water;
+    }
+    return j;
+  }
+
+private:
+  struct item {
+    uint64_t seq = 0;
+    Job job;
+  };
+
+  struct worker {
+    explicit worker(size_t depth) : queue(depth) {}
+    MPSCQueue<item> queue;
+    std::thread thread;
+    std::atomic<uint32_t> signal{0};
+    std::atomic<uint64_t> jobs{0};
+  };
+
+  void wake(worker &wk) {
+    wk.signal.fetch_add(1, std::memory_order_release);
+    wk.signal.notify_one();
+  }
+
+  void run(size_t i) {
+    auto &wk = *_workers[i];
+    item it;
+    for (;;) {
+      uint32_t signal = wk.signal.load(std::memory_order_acquire);
+      // Read before popping: jobs submitted before stop() are then visible
+      bool stopping = _stop.load();
+      if (!wk.queue.try_pop(it)) {
+        if (stopping)
+          break;
+        wk.signal.wait(signal, std::memory_order_acquire);
+        continue;
+      }
+      bool emit = false;
+      try {
+        emit = _work(i, it.job);
+      } catch (...) {
+        _errors++;
+      }
+      wk.jobs++;
+      _completed++;
+      if (!_ordered) {
+        if (emit) {
+          std::lock_guard lock(_done_mtx);
+          _done(it.job);
+        }
+        continue;
+      }
+      // Jobs that emit nothing still take their turn in the sequence
+      std::lock_guard lock(_done_mtx);
+      _reorder.emplace(it.seq, emit ? std::make_unique<Job>(std::move(it.job))
+                                    : nullptr);
+      _reorder_high_water = std::max(_reorder_high_water, _reorder.size());
+      while (!_reorder.empty() && _reorder.begin()->first == _next_done) {
+        if (auto &job = _reorder.begin()->second)
+          _done(*job);
+        _reorder.erase(_reorder.begin());
+        _next_done++;
+      }
+    }
+  }
+
+  bool _ordered;
+  work_t _work;
+  done_t _done;
+  std::vector<std::unique_ptr<worker>> _workers;
+  size_t _next = 0;
+  uint64_t _submitted = 0;
+  std::atomic<bool> _stop{false};
+  std::atomic<uint64_t> _completed{0}, _errors{0};
+  mutable std::mutex _done_mtx; // Reorder buffer and done callback
+  std::map<uint64_t, std::unique_ptr<Job>> _reorder;
+  uint64_t _next_done = 0;
+  size_t _reorder_high_water = 0;
+};
+
+} // namespace Mads
+
+#endif // PLUGIN_POOL_HPP
@@ -0,0 +1,326 @@
+/*
+  ____                 _
+ |  _ \ ___  __ _  ___| |_ ___  _ __
+ | |_) / _ \/ _` |/ __| __/ _ \| '__|
+ |  _ <  __/ (_| | (__| || (_) | |
+ |_| \_\___|\__,_|\___|\__\___/|_|
+
+Single-threaded event loop for agents. ZeroMQ sockets, plain file descriptors
+(e.g. inotify, stdin) and timers are multiplexed in one zmq_poll call, and
+the handler of each ready source is dispatched in the calling thread. Idle
+agents sleep in the poll, with no timeout if they have no timers, and react
+as soon as something happens. Signal handlers wake them through a pipe.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <atomic>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <zmqpp/zmqpp.hpp>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Mads {
+
+/**
+ * @brief Event loop over sockets, file descriptors and timers.
+ *
+ * Handlers run in the thread calling run(); they can add and remove sources
+ * and timers. Socket handlers should consume all the available messages
+ * (non-blocking receive), as they are called again as long as the socket is
+ * readable. After changing the running flag from another thread or from a
+ * signal handler, call wake() (or wake_all()) to make run() notice it.
+ *
+ * @example
+ * Reactor reactor;
+ * reactor.add(subscriber, [&]() { while (sub.receive(msg, true)) {...} });
+ * reactor.add(STDIN_FILENO, [&]() { ... read(STDIN_FILENO, ...) ... });
+ * auto id = reactor.add_timer(1000ms, [&]() { publish_status(); });
+ * reactor.run(Mads::running);
+ */
+class Reactor {
+public:
+  using clock = std::chrono::steady_clock;
+  using handler_t = std::function<void()>;
+  using timer_id = uint64_t;
+
+  Reactor() {
+#ifndef _WIN32
+    if (pipe(_wake) == 0) {
+      for (int fd : _wake)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      _poller.add(_wake[0], zmqpp::poller::poll_in);
+      for (auto &slot : _registry) {
+        int free = -1;
+        if (slot.compare_exchange_strong(free, _wake[1]))
+          return;
+      }
+    }
+    // Without a wake pipe, signals must be noticed by polling
+    _max_wait = std::chrono::milliseconds(100);
+#endif
+  }
+
+  ~Reactor() {
+#ifndef _WIN32
+    for (auto &slot : _registry) {
+      int fd = _wake[1];
+      slot.compare_exchange_strong(fd, -1);
+    }
+    for (int fd : _wake) {
+      if (fd >= 0)
+        close(fd);
+    }
+#endif
+  }
+
+  Reactor(const Reactor &) = delete;
+  Reactor &operator=(const Reactor &) = delete;
+
+  /**
+   * @brief Calls handler when the socket has input.
+   */
+  void add(zmqpp::socket &socket, handler_t handler) {
+    remove(socket);
+    _poller.add(socket, zmqpp::poller::poll_in);
+    _sources.push_back({&socket, 0, std::move(handler)});
+  }
+
+  /**
+   * @brief Calls handler when the file descriptor (a socket on Windows) is
+   * readable.
+   */
+  void add(zmqpp::raw_socket_t fd, handler_t handler) {
+    remove(fd);
+    _poller.add(fd, zmqpp::poller::poll_in);
+    _sources.push_back({nullptr, fd, std::move(handler)});
+  }
+
+  void remove(zmqpp::socket &socket) {
+    for (auto &s : _sources) {
+      if (s.socket == &socket && !s.removed) {
+        _poller.remove(socket);
+        s.removed = true;
+      }
+    }
+  }
+
+  void remove(zmqpp::raw_socket_t fd) {
+    for (auto &s : _sources) {
+      if (!s.socket && s.fd == fd && !s.removed) {
+        _poller.remove(fd);
+        s.removed = true;
+      }
+    }
+  }
+
+  bool has(const zmqpp::socket &socket) const {
+    return std::any_of(_sources.begin(), _sources.end(), [&](auto &s) {
+      return s.socket == &socket && !s.removed;
+    });
+  }
+
+  /**
+   * @brief Calls handler every period (or once, after period, if not
+   * repeating). Deadlines are absolute, so periodic timers do not drift;
+   * missed ticks are skipped.
+   *
+   * @return The timer id, for cancel().
+   * @throws std::invalid_argument if a repeating timer has no positive
+   * period.
+   */
+  timer_id add_timer(std::chrono::milliseconds period, handler_t handler,
+                     bool repeat = true) {
+    if (repeat && period.count() <= 0)
+      throw std::invalid_argument("Repeating timers need a positive period");
+    timer_id id = ++_last_timer;
+    _timers[id] = {period, std::move(handler), repeat};
+    _deadlines.push({clock::now() + period, id});
+    return id;
+  }
+
+  void cancel(timer_id id) { _timers.erase(id); }
+
+  /**
+   * @brief Sets the longest sleep in the poll (negative for no limit, the
+   * default where wake() is available; 100 ms otherwise, e.g. on Windows).
+   */
+  void set_max_wait(std::chrono::milliseconds max_wait) {
+    _max_wait = max_wait;
+  }
+
+  /**
+   * @brief Interrupts the current (or next) wait of run() or run_once().
+   * Async-signal-safe, and callable from any thread.
+   */
+  void wake() {
+#ifndef _WIN32
+    notify(_wake[1]);
+#endif
+  }
+
+  /**
+   * @brief Wakes all the reactors of the process (async-signal-safe), e.g.
+   * from a SIGINT handler that clears the running flag.
+   */
+  static void wake_all() {
+#ifndef _WIN32
+    for (auto &slot : _registry)
+      notify(slot.load());
+#endif
+  }
+
+  /**
+   * @brief Waits for events (at most max_wait, if not negative) and
+   * dispatches them.
+   *
+   * @return The number of handlers called.
+   */
+  size_t run_once(std::chrono::milliseconds max_wait) {
+    size_t dispatched = fire_timers();
+    long timeout = (long)max_wait.count(); // Negative: no limit
+    if (!_deadlines.empty()) {
+      auto next = std::chrono::ceil<std::chrono::milliseconds>(
+          _deadlines.top().first - clock::now());
+      long t = std::max<long>((long)next.count(), 0);
+      timeout = timeout < 0 ? t : std::min(t, timeout);
+    }
+    if (dispatched > 0)
+      timeout = 0; // Just check the sources, timers may be due again
+    if (_sources.empty() && _wake[0] < 0) {
+      if (timeout != 0)
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(timeout > 0 ? timeout : 100));
+    } else if (_poller.poll(timeout)) {
+      if (_wake[0] >= 0 && _poller.has_input(_wake[0]))
+        drain();
+      // Handlers may add sources: only those present before are checked
+      size_t n = _sources.size();
+      for (size_t i = 0; i < n; i++) {
+        if (_sources[i].removed || !ready(_sources[i]))
+          continue;
+        handler_t handler = _sources[i].handler; // It may remove itself
+        handler();
+        dispatched++;
+      }
+    }
+    _sources.erase(std::remove_if(_sources.begin(), _sources.end(),
+                                  [](auto &s) { return s.removed; }),
+                   _sources.end());
+    return dispatched + fire_timers();
+  }
+
+  /**
+   * @brief Dispatches events until running becomes false or stop() is
+   * called.
+   */
+  void run(const bool &running) {
+    _stop = false;
+    while (running && !_stop)
+      run_once(_max_wait);
+  }
+
+  /**
+   * @brief Makes run() return (from a handler).
+   */
+  void stop() { _stop = true; }
+
+private:
+  struct source {
+    zmqpp::socket *socket;
+    zmqpp::raw_socket_t fd;
+    handler_t handler;
+    bool removed = false;
+  };
+
+  struct timer {
+    std::chrono::milliseconds period;
+    handler_t handler;
+    bool repeat;
+  };
+
+  using deadline_t = std::pair<clock::time_point, timer_id>;
+
+  bool ready(const source &s) const {
+    return s.socket ? _poller.has_input(*s.socket) : _poller.has_input(s.fd);
+  }
+
+  size_t fire_timers() {
+    size_t fired = 0;
+    auto now = clock::now();
+    while (!_deadlines.empty() && _deadlines.top().first <= now) {
+      auto [deadline, id] = _deadlines.top();
+      _deadlines.pop();
+      auto it = _timers.find(id);
+      if (it == _timers.end())
+        continue; // Cancelled
+      handler_t handler = it->second.handler;
+      if (it->second.repeat) {
+        auto period = it->second.period; // Positive, see add_timer()
+        do {
+          deadline += period;
+        } while (deadline <= now);
+        _deadlines.push({deadline, id});
+      } else {
+        _timers.erase(it);
+      }
+      handler();
+      fired++;
+    }
+    return fired;
+  }
+
+  static void notify(int fd) {
+#ifndef _WIN32
+    if (fd < 0)
+      return;
+    char c = 0;
+    [[maybe_unused]] auto n = ::write(fd, &c, 1); // Full pipe: already awake
+#endif
+  }
+
+  void drain() {
+#ifndef _WIN32
+    char buf[64];
+    while (::read(_wake[0], buf, sizeof(buf)) > 0)
+      ;
+#endif
+  }
+
+  // Write ends of the wake pipes of all reactors, for wake_all()
+  static inline std::atomic<int> _registry[32] = {
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+
+  zmqpp::poller _poller;
+  std::vector<source> _sources;
+  std::map<timer_id, timer> _timers;
+  std::priority_queue<deadline_t, std::vector<deadline_t>,
+                      std::greater<deadline_t>>
+      _deadlines;
+  timer_id _last_timer = 0;
+#ifdef _WIN32
+  std::chrono::milliseconds _max_wait{100};
+#else
+  std::chrono::milliseconds _max_wait{-1};
+#endif
+  int _wake[2] = {-1, -1};
+  bool _stop = false;
+};
+
+} // namespace Mads
+
+#endif // REACTOR_HPP
@@ -0,0 +1,385 @@
+/*
+  ____            _                    _
+ |  _ \ ___ _ __ | | __ _ _   _    ___| | __ _ ___ ___
+ | |_) / _ \ '_ \| |/ _` | | | |  / __| |/ _` / __/ __|
+ |  _ <  __/ |_) | | (_| | |_| | | (__| | (_| \__ \__ \
+ |_| \_\___| .__/|_|\__,_|\__, |  \___|_|\__,_|___/___/
+           |_|            |___/
+
+This class publishes recorded traffic again: either a broker journal (see
+journal.hpp), whose messages are sent as they were received, or the JSON
+file written by the logger (one {"topic": payload} document per line), whose
+payloads are published as new messages. The original timing is reproduced,
+possibly accelerated.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include "mads.hpp"
+#include "agent.hpp"
+#include "journal.hpp"
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+using json = nlohmann::json;
+
+namespace Mads {
+
+/**
+ * @brief The Replay class publishes a recording, preserving the timing of
+ * the messages.
+ *
+ * Times are the receive times for journals, and the timestamp (or, if
+ * missing, the timecode) of the payloads for logger files.
+ *
+ * @example
+ * Replay replay(argv[0], settings_uri);
+ * replay.init();
+ * replay.open("journal");
+ * replay.set_speed(10);
+ * replay.connect();
+ * replay.loop([&]() { if (!replay.play_next()) Mads::running = false; }, 0ms);
+ */
+class Replay : public Agent {
+public:
+  using clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Constructs a Replay object with the given name and settings path.
+   *
+   * @param name The name of the agent.
+   * @param settings_path The path to the settings file.
+   */
+  Replay(std::string name, std::string settings_path)
+      : Agent(name, settings_path) {}
+
+  /**
+   * @brief Opens a recording: a journal directory or segment (.journal), or
+   * a logger JSON file.
+   *
+   * @throws AgentError if the recording cannot be opened.
+   */
+  void open(const std::string &path) {
+    filesystem::path p(path);
+    try {
+      if (filesystem::is_directory(p) || p.extension() == ".journal") {
+        _journal.open(p);
+        _is_journal = true;
+      } else {
+        _file.open(p);
+        if (!_file)
+          throw std::runtime_error("Cannot open " + path);
+        _is_journal = false;
+      }
+    } catch (const std::exception &e) {
+      throw AgentError(e.what());
+    }
+    _path = path;
+  }
+
+  /**
+   * @brief Sets the playback speed: 1 is real time, 0 as fast as possible.
+   */
+  void set_speed(double speed) { _speed = speed < 0 ? 0 : speed; }
+
+  /**
+   * @brief Only publishes the topics starting with any of the prefixes (all
+   * if empty).
+   */
+  void set_topics(vector<string> topics) { _topics = std::move(topics); }
+
+  /**
+   * @brief Plays the part of the recording between from and to.
+   *
+   * Each bound is either an ISO date (e.g. "2024-05-10T14:30:00", local
+   * time unless a UTC offset follows) or seconds since the first message;
+   * empty means the beginning or the end of the recording. Journals are
+   * sought via their indexes; logger files are read up to from. Bounds are
+   * checked by the first play_next(), which throws AgentError if invalid.
+   */
+  void set_range(const string &from, const string &to) {
+    _from = from;
+    _to = to;
+  }
+
+  /**
+   * @brief Publishes the next message of the recording, after waiting for
+   * its time.
+   *
+   * @return false at the end of the recording (or of the range), or if
+   * Mads::running becomes false while waiting.
+   */
+  bool play_next() {
+    if (!_started)
+      start();
+    while (read_next()) {
+      if (_time > _to_ns)
+        return false;
+      if (_time < _from_ns && !(_flags & journal_flag::dictionary))
+        continue;
+      if (!selected(_topic))
+        continue;
+      if (!wait())
+        return false;
+      if (_is_journal)
+        forward(_topic, _record.frames);
+      else
+        publish(_payload, string(_topic));
+      _published++;
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * @brief Number of messages published so far.
+   */
+  size_t published() const { return _published; }
+
+  void info(ostream &out = cout) override {
+    Agent::info(out);
+    out << "  Recording:        " << style::bold << _path << " ("
+        << (_is_journal ? "journal" : "logger file") << ")" << style::reset
+        << endl;
+    out << "  Speed:            " << style::bold;
+    if (_speed > 0)
+      out << _speed << "x";
+    else
+      out << "as fast as possible";
+    out << style::reset << endl;
+    if (!_topics.empty()) {
+      out << "  Replayed topics:  " << style::bold;
+      for (auto const &t : _topics)
+        out << t << "* ";
+      out << style::reset << endl;
+    }
+  }
+
+  /**
+   * @brief Converts an ISO date to ns since the epoch.
+   *
+   * @return 0 if the string is not an ISO date.
+   */
+  static uint64_t parse_iso_time(const string &s) {
+    tm t{};
+    int ms = 0, n = 0;
+    if (sscanf(s.c_str(), "%d-%d-%dT%d:%d:%d%n", &t.tm_year, &t.tm_mon,
+               &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &n) != 6)
+      return 0;
+    string_view rest = string_view(s).substr(n);
+    if (!rest.empty() && rest[0] == '.') {
+      size_t digits = 1;
+      while (digits < rest.size() && isdigit(rest[digits]))
+        digits++;
+      string frac(rest.substr(1, digits - 1));
+      frac.resize(3, '0');
+      ms = stoi(frac);
+      rest.remove_prefix(digits);
+    }
+    int64_t seconds;
+    if (rest.empty()) {
+      // Local time
+      t.tm_year -= 1900;
+      t.tm_mon -= 1;
+      t.tm_isdst = -1;
+      seconds = (int64_t)mktime(&t);
+    } else {
+      int offset = 0;
+      if (rest[0] == '+' || rest[0] == '-') {
+        // +hh, +hhmm or +hh:mm
+        string digits;
+        for (char c : rest.substr(1)) {
+          if (isdigit(c))
+            digits += c;
+        }
+        if (digits.size() != 2 && digits.size() != 4)
+          return 0;
+        int hh = stoi(digits.substr(0, 2));
+        int mm = digits.size() == 4 ? stoi(digits.substr(2)) : 0;
+        offset = (rest[0] == '-' ? -1 : 1) * (hh * 3600 + mm * 60);
+      } else if (rest != "Z") {
+        return 0;
+      }
+      auto days = chrono::sys_days(chrono::year(t.tm_year) /
+                                   chrono::month(t.tm_mon) /
+                                   chrono::day(t.tm_mday));
+      seconds = days.time_since_epoch().count() * 86400LL +
+                t.tm_hour * 3600 + t.tm_min * 60 + t.tm_sec - offset;
+    }
+    if (seconds < 0)
+      return 0;
+    return (uint64_t)seconds * 1000000000ull + (uint64_t)ms * 1000000ull;
+  }
+
+private:
+  // Resolves the range and seeks its start
+  void start() {
+    _started = true;
+    _from_ns = 0;
+    _to_ns = numeric_limits<uint64_t>::max();
+    uint64_t first = 0;
+    if (_is_journal) {
+      first = _journal.first_timestamp();
+    } else if (!_from.empty() || !_to.empty()) {
+      // The first time of a logger file: peek at the first records
+      auto pos = _file.tellg();
+      while (read_next() && _time == 0) {
+      }
+      first = _time;
+      _file.clear();
+      _file.seekg(pos);
+      _timecode_day = 0;
+      _last_timecode = -1;
+    }
+    _from_ns = resolve(_from, first, 0);
+    _to_ns = resolve(_to, first, numeric_limits<uint64_t>::max());
+    if (_is_journal && _from_ns > 0)
+      _journal.seek(_from_ns);
+  }
+
+  uint64_t resolve(const string &bound, uint64_t first, uint64_t fallback) {
+    if (bound.empty())
+      return fallback;
+    if (uint64_t t = parse_iso_time(bound))
+      return t;
+    try {
+      return first + (uint64_t)(std::stod(bound) * 1e9);
+    } catch (const std::exception &) {
+      throw AgentError("Invalid time: " + bound);
+    }
+  }
+
+  bool selected(string_view topic) const {
+    // Commands were meant for the agents alive at recording time
+    if (topic == "control")
+      return false;
+    if (_topics.empty())
+      return true;
+    for (auto const &t : _topics) {
+      if (topic.substr(0, t.size()) == t)
+        return true;
+    }
+    return false;
+  }
+
+  // Reads the next record into _time, _topic, _flags and _record/_payload
+  bool read_next() {
+    if (_is_journal) {
+      if (!_journal.next(_record))
+        return false;
+      _time = _record.timestamp;
+      _topic = _record.topic;
+      _flags = _record.flags;
+      return true;
+    }
+    string line;
+    while (getline(_file, line)) {
+      // Array format: skip brackets, and the comma after each document
+      size_t end = line.find_last_not_of(" \t\r,");
+      if (end == string::npos || line[0] == '[' || line[0] == ']')
+        continue;
+      line.resize(end + 1);
+      json doc;
+      try {
+        doc = json::parse(line);
+      } catch (const json::parse_error &) {
+        cerr << fg::yellow << "Skipping invalid line: " << line.substr(0, 60)
+             << fg::reset << endl;
+        continue;
+      }
+      if (!doc.is_object() || doc.size() != 1)
+        continue;
+      _line_topic = doc.begin().key();
+      _topic = _line_topic;
+      _payload = std::move(doc.begin().value());
+      _flags = 0;
+      _time = payload_time(_payload);
+      return true;
+    }
+    return false;
+  }
+
+  uint64_t payload_time(json &payload) {
+    if (!payload.is_object())
+      return 0;
+    if (payload.contains("timestamp") && payload["timestamp"].is_object()) {
+      auto &date = payload["timestamp"]["$date"];
+      if (date.is_string()) {
+        if (uint64_t t = parse_iso_time(date.get<string>()))
+          return t;
+      } else if (date.is_number()) {
+        return date.get<uint64_t>() * 1000000ull; // ms since the epoch
+      }
+    }
+    if (payload.contains("timecode") && payload["timecode"].is_number()) {
+      // Seconds since midnight: count the days when it wraps
+      double tc = payload["timecode"].get<double>();
+      if (_last_timecode >= 0 && tc < _last_timecode - 43200)
+        _timecode_day++;
+      _last_timecode = tc;
+      // Payloads published again get a new timecode
+      payload.erase("timecode");
+      return (uint64_t)((_timecode_day * 86400 + tc) * 1e9);
+    }
+    return 0;
+  }
+
+  // Waits for the time of the current record; false if interrupted
+  bool wait() {
+    // Dictionaries are repeated at the start of journal segments, with
+    // their original times: they are sent right away
+    if (_time == 0 || _flags & journal_flag::dictionary)
+      return true;
+    if (_t0 == 0) {
+      _t0 = _time;
+      _w0 = clock::now();
+      return true;
+    }
+    if (_speed <= 0 || _time <= _t0)
+      return true;
+    auto due = _w0 + chrono::nanoseconds((int64_t)((_time - _t0) / _speed));
+    while (Mads::running) {
+      auto now = clock::now();
+      if (now >= due)
+        return true;
+      this_thread::sleep_for(min<clock::duration>(due - now, 100ms));
+    }
+    return false;
+  }
+
+  string _path;
+  bool _is_journal = false;
+  JournalReader _journal;
+  JournalReader::record _record;
+  ifstream _file;
+  string _line_topic;
+  json _payload;
+  double _last_timecode = -1;
+  int64_t _timecode_day = 0;
+
+  double _speed = 1.0;
+  vector<string> _topics;
+  string _from, _to;
+  uint64_t _from_ns = 0, _to_ns = numeric_limits<uint64_t>::max();
+  bool _started = false;
+
+  uint64_t _time = 0; // Current record
+  string_view _topic;
+  uint8_t _flags = 0;
+
+  uint64_t _t0 = 0; // Time of the first published record
+  clock::time_point _w0;
+  size_t _published = 0;
+};
+
+} // namespace Mads
+
+#endif // REPLAY_HPP
@@ -0,0 +1,220 @@
+/*
+  ____       _              _       _
+ / ___|  ___| |__   ___  __| |_   _| | ___ _ __
+ \___ \ / __| '_ \ / _ \/ _` | | | | |/ _ \ '__|
+  ___) | (__| | | |  __/ (_| | |_| | |  __/ |
+ |____/ \___|_| |_|\___|\__,_|\__,_|_|\___|_|
+
+Drift-free periodic scheduler for agent main loops. Deadlines are absolute
+(steady clock), so the period does not accumulate the execution time of the
+loop body, and no thread is needed for timing.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <nlohmann/json.hpp>
+#ifdef __linux__
+#include <cerrno>
+#include <ctime>
+#endif
+
+namespace Mads {
+
+/**
+ * @brief What to do when an iteration runs past its deadline.
+ *
+ * - skip: drop the missed ticks and wait for the next one in phase
+ * - burst: run the missed ticks back-to-back, until back in phase
+ * - shift: restart the period from the end of the late iteration
+ */
+enum class overrun_policy { skip = 0, burst, shift };
+
+/**
+ * @brief Map of overrun policies to strings (as used in the INI file).
+ *
+ */
+static const std::map<overrun_policy, std::string> overrun_policy_map = {
+    {overrun_policy::skip, "skip"},
+    {overrun_policy::burst, "burst"},
+    {overrun_policy::shift, "shift"},
+};
+
+/**
+ * @brief Parses an overrun policy name.
+ *
+ * @param name One of "skip", "burst", "shift".
+ * @return The overrun policy.
+ * @throws std::invalid_argument if the name is unknown.
+ */
+static overrun_policy overrun_policy_from(const std::string &name) {
+  for (auto const &[k, v] : overrun_policy_map) {
+    if (v == name)
+      return k;
+  }
+  throw std::invalid_argument("Unknown overrun policy: " + name);
+}
+
+/**
+ * @brief Statistics of a periodic loop.
+ *
+ * Jitter is the difference between the actual and the nominal period; its
+ * absolute value is binned in a decade histogram (<10 us, <100 us, <1 ms,
+ * <10 ms, >=10 ms).
+ */
+struct LoopStats {
+  static constexpr size_t bins = 5;
+  uint64_t iterations = 0;
+  uint64_t overruns = 0;
+  uint64_t skipped = 0;
+  double period_nominal = 0; // seconds
+  double period_mean = 0;    // seconds
+  double period_min = std::numeric_limits<double>::max();
+  double period_max = 0;
+  std::array<uint64_t, bins> jitter_hist{};
+
+  void reset(double nominal) {
+    *this = LoopStats();
+    period_nominal = nominal;
+  }
+
+  void add(double period) {
+    uint64_t n = ++iterations;
+    period_mean += (period - period_mean) / n;
+    period_min = std::min(period_min, period);
+    period_max = std::max(period_max, period);
+    double jitter = std::abs(period - period_nominal);
+    size_t bin = 0;
+    for (double edge = 10e-6; bin < bins - 1 && jitter >= edge; edge *= 10)
+      bin++;
+    jitter_hist[bin]++;
+  }
+
+  nlohmann::json json() const {
+    return {{"iterations", iterations},
+            {"overruns", overruns},
+            {"skipped", skipped},
+            {"period_nominal", period_nominal},
+            {"period_mean", period_mean},
+            {"period_min", iterations > 0 ? period_min : 0.0},
+            {"period_max", period_max},
+            {"jitter_hist",
+             {{"<10us", jitter_hist[0]},
+              {"<100us", jitter_hist[1]},
+              {"<1ms", jitter_hist[2]},
+              {"<10ms", jitter_hist[3]},
+              {">=10ms", jitter_hist[4]}}}};
+  }
+};
+
+/**
+ * @brief Periodic scheduler based on absolute deadlines.
+ *
+ * @example
+ * Scheduler sched(chrono::milliseconds(10));
+ * sched.start();
+ * while (running) {
+ *   do_something();
+ *   sched.wait(); // sleeps until the next 10 ms tick
+ * }
+ */
+class Scheduler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  Scheduler(std::chrono::nanoseconds period = std::chrono::nanoseconds(0),
+            overrun_policy policy = overrun_policy::skip)
+      : _period(period), _policy(policy) {}
+
+  void set_period(std::chrono::nanoseconds period) { _period = period; }
+  std::chrono::nanoseconds period() const { return _period; }
+
+  void set_policy(overrun_policy policy) { _policy = policy; }
+  overrun_policy policy() const { return _policy; }
+
+  /**
+   * @brief Anchors the first deadline one period from now and resets stats.
+   */
+  void start() {
+    _last = clock::now();
+    _deadline = _last + _period;
+    _stats.reset(std::chrono::duration<double>(_period).count());
+  }
+
+  /**
+   * @brief Sleeps until the next deadline, then schedules the following one
+   * according to the overrun policy.
+   *
+   * @return false if the sleep was interrupted by a signal.
+   */
+  bool wait() {
+    clock::time_point now = clock::now();
+    bool interrupted = false;
+    if (now > _deadline) {
+      _stats.overruns++;
+      switch (_policy) {
+      case overrun_policy::skip: {
+        // The late tick itself is dropped too, along with the missed ones
+        auto missed = (now - _deadline) / _period + 1;
+        _stats.skipped += missed;
+        _deadline += _period * missed;
+        interrupted = !sleep_until(_deadline);
+        break;
+      }
+      case overrun_policy::burst:
+        break; // run immediately, deadlines unchanged
+      case overrun_policy::shift:
+        _deadline = now;
+        break;
+      }
+    } else {
+      interrupted = !sleep_until(_deadline);
+    }
+    now = clock::now();
+    _stats.add(std::chrono::duration<double>(now - _last).count());
+    _last = now;
+    _deadline += _period;
+    return !interrupted;
+  }
+
+  const LoopStats &stats() const { return _stats; }
+
+private:
+  static bool sleep_until(clock::time_point deadline) {
+#ifdef __linux__
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  deadline.time_since_epoch())
+                  .count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) !=
+           EINTR;
+#else
+    std::this_thread::sleep_until(deadline);
+    return true;
+#endif
+  }
+
+  std::chrono::nanoseconds _period;
+  overrun_policy _policy;
+  clock::time_point _deadline, _last;
+  LoopStats _stats;
+};
+
+} // namespace Mads
+
+#endif // SCHEDULER_HPP
@@ -0,0 +1,139 @@
+/*
+  ____  _                   _
+ / ___|| |__   __ _ _ __ __| |___
+ \___ \| '_ \ / _` | '__/ _` / __|
+  ___) | | | | (_| | | | (_| \__ \
+ |____/|_| |_|\__,_|_|  \__,_|___/
+
+Topic partitioning of the broker. A partitioned broker runs one proxy per
+shard, each on its own pair of endpoints; every topic is assigned to exactly
+one shard, by prefix rules or by hash. The map is read from the [broker]
+section, which agents also receive with the settings, so that publishers
+send each topic to its shard and subscribers connect to all the shards.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef SHARDS_HPP
+#define SHARDS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <toml++/toml.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Assignment of topics to broker shards.
+ *
+ * Settings, in the [broker] section:
+ * - shards: number of shards (default 1, not partitioned)
+ * - shard_port_step: shard i uses the frontend and backend ports plus
+ *   i * shard_port_step (default 10)
+ * - [broker.shard_prefixes]: topic prefix = shard index; the longest
+ *   matching prefix wins, other topics are assigned by hash
+ *
+ * @example
+ * ShardMap shards(config["broker"].as_table());
+ * size_t i = shards.shard("camera_left");
+ * string ep = shards.endpoint("tcp://localhost:9090", i);
+ */
+class ShardMap {
+public:
+  ShardMap() = default;
+
+  /**
+   * @brief Reads the map from the [broker] section (may be null).
+   *
+   * @throws std::invalid_argument on invalid settings.
+   */
+  explicit ShardMap(const toml::table *broker) {
+    if (!broker)
+      return;
+    int64_t count = (*broker)["shards"].value_or(1);
+    if (count < 1)
+      throw std::invalid_argument("shards must be at least 1");
+    _count = (size_t)count;
+    int64_t step = (*broker)["shard_port_step"].value_or(10);
+    if (step < 1)
+      throw std::invalid_argument("shard_port_step must be at least 1");
+    _port_step = (unsigned)step;
+    if (auto prefixes = (*broker)["shard_prefixes"].as_table()) {
+      for (auto const &[k, v] : *prefixes) {
+        int64_t i = v.value_or(-1);
+        if (i < 0 || i >= count)
+          throw std::invalid_argument("Invalid shard for prefix '" +
+                                      std::string(k.str()) + "'");
+        _prefixes.emplace_back(std::string(k.str()), (size_t)i);
+      }
+    }
+    std::sort(_prefixes.begin(), _prefixes.end(), [](auto &a, auto &b) {
+      return a.first.size() > b.first.size();
+    });
+  }
+
+  size_t count() const { return _count; }
+
+  bool enabled() const { return _count > 1; }
+
+  /**
+   * @brief The shard of a topic.
+   */
+  size_t shard(std::string_view topic) const {
+    if (_count == 1)
+      return 0;
+    for (auto const &[prefix, i] : _prefixes) {
+      if (topic.substr(0, prefix.size()) == prefix)
+        return i;
+    }
+    // FNV-1a: stable across processes and platforms, unlike std::hash
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : topic) {
+      h ^= c;
+      h *= 1099511628211ull;
+    }
+    return h % _count;
+  }
+
+  /**
+   * @brief The endpoint of a shard, derived from the endpoint of shard 0 by
+   * offsetting the port (or suffixing the path for endpoints with no port).
+   */
+  std::string endpoint(const std::string &base, size_t i) const {
+    if (i == 0)
+      return base;
+    size_t colon = base.find_last_of(':');
+    std::string port = base.substr(colon + 1);
+    if (colon == std::string::npos || port.empty() ||
+        port.find_first_not_of("0123456789") != std::string::npos)
+      return base + "-" + std::to_string(i);
+    return base.substr(0, colon + 1) +
+           std::to_string(std::stoul(port) + i * _port_step);
+  }
+
+  /**
+   * @brief True if the maps assign topics and endpoints in the same way.
+   */
+  bool operator==(const ShardMap &other) const = default;
+
+  /**
+   * @brief The prefix rules, longest first.
+   */
+  const std::vector<std::pair<std::string, size_t>> &prefixes() const {
+    return _prefixes;
+  }
+
+private:
+  size_t _count = 1;
+  unsigned _port_step = 10;
+  std::vector<std::pair<std::string, size_t>> _prefixes;
+};
+
+} // namespace Mads
+
+#endif // SHARDS_HPP
@@ -0,0 +1,333 @@
+/*
+  _____           _            _
+ |_   _|__  _ __ (_) ___   ___| |_ ___  _ __ ___
+   | |/ _ \| '_ \| |/ __| / __| __/ _ \| '__/ _ \
+   | | (_) | |_) | | (__  \__ \ || (_) | | |  __/
+   |_|\___/| .__/|_|\___| |___/\__\___/|_|  \___|
+           |_|
+
+Store of the last message received on each topic. It is written by the
+receiving thread only, and it can be read from any thread without locks:
+values and the topic index are immutable and published by swapping shared
+pointers (RCU style), so that a reader keeps what it has loaded alive for as
+long as it needs it. The store can be bounded in number of topics, in memory
+and in age of the last update, evicting the least recently updated topics.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef STATUS_HPP
+#define STATUS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief A shared pointer that can be loaded and stored atomically.
+ *
+ * Uses std::atomic<std::shared_ptr> where available, the atomic free
+ * functions otherwise (e.g. libc++).
+ */
+template <typename T> class atomic_shared {
+public:
+  std::shared_ptr<T> load() const {
+#ifdef __cpp_lib_atomic_shared_ptr
+    return _ptr.load(std::memory_order_acquire);
+#else
+    return std::atomic_load_explicit(&_ptr, std::memory_order_acquire);
+#endif
+  }
+
+  void store(std::shared_ptr<T> ptr) {
+#ifdef __cpp_lib_atomic_shared_ptr
+    _ptr.store(std::move(ptr), std::memory_order_release);
+#else
+    std::atomic_store_explicit(&_ptr, std::move(ptr),
+                               std::memory_order_release);
+#endif
+  }
+
+private:
+#ifdef __cpp_lib_atomic_shared_ptr
+  std::atomic<std::shared_ptr<T>> _ptr;
+#else
+  std::shared_ptr<T> _ptr;
+#endif
+};
+
+/**
+ * @brief Bounds of a topic store. Zero means unbounded.
+ *
+ * - max_topics: maximum number of topics
+ * - max_bytes: maximum memory held by the stored messages
+ * - ttl: topics not updated for this long are evicted
+ */
+struct StatusBounds {
+  size_t max_topics = 0;
+  size_t max_bytes = 0;
+  std::chrono::milliseconds ttl{0};
+
+  bool bounded() const {
+    return max_topics > 0 || max_bytes > 0 || ttl.count() > 0;
+  }
+};
+
+/**
+ * @brief Hashed, bounded, versioned store of the last value of each topic.
+ *
+ * Each update gets a per-topic sequence number (1, 2, ...) and a store-wide
+ * version, so that consumers can ask for what changed after a given version.
+ * T must provide size_t footprint() const, the memory it holds in bytes.
+ * Writer methods (emplace(), expire(), clear(), set_bounds(), on_change())
+ * must be called by a single thread; reader methods (get(), snapshot(),
+ * size(), bytes(), version(), stats()) by any thread.
+ *
+ * @example
+ * TopicStore<inbound> store;
+ * store.set_bounds({100, 64 << 20, 60s});
+ * store.on_change([](string_view topic, auto const &rec) { ... });
+ * auto rec = store.emplace("sensors", message, header); // receiving thread
+ * auto snap = store.snapshot(last_version); // any thread
+ * for (auto const &[topic, rec] : snap.entries) { ... }
+ */
+template <typename T> class TopicStore {
+public:
+  using clock = std::chrono::steady_clock;
+
+  /**
+   * @brief A stored value, with its sequence number and version.
+   */
+  struct record {
+    template <typename... Args>
+    record(uint64_t s, uint64_t v, Args &&...args)
+        : seq(s), version(v), value(std::forward<Args>(args)...) {}
+    uint64_t seq;     // Per-topic sequence number
+    uint64_t version; // Store version at the update
+    T value;
+  };
+
+  using record_ptr = std::shared_ptr<const record>;
+  using callback_t =
+      std::function<void(std::string_view topic, const record &rec)>;
+
+private:
+  struct slot {
+    std::string topic;
+    atomic_shared<const record> current;
+    // Writer only
+    uint64_t seq = 0;
+    size_t bytes = 0;
+    clock::time_point updated;
+    typename std::list<slot *>::iterator lru;
+  };
+
+  struct string_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  using index_t = std::unordered_map<std::string, std::shared_ptr<slot>,
+                                     string_hash, std::equal_to<>>;
+
+public:
+  /**
+   * @brief A consistent view of (part of) the store. Topics and records are
+   * kept alive by the snapshot.
+   */
+  struct snapshot_t {
+    std::shared_ptr<const index_t> index;
+    std::vector<std::pair<std::string_view, record_ptr>> entries;
+  };
+
+  TopicStore() { _published.store(std::make_shared<const index_t>()); }
+
+  TopicStore(const TopicStore &) = delete;
+  TopicStore &operator=(const TopicStore &) = delete;
+
+  /**
+   * @brief Sets the bounds, evicting topics as needed (writer).
+   */
+  void set_bounds(const StatusBounds &bounds) {
+    _bounds = bounds;
+    if (enforce(nullptr))
+      publish_index();
+  }
+
+  const StatusBounds &bounds() const { return _bounds; }
+
+  /**
+   * @brief Adds a callback, called by the writer on each update.
+   */
+  void on_change(callback_t callback) {
+    _callbacks.push_back(std::move(callback));
+  }
+
+  /**
+   * @brief Stores a new value for a topic, constructed in place (writer).
+   *
+   * @param topic The topic.
+   * @param args Arguments for the constructor of T.
+   * @return The new record.
+   */
+  template <typename... Args>
+  record_ptr emplace(std::string_view topic, Args &&...args) {
+    bool index_changed = false;
+    auto it = _index.find(topic);
+    if (it == _index.end()) {
+      auto s = std::make_shared<slot>();
+      s->topic = topic;
+      _lru.push_front(s.get());
+      s->lru = _lru.begin();
+      it = _index.emplace(std::string(topic), std::move(s)).first;
+      index_changed = true;
+    } else {
+      _lru.splice(_lru.begin(), _lru, it->second->lru);
+    }
+    slot &s = *it->second;
+    auto rec = std::make_shared<const record>(++s.seq, ++_version,
+                                              std::forward<Args>(args)...);
+    _bytes.fetch_add(rec->value.footprint() + sizeof(record),
+                     std::memory_order_relaxed);
+    _bytes.fetch_sub(s.bytes, std::memory_order_relaxed);
+    s.bytes = rec->value.footprint() + sizeof(record);
+    s.updated = clock::now();
+    s.current.store(rec);
+    if (_bounds.bounded())
+      index_changed |= enforce(&s);
+    if (index_changed)
+      publish_index();
+    for (auto &cb : _callbacks)
+      cb(s.topic, *rec);
+    return rec;
+  }
+
+  /**
+   * @brief Evicts the topics older than the TTL (writer). Also done on each
+   * update.
+   */
+  void expire() {
+    if (_bounds.ttl.count() > 0 && enforce(nullptr))
+      publish_index();
+  }
+
+  /**
+   * @brief Removes all topics (writer).
+   */
+  void clear() {
+    _index.clear();
+    _lru.clear();
+    _bytes = 0;
+    publish_index();
+  }
+
+  /**
+   * @brief The last record of a topic (any thread).
+   *
+   * @return The record, or null if the topic is unknown.
+   */
+  record_ptr get(std::string_view topic) const {
+    auto index = _published.load();
+    auto it = index->find(topic);
+    return it == index->end() ? nullptr : it->second->current.load();
+  }
+
+  /**
+   * @brief The records updated after a given version (any thread).
+   *
+   * @param since A version (0 for all the records).
+   * @return The snapshot, in no particular order.
+   */
+  snapshot_t snapshot(uint64_t since = 0) const {
+    snapshot_t snap;
+    snap.index = _published.load();
+    snap.entries.reserve(snap.index->size());
+    for (auto const &[topic, s] : *snap.index) {
+      auto rec = s->current.load();
+      if (rec && rec->version > since)
+        snap.entries.emplace_back(s->topic, std::move(rec));
+    }
+    return snap;
+  }
+
+  /**
+   * @brief The last version (number of updates since creation).
+   */
+  uint64_t version() const { return _version.load(std::memory_order_acquire); }
+
+  size_t size() const { return _published.load()->size(); }
+
+  size_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Occupation and eviction counters.
+   */
+  nlohmann::json stats() const {
+    nlohmann::json j{{"topics", size()},
+                     {"bytes", bytes()},
+                     {"version", version()},
+                     {"evicted", _evicted.load(std::memory_order_relaxed)}};
+    if (_bounds.max_topics > 0)
+      j["max_topics"] = _bounds.max_topics;
+    if (_bounds.max_bytes > 0)
+      j["max_bytes"] = _bounds.max_bytes;
+    if (_bounds.ttl.count() > 0)
+      j["ttl"] = _bounds.ttl.count();
+    return j;
+  }
+
+private:
+  // Evicts least recently updated topics until bounds are met, never
+  // evicting keep. Returns true if any topic was evicted.
+  bool enforce(const slot *keep) {
+    bool evicted = false;
+    auto now = clock::now();
+    while (!_lru.empty() && _lru.back() != keep) {
+      slot *s = _lru.back();
+      bool over =
+          (_bounds.max_topics > 0 && _index.size() > _bounds.max_topics) ||
+          (_bounds.max_bytes > 0 && bytes() > _bounds.max_bytes) ||
+          (_bounds.ttl.count() > 0 && now - s->updated > _bounds.ttl);
+      if (!over)
+        break;
+      _bytes.fetch_sub(s->bytes, std::memory_order_relaxed);
+      _lru.pop_back();
+      _index.erase(_index.find(s->topic));
+      _evicted.fetch_add(1, std::memory_order_relaxed);
+      evicted = true;
+    }
+    return evicted;
+  }
+
+  // Readers get a copy of the index: slots are shared, so this is a copy of
+  // pointers, only done when topics are added or evicted
+  void publish_index() {
+    _published.store(std::make_shared<const index_t>(_index));
+  }
+
+  index_t _index;           // Writer's index
+  std::list<slot *> _lru;   // Most recently updated first
+  atomic_shared<const index_t> _published; // Readers' index
+  StatusBounds _bounds;
+  std::vector<callback_t> _callbacks;
+  std::atomic<uint64_t> _version{0};
+  std::atomic<size_t> _bytes{0};
+  std::atomic<uint64_t> _evicted{0};
+};
+
+} // namespace Mads
+
+#endif // STATUS_HPP
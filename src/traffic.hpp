@@ -0,0 +1,326 @@
+/*
+  _____           __  __ _
+ |_   _| __ __ _ / _|/ _(_) ___
+   | || '__/ _` | |_| |_| |/ __|
+   | || | | (_| |  _|  _| | (__
+   |_||_|  \__,_|_| |_| |_|\___|
+
+Per-topic traffic statistics, as seen by the broker: message and byte
+counters, rolling rates over the last 1, 10 and 60 seconds, and message size
+histograms. Statistics are exported as JSON or in the Prometheus text format.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef TRAFFIC_HPP
+#define TRAFFIC_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Traffic counters of a single topic.
+ *
+ * Rates are computed over complete seconds, from a ring of one-second
+ * buckets; sizes are binned in powers of two, from 16 bytes to 16 MiB.
+ */
+class TopicTraffic {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr size_t window = 61; // 60 complete seconds + the current
+  static constexpr size_t min_bin = 4; // First bin: up to 2^4 bytes
+  static constexpr size_t bins = 21;   // Last bin: over 2^23 bytes
+  static constexpr std::array<size_t, 3> rate_windows{1, 10, 60};
+
+  /**
+   * @brief Counts a message.
+   *
+   * @param bytes The payload size.
+   * @param now The current time.
+   */
+  void add(size_t bytes, clock::time_point now) {
+    advance(now);
+    messages++;
+    this->bytes += bytes;
+    size_t s = slot(second(now));
+    _msg_ring[s]++;
+    _byte_ring[s] += bytes;
+    _histogram[bin(bytes)]++;
+    if (bytes > max_size)
+      max_size = bytes;
+  }
+
+  /**
+   * @brief Messages per second over the last seconds (complete seconds).
+   */
+  double rate(size_t seconds, clock::time_point now) {
+    return sum(_msg_ring, seconds, now) / (double)seconds;
+  }
+
+  /**
+   * @brief Bytes per second over the last seconds (complete seconds).
+   */
+  double byte_rate(size_t seconds, clock::time_point now) {
+    return sum(_byte_ring, seconds, now) / (double)seconds;
+  }
+
+  /**
+   * @brief Upper bound (bytes) of a histogram bin; the last bin is open.
+   */
+  static size_t bin_limit(size_t i) { return size_t(1) << (i + min_bin); }
+
+  const std::array<uint64_t, bins> &histogram() const { return _histogram; }
+
+  nlohmann::json json(clock::time_point now) {
+    nlohmann::json j{{"messages", messages},
+                     {"bytes", bytes},
+                     {"max_size", max_size}};
+    for (auto w : rate_windows) {
+      j["rate_" + std::to_string(w) + "s"] = rate(w, now);
+      j["byte_rate_" + std::to_string(w) + "s"] = byte_rate(w, now);
+    }
+    nlohmann::json h = nlohmann::json::object();
+    for (size_t i = 0; i < bins; i++) {
+      if (_histogram[i] > 0)
+        h[i + 1 < bins ? std::to_string(bin_limit(i)) : "+Inf"] =
+            _histogram[i];
+    }
+    j["size_histogram"] = h;
+    return j;
+  }
+
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  size_t max_size = 0;
+
+private:
+  static int64_t second(clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               t.time_since_epoch())
+        .count();
+  }
+
+  static size_t slot(int64_t second) {
+    return (size_t)(((second % (int64_t)window) + window) % window);
+  }
+
+  static size_t bin(size_t bytes) {
+    size_t b = bytes <= 1 ? 0 : std::bit_width(bytes - 1);
+    return std::clamp<size_t>(b, min_bin, min_bin + bins - 1) - min_bin;
+  }
+
+  // Clears the buckets of the seconds elapsed since the last update
+  void advance(clock::time_point now) {
+    int64_t s = second(now);
+    if (_last < 0 || s - _last >= (int64_t)window) {
+      _msg_ring.fill(0);
+      _byte_ring.fill(0);
+    } else {
+      for (int64_t i = _last + 1; i <= s; i++) {
+        _msg_ring[slot(i)] = 0;
+        _byte_ring[slot(i)] = 0;
+      }
+    }
+    _last = std::max(_last, s);
+  }
+
+  double sum(const std::array<uint64_t, window> &ring, size_t seconds,
+             clock::time_point now) {
+    advance(now);
+    int64_t s = second(now);
+    uint64_t total = 0;
+    for (size_t i = 1; i <= std::min(seconds, window - 1); i++)
+      total += ring[slot(s - (int64_t)i)];
+    return (double)total;
+  }
+
+  std::array<uint64_t, window> _msg_ring{}, _byte_ring{};
+  std::array<uint64_t, bins> _histogram{};
+  int64_t _last = -1;
+};
+
+/**
+ * @brief Traffic statistics of all topics. Thread-safe.
+ *
+ * @example
+ * TrafficStats traffic;
+ * traffic.add("sensors", 0, 128); // for each message
+ * cout << traffic.prometheus();
+ */
+class TrafficStats {
+public:
+  using clock = TopicTraffic::clock;
+
+  /**
+   * @brief Counts a message.
+   *
+   * @param topic The topic.
+   * @param shard The broker shard that relayed the message.
+   * @param bytes The payload size.
+   */
+  void add(std::string_view topic, size_t shard, size_t bytes) {
+    auto now = clock::now();
+    std::lock_guard lock(_mtx);
+    auto it = _topics.find(topic);
+    if (it == _topics.end())
+      it = _topics.emplace(std::string(topic), entry{shard, {}}).first;
+    it->second.traffic.add(bytes, now);
+  }
+
+  /**
+   * @brief Removes all the counters.
+   */
+  void reset() {
+    std::lock_guard lock(_mtx);
+    _topics.clear();
+  }
+
+  /**
+   * @brief A summary row of a topic, as returned by top().
+   */
+  struct row {
+    std::string topic;
+    size_t shard;
+    uint64_t messages, bytes;
+    double rate, byte_rate; // Over the last 10 s
+  };
+
+  /**
+   * @brief The busiest topics, by message rate over the last 10 s.
+   *
+   * @param n The maximum number of rows (0 for all).
+   */
+  std::vector<row> top(size_t n = 0) {
+    auto now = clock::now();
+    std::vector<row> rows;
+    {
+      std::lock_guard lock(_mtx);
+      for (auto &[topic, e] : _topics) {
+        rows.push_back({topic, e.shard, e.traffic.messages, e.traffic.bytes,
+                        e.traffic.rate(10, now), e.traffic.byte_rate(10, now)});
+      }
+    }
+    std::sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+      return a.rate > b.rate || (a.rate == b.rate && a.messages > b.messages);
+    });
+    if (n > 0 && rows.size() > n)
+      rows.resize(n);
+    return rows;
+  }
+
+  /**
+   * @brief All the statistics, one key per topic.
+   */
+  nlohmann::json json() {
+    auto now = clock::now();
+    std::lock_guard lock(_mtx);
+    nlohmann::json j = nlohmann::json::object();
+    for (auto &[topic, e] : _topics) {
+      j[topic] = e.traffic.json(now);
+      j[topic]["shard"] = e.shard;
+    }
+    return j;
+  }
+
+  /**
+   * @brief All the statistics, in the Prometheus text exposition format.
+   */
+  std::string prometheus() {
+    auto now = clock::now();
+    std::lock_guard lock(_mtx);
+    std::ostringstream out;
+    auto header = [&](const char *name, const char *type, const char *help) {
+      out << "# HELP " << name << " " << help << "\n# TYPE " << name << " "
+          << type << "\n";
+    };
+    header("mads_topic_messages_total", "counter",
+           "Messages relayed by the broker");
+    for (auto &[topic, e] : _topics)
+      out << "mads_topic_messages_total" << labels(topic, e.shard) << " "
+          << e.traffic.messages << "\n";
+    header("mads_topic_bytes_total", "counter",
+           "Payload bytes relayed by the broker");
+    for (auto &[topic, e] : _topics)
+      out << "mads_topic_bytes_total" << labels(topic, e.shard) << " "
+          << e.traffic.bytes << "\n";
+    header("mads_topic_message_rate", "gauge",
+           "Messages per second over the window");
+    for (auto &[topic, e] : _topics) {
+      for (auto w : TopicTraffic::rate_windows)
+        out << "mads_topic_message_rate"
+            << labels(topic, e.shard, std::to_string(w) + "s") << " "
+            << e.traffic.rate(w, now) << "\n";
+    }
+    header("mads_topic_byte_rate", "gauge",
+           "Payload bytes per second over the window");
+    for (auto &[topic, e] : _topics) {
+      for (auto w : TopicTraffic::rate_windows)
+        out << "mads_topic_byte_rate"
+            << labels(topic, e.shard, std::to_string(w) + "s") << " "
+            << e.traffic.byte_rate(w, now) << "\n";
+    }
+    header("mads_topic_message_size_bytes", "histogram",
+           "Payload size of the relayed messages");
+    for (auto &[topic, e] : _topics) {
+      std::string l = labels(topic, e.shard);
+      std::string prefix = l.substr(0, l.size() - 1) + ",le=\"";
+      uint64_t cumulative = 0;
+      auto const &h = e.traffic.histogram();
+      for (size_t i = 0; i < TopicTraffic::bins; i++) {
+        cumulative += h[i];
+        out << "mads_topic_message_size_bytes_bucket" << prefix
+            << (i + 1 < TopicTraffic::bins
+                    ? std::to_string(TopicTraffic::bin_limit(i))
+                    : "+Inf")
+            << "\"} " << cumulative << "\n";
+      }
+      out << "mads_topic_message_size_bytes_sum" << l << " "
+          << e.traffic.bytes << "\n";
+      out << "mads_topic_message_size_bytes_count" << l << " "
+          << e.traffic.messages << "\n";
+    }
+    return out.str();
+  }
+
+private:
+  struct entry {
+    size_t shard;
+    TopicTraffic traffic;
+  };
+
+  static std::string labels(std::string_view topic, size_t shard,
+                            std::string window = "") {
+    std::string l = "{topic=\"";
+    for (char c : topic) {
+      if (c == '\\' || c == '"')
+        l += '\\';
+      if (c == '\n')
+        l += "\\n";
+      else
+        l += c;
+    }
+    l += "\",shard=\"" + std::to_string(shard) + "\"";
+    if (!window.empty())
+      l += ",window=\"" + window + "\"";
+    return l + "}";
+  }
+
+  std::mutex _mtx;
+  std::map<std::string, entry, std::less<>> _topics;
+};
+
+} // namespace Mads
+
+#endif // TRAFFIC_HPP
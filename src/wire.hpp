@@ -0,0 +1,200 @@
+/*
+ __        ___             __                            _
+ \ \      / (_)_ __ ___   / _| ___  _ __ _ __ ___   __ _| |_
+  \ \ /\ / /| | '__/ _ \ | |_ / _ \| '__| '_ ` _ \ / _` | __|
+   \ V  V / | | | |  __/ |  _| (_) | |  | | | | | | (_| | |_
+    \_/\_/  |_|_|  \___| |_|  \___/|_|  |_| |_| |_|\__,_|\__|
+
+Encoding of JSON payloads on the wire. Payloads can be sent as JSON text,
+CBOR or MessagePack, optionally compressed (see compression.hpp). Non-JSON or
+compressed payloads start with a 4-byte header: "\0M", the encoding and the
+codec. A flag in the encoding byte marks batches of payloads (see batch.hpp).
+Plain JSON text has no header, so it is still understood by older
+agents; a JSON text never starts with a zero byte, nor does a non-empty snappy
+buffer.
+
+Author(s): Paolo Bosetti
+*/
+
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+
+namespace Mads {
+
+/**
+ * @brief Serialization of JSON payloads.
+ *
+ */
+enum class wire_encoding : uint8_t { json = 0, cbor, msgpack };
+
+/**
+ * @brief Map of wire encodings to strings (as used in the INI file).
+ *
+ */
+static const std::map<wire_encoding, std::string> wire_encoding_map = {
+    {wire_encoding::json, "json"},
+    {wire_encoding::cbor, "cbor"},
+    {wire_encoding::msgpack, "msgpack"},
+};
+
+/**
+ * @brief Parses a wire encoding name.
+ *
+ * @param name One of "json", "cbor", "msgpack".
+ * @return The wire encoding.
+ * @throws std::invalid_argument if the name is unknown.
+ */
+static wire_encoding wire_encoding_from(const std::string &name) {
+  for (auto const &[k, v] : wire_encoding_map) {
+    if (v == name)
+      return k;
+  }
+  throw std::invalid_argument("Unknown wire encoding: " + name);
+}
+
+/**
+ * @brief Compression codec of a payload.
+ *
+ * A dictionary frame is not a payload: it carries a zstd dictionary for the
+ * topic, and it is consumed by the receiving agent.
+ */
+enum class wire_codec : uint8_t {
+  none = 0,
+  snappy,
+  lz4,
+  zstd,
+  dictionary = 0x7F
+};
+
+/**
+ * @brief Map of compression codecs to strings (as used in the INI file).
+ *
+ */
+static const std::map<wire_codec, std::string> wire_codec_map = {
+    {wire_codec::none, "none"},
+    {wire_codec::snappy, "snappy"},
+    {wire_codec::lz4, "lz4"},
+    {wire_codec::zstd, "zstd"},
+};
+
+/**
+ * @brief Parses a compression codec name.
+ *
+ * @param name One of "none", "snappy", "lz4", "zstd".
+ * @return The codec.
+ * @throws std::invalid_argument if the name is unknown.
+ */
+static wire_codec wire_codec_from(const std::string &name) {
+  for (auto const &[k, v] : wire_codec_map) {
+    if (v == name)
+      return k;
+  }
+  throw std::invalid_argument("Unknown compression codec: " + name);
+}
+
+namespace wire {
+
+static constexpr size_t header_size = 4;
+static constexpr uint8_t batch_flag = 0x40; // In the encoding byte
+// Reserved key of the blob metadata, holding the codec of compressed blobs
+static constexpr const char *blob_codec_key = "_mads_codec";
+
+/**
+ * @brief Encoding and codec of a received payload.
+ *
+ * size is the number of header bytes in the frame (0 for headerless
+ * payloads); batch is set if the body is a batch of payloads.
+ */
+struct header {
+  wire_encoding encoding = wire_encoding::json;
+  wire_codec codec = wire_codec::none;
+  size_t size = 0;
+  bool batch = false;
+};
+
+/**
+ * @brief Reads the header of a payload frame.
+ *
+ * @param frame The payload frame.
+ * @return The header (size 0 for headerless JSON text).
+ * @throws std::invalid_argument on unknown encoding or codec.
+ */
+inline header read_header(std::string_view frame) {
+  header h;
+  if (frame.size() < header_size || frame[0] != '\0' || frame[1] != 'M')
+    return h;
+  uint8_t enc = frame[2], codec = frame[3];
+  h.batch = enc & batch_flag;
+  enc &= ~batch_flag;
+  if (enc > (uint8_t)wire_encoding::msgpack)
+    throw std::invalid_argument("Unknown wire encoding: " +
+                                std::to_string(enc));
+  if (codec > (uint8_t)wire_codec::zstd &&
+      codec != (uint8_t)wire_codec::dictionary)
+    throw std::invalid_argument("Unknown wire codec: " +
+                                std::to_string(codec));
+  h.encoding = (wire_encoding)enc;
+  h.codec = (wire_codec)codec;
+  h.size = header_size;
+  return h;
+}
+
+/**
+ * @brief Appends a header to out.
+ *
+ */
+inline void write_header(std::string &out, wire_encoding encoding,
+                         wire_codec codec, bool batch = false) {
+  out.push_back('\0');
+  out.push_back('M');
+  out.push_back((char)((uint8_t)encoding | (batch ? batch_flag : 0)));
+  out.push_back((char)codec);
+}
+
+/**
+ * @brief Serializes a JSON object, appending to out.
+ *
+ */
+inline void encode(const nlohmann::json &j, wire_encoding encoding,
+                   std::string &out) {
+  switch (encoding) {
+  case wire_encoding::json:
+    out += j.dump();
+    break;
+  case wire_encoding::cbor:
+    nlohmann::json::to_cbor(j, out);
+    break;
+  case wire_encoding::msgpack:
+    nlohmann::json::to_msgpack(j, out);
+    break;
+  }
+}
+
+/**
+ * @brief Deserializes a (decompressed) payload body.
+ *
+ * @throws nlohmann::json::parse_error on malformed data.
+ */
+inline nlohmann::json decode(std::string_view body, wire_encoding encoding) {
+  switch (encoding) {
+  case wire_encoding::cbor:
+    return nlohmann::json::from_cbor(body.begin(), body.end());
+  case wire_encoding::msgpack:
+    return nlohmann::json::from_msgpack(body.begin(), body.end());
+  default:
+    return nlohmann::json::parse(body);
+  }
+}
+
+} // namespace wire
+
+} // namespace Mads
+
+#endif // WIRE_HPP
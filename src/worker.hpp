@@ -37,11 +37,37 @@ public:
   }
 
   json pull() {
-    string payload;
     message msg;
-    json j;
-
     _receiver.receive(msg);
+    return parse(msg);
+  }
+
+  /**
+   * @brief Calls handler for each message pulled from the dealer, when run()
+   * is used in place of loop().
+   *
+   * @param handler Called with the parsed payload (with an "error" key if it
+   * is not valid JSON).
+   */
+  void on_pull(std::function<void(json &)> handler) {
+    reactor().add(_receiver, [this, handler = std::move(handler)]() {
+      message msg;
+      // Bounded, so that a busy dealer does not starve other sources
+      for (int i = 0; i < 1000 && Mads::running; i++) {
+        if (!_receiver.receive(msg, true))
+          break;
+        json j = parse(msg);
+        if (!j.empty())
+          handler(j);
+      }
+    });
+  }
+
+
+private: 
+  json parse(message &msg) {
+    string payload;
+    json j;
     if (msg.parts() == 0) return j;
       
     msg >> payload;
@@ -54,8 +80,6 @@ public:
     return j;
   }
 
-
-private: 
   void load_settings() override {
     auto cfg = _config[_name];
     _dealer_address = cfg["dealer_address"].value_or("tcp://localhost:9093");
@@ -0,0 +1,89 @@
+// Tests of Batcher: size and latency bounds, split and decode of the batch
+// records
+#undef NDEBUG
+#include "src/batch.hpp"
+#include "src/wire.hpp"
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+using namespace Mads;
+
+struct batch {
+  string topic, body;
+  size_t count;
+};
+
+int main() {
+  mutex mtx;
+  vector<batch> batches;
+  Batcher batcher;
+  batcher.set_policy("fast", BatchPolicy{256, chrono::seconds(10)});
+  assert(batcher.active());
+  batcher.start([&](const string &topic, string &&body, size_t count) {
+    lock_guard lock(mtx);
+    batches.push_back({topic, std::move(body), count});
+  });
+
+  // Topics without a policy are not batched
+  assert(!batcher.add("slow", "{}"));
+
+  // Payloads are batched until the size bound is reached
+  vector<nlohmann::json> sent;
+  size_t bytes = 0;
+  for (int i = 0; bytes < 256; i++) {
+    nlohmann::json j = {{"i", i}, {"data", string(20, 'x')}};
+    string body;
+    wire::encode(j, wire_encoding::cbor, body);
+    bytes += Batcher::record_header + body.size();
+    assert(batcher.add("fast", body));
+    sent.push_back(j);
+  }
+  {
+    lock_guard lock(mtx);
+    assert(batches.size() == 1);
+    assert(batches[0].topic == "fast");
+    assert(batches[0].count == sent.size());
+  }
+  vector<string_view> records;
+  Batcher::split(batches[0].body, records);
+  assert(records.size() == sent.size());
+  for (size_t i = 0; i < records.size(); i++)
+    assert(wire::decode(records[i], wire_encoding::cbor) == sent[i]);
+
+  // A single payload is flushed by the latency bound, without framing
+  batcher.set_policy("fast", BatchPolicy{256, chrono::milliseconds(20)});
+  assert(batcher.add("fast", "{\"single\":true}"));
+  this_thread::sleep_for(chrono::milliseconds(200));
+  {
+    lock_guard lock(mtx);
+    assert(batches.size() == 2);
+    assert(batches[1].count == 1);
+    assert(batches[1].body == "{\"single\":true}");
+  }
+
+  // stop() sends what is pending
+  assert(batcher.add("fast", "a"));
+  assert(batcher.add("fast", "b"));
+  batcher.stop();
+  assert(batches.size() == 3);
+  Batcher::split(batches[2].body, records);
+  assert(records.size() == 2 && records[0] == "a" && records[1] == "b");
+  assert(!batcher.add("fast", "c"));
+  assert(batcher.stats()["fast"]["batches"] == 3);
+
+  // Truncated batches are rejected
+  string truncated;
+  Batcher::append_record(truncated, "payload");
+  truncated.pop_back();
+  bool thrown = false;
+  try {
+    Batcher::split(truncated, records);
+  } catch (const runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  cout << "Batch tests passed" << endl;
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Tests of federation: envelope encode/decode, export and import of
+// messages, loops and hop limit
+#undef NDEBUG
+#include "src/federation.hpp"
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+using namespace Mads;
+
+struct sent {
+  string topic, envelope, body;
+};
+
+static void test_envelope() {
+  uint32_t count = 0;
+  auto e = federation::write_envelope(0x01020304);
+  assert(e.size() == federation::envelope_size);
+  assert(federation::read_envelope(e, count) && count == 0x01020304);
+  // Payloads from a plain backend are not envelopes
+  assert(!federation::read_envelope("{\"a\":1}", count));
+  assert(!federation::read_envelope(e.substr(1), count));
+  e[3] = 2;
+  bool thrown = false;
+  try {
+    federation::read_envelope(e, count);
+  } catch (const invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+static void test_subscriptions() {
+  FederationSettings settings;
+  FederationLedger ledger;
+  FederationExporter exporter(settings, ledger, [](auto &&...) {});
+  exporter.subscription(string("\x01" "sensors", 8));
+  exporter.subscription(string("\x01" "sensors", 8));
+  assert(exporter.wanted("sensors/temp") && !exporter.wanted("logs"));
+  exporter.subscription(string("\0sensors", 8));
+  assert(exporter.wanted("sensors/temp"));
+  exporter.subscription(string("\0sensors", 8));
+  assert(!exporter.wanted("sensors/temp"));
+  assert(exporter.subscriptions() == 0);
+}
+
+// Messages exported by broker a, with the given hops and origin, imported
+// by broker b
+static void test_hops() {
+  FederationSettings a, b;
+  a.name = "a";
+  a.batch = {0, chrono::milliseconds(2)};
+  b.name = "b";
+  b.max_hops = 4;
+  FederationLedger ledger_a, ledger_b;
+  vector<sent> out;
+  FederationExporter exporter(a, ledger_a,
+                              [&](const string &topic, string &&envelope,
+                                  string &&body) {
+                                out.push_back({topic, envelope, body});
+                              });
+  FederationImporter importer(b, {"a", "tcp://a:9093", {}}, &ledger_b);
+  vector<pair<string, vector<string>>> forwarded;
+  auto forward = [&](string_view topic, auto const &frames) {
+    forwarded.emplace_back(string(topic),
+                           vector<string>(frames.begin(), frames.end()));
+  };
+  auto import = [&](const sent &s) {
+    return importer.unpack(s.topic, {s.envelope, s.body}, forward);
+  };
+
+  // Local message: origin a, one hop when imported
+  vector<string_view> frames{"{\"v\":1}"};
+  exporter.add("t", frames);
+  assert(out.size() == 1 && out[0].topic == "t");
+  assert(import(out[0]));
+  assert(forwarded.size() == 1 && forwarded[0].second[0] == "{\"v\":1}");
+  string origin;
+  uint8_t hops = 0;
+  assert(ledger_b.take(federation::fingerprint("t", frames), origin, hops));
+  assert(origin == "a" && hops == 1);
+
+  // Message injected into a by a link: sent on with its origin and hops
+  auto relay = [&](string_view from, uint8_t h) {
+    ledger_a.add(federation::fingerprint("t", frames), from, h);
+    exporter.add("t", frames);
+    return import(out.back());
+  };
+  assert(relay("c", 3));
+  assert(forwarded.size() == 2);
+  assert(ledger_b.take(federation::fingerprint("t", frames), origin, hops));
+  assert(origin == "c" && hops == 4);
+  // Over max_hops, and with no wrap past 255
+  assert(relay("c", 4) && relay("c", 255));
+  assert(forwarded.size() == 2 && importer.stats().expired == 2);
+  // Back to its origin
+  assert(relay("b", 1));
+  assert(forwarded.size() == 2 && importer.stats().looped == 1);
+
+  // From a plain backend: forwarded as it is, with the link as origin
+  assert(!importer.unpack("t", frames, forward));
+  assert(ledger_b.take(federation::fingerprint("t", frames), origin, hops));
+  assert(origin == "a" && hops == 1);
+
+  // Undecodable
+  auto bad = out[0];
+  bad.envelope = federation::write_envelope(2);
+  assert(import(bad));
+  assert(importer.stats().invalid == 1 && forwarded.size() == 2);
+}
+
+// Batched and compressed: one envelope for the messages of a topic
+static void test_batch() {
+  FederationSettings a, b;
+  a.name = "a";
+  a.batch = {4096, chrono::seconds(10)};
+  a.codec = wire_codec::zstd;
+  b.name = "b";
+  FederationLedger ledger;
+  vector<sent> out;
+  FederationExporter exporter(a, ledger,
+                              [&](const string &topic, string &&envelope,
+                                  string &&body) {
+                                out.push_back({topic, envelope, body});
+                              });
+  for (int i = 0; i < 10; i++) {
+    string payload = "{\"i\":" + to_string(i) + "}";
+    exporter.add("t", {payload, "blob"});
+  }
+  assert(out.empty());
+  exporter.flush();
+  assert(out.size() == 1);
+  uint32_t count = 0;
+  assert(federation::read_envelope(out[0].envelope, count) && count == 10);
+  assert(wire::read_header(out[0].body).codec == wire_codec::zstd);
+
+  FederationImporter importer(b, {"a", "tcp://a:9093", {}}, nullptr);
+  int i = 0;
+  assert(importer.unpack("t", {out[0].envelope, out[0].body},
+                         [&](string_view topic, auto const &frames) {
+                           assert(topic == "t" && frames.size() == 2);
+                           assert(frames[0] ==
+                                  "{\"i\":" + to_string(i++) + "}");
+                           assert(frames[1] == "blob");
+                         }));
+  assert(i == 10 && importer.stats().messages == 10);
+}
+
+int main() {
+  test_envelope();
+  test_subscriptions();
+  test_hops();
+  test_batch();
+  cout << "Federation tests passed" << endl;
+  return 0;
+}
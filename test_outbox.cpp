@@ -0,0 +1,168 @@
+// Tests of MPSCQueue and Outbox: ordering, full queue, paired and delayed
+// messages, pushes with no I/O thread
+#undef NDEBUG
+#include "src/outbox.hpp"
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+using namespace Mads;
+
+static void test_queue() {
+  MPSCQueue<int> q(3);
+  assert(q.capacity() == 4);
+  for (int i = 0; i < 4; i++)
+    assert(q.try_push(i));
+  int item = 42;
+  assert(!q.try_push(item)); // Full, item untouched
+  assert(item == 42);
+  for (int i = 0; i < 4; i++) {
+    assert(q.try_pop(item));
+    assert(item == i);
+  }
+  assert(!q.try_pop(item));
+}
+
+// Items of each producer come out in the order they were pushed
+static void test_queue_producers() {
+  const int producers = 4, n = 20000;
+  MPSCQueue<pair<int, int>> q(64);
+  vector<thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < n; i++) {
+        pair<int, int> item{p, i};
+        while (!q.try_push(item))
+          this_thread::yield();
+      }
+    });
+  }
+  vector<int> next(producers, 0);
+  pair<int, int> item;
+  for (int received = 0; received < producers * n;) {
+    if (!q.try_pop(item)) {
+      this_thread::yield();
+      continue;
+    }
+    assert(item.second == next[item.first]);
+    next[item.first]++;
+    received++;
+  }
+  for (auto &t : threads)
+    t.join();
+}
+
+static zmqpp::message make(const string &topic, const string &body) {
+  zmqpp::message msg;
+  msg << topic << body;
+  return msg;
+}
+
+static void test_outbox() {
+  zmqpp::context context;
+  zmqpp::socket push(context, zmqpp::socket_type::push);
+  zmqpp::socket pull(context, zmqpp::socket_type::pull);
+  push.bind("inproc://test-outbox");
+  pull.connect("inproc://test-outbox");
+  pull.set(zmqpp::socket_option::receive_timeout, 1000);
+
+  auto expect = [&](const vector<string> &expected) {
+    for (auto const &e : expected) {
+      zmqpp::message msg;
+      assert(pull.receive(msg));
+      assert(msg.get(1) == e);
+    }
+  };
+
+  // With no I/O thread, before start() and after stop(), messages are
+  // dropped and counted rather than left in the queue
+  {
+    Outbox outbox(4, queue_policy::block);
+    auto early = make("t", "early");
+    assert(!outbox.push(early));
+    outbox.start(push);
+    outbox.stop();
+    auto late = make("t", "late"), dict = make("t", "dict"),
+         payload = make("t", "payload");
+    assert(!outbox.push(late));
+    assert(!outbox.push(dict, payload));
+    auto stats = outbox.stats();
+    assert(stats["dropped"] == 4 && stats["sent"] == 0);
+  }
+
+  // Full queue, while the I/O thread is held sending the first message:
+  // dropped with the drop policy, waiting for room with the block one
+  for (auto policy : {queue_policy::drop, queue_policy::block}) {
+    Outbox outbox(2, policy);
+    atomic<bool> hold = true;
+    atomic<int> routed = 0;
+    outbox.start({&push}, [&](const zmqpp::message &) {
+      if (routed++ == 0)
+        while (hold)
+          this_thread::yield();
+      return size_t(0);
+    });
+    auto m0 = make("t", "0"), m1 = make("t", "1"), m2 = make("t", "2");
+    assert(outbox.push(m0));
+    while (routed == 0)
+      this_thread::yield();
+    assert(outbox.push(m1));
+    assert(outbox.push(m2));
+    atomic<bool> done = false;
+    thread producer([&]() {
+      auto m3 = make("t", "3");
+      bool queued = outbox.push(m3);
+      assert(queued == (policy == queue_policy::block));
+      done = true;
+    });
+    if (policy == queue_policy::block) {
+      this_thread::sleep_for(chrono::milliseconds(50));
+      assert(!done);
+    } else {
+      producer.join();
+      assert(outbox.stats()["dropped"] == 1);
+    }
+    hold = false;
+    if (producer.joinable())
+      producer.join();
+    outbox.stop();
+    if (policy == queue_policy::block)
+      expect({"0", "1", "2", "3"});
+    else
+      expect({"0", "1", "2"});
+  }
+
+  Outbox outbox(4, queue_policy::block);
+  outbox.start(push);
+  // Delayed messages are sent on stop(), at the latest
+  auto delayed = make("t", "delayed");
+  assert(outbox.push(delayed, chrono::seconds(10)));
+  auto first = make("t", "first");
+  assert(outbox.push(first));
+  // A pair is sent back-to-back; a full queue blocks until there is room
+  auto dict = make("t", "dict"), payload = make("t", "payload");
+  assert(outbox.push(dict, payload));
+  for (int i = 0; i < 20; i++) {
+    auto msg = make("t", to_string(i));
+    assert(outbox.push(msg));
+  }
+  outbox.stop();
+  vector<string> expected{"first", "dict", "payload"};
+  for (int i = 0; i < 20; i++)
+    expected.push_back(to_string(i));
+  expected.push_back("delayed");
+  expect(expected);
+  auto stats = outbox.stats();
+  assert(stats["sent"] == expected.size());
+  assert(stats["dropped"] == 0);
+  push.close();
+  pull.close();
+}
+
+int main() {
+  test_queue();
+  test_queue_producers();
+  test_outbox();
+  cout << "Outbox tests passed" << endl;
+  return 0;
+}
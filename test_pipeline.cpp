@@ -0,0 +1,82 @@
+// Tests of SPSCQueue and PipelineStage: ordering, full queue and back
+// pressure, stop
+#undef NDEBUG
+#include "src/pipeline.hpp"
+#include <cassert>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace Mads;
+
+static void test_queue() {
+  assert(SPSCQueue<int>(1).capacity() == 2);
+  SPSCQueue<int> q(3);
+  assert(q.capacity() == 4);
+  for (int i = 0; i < 4; i++)
+    assert(q.try_push(i));
+  int item = 42;
+  assert(!q.try_push(item)); // Full, item untouched
+  assert(item == 42 && q.size() == 4);
+  for (int i = 0; i < 4; i++) {
+    assert(q.try_pop(item));
+    assert(item == i);
+  }
+  assert(!q.try_pop(item) && q.size() == 0);
+}
+
+static void test_queue_threads() {
+  const int n = 100000;
+  SPSCQueue<int> q(64);
+  thread producer([&]() {
+    for (int i = 0; i < n; i++) {
+      int item = i;
+      while (!q.try_push(item))
+        this_thread::yield();
+    }
+  });
+  int item;
+  for (int i = 0; i < n;) {
+    if (!q.try_pop(item)) {
+      this_thread::yield();
+      continue;
+    }
+    assert(item == i++);
+  }
+  producer.join();
+}
+
+// A slow stage pushes back on its producer, which is charged the wait
+static void test_stage() {
+  vector<int> out;
+  PipelineStage<int> stage("slow", 4, [&](int &item) {
+    this_thread::sleep_for(chrono::microseconds(200));
+    out.push_back(item);
+  });
+  StageMeter producer("fast");
+  for (int i = 0; i < 200; i++) {
+    producer.begin();
+    int item = i;
+    assert(stage.push(item, &producer));
+    producer.end();
+  }
+  stage.stop(); // Runs what is queued
+  int item = 200;
+  assert(!stage.push(item));
+  assert(out.size() == 200);
+  for (int i = 0; i < 200; i++)
+    assert(out[i] == i);
+  auto j = stage.json();
+  assert(j["items"] == 200 && j["queue"]["capacity"] == 4);
+  assert(j["queue"]["full"] > 0 && j["queue"]["high_water"] <= 4);
+  assert(producer.json()["blocked_s"] > 0.0);
+  assert(producer.json()["items"] == 200);
+}
+
+int main() {
+  test_queue();
+  test_queue_threads();
+  test_stage();
+  cout << "Pipeline tests passed" << endl;
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Tests of WorkerPool: ordered and unordered output, with dropped jobs and
+// throwing workers
+#undef NDEBUG
+#include "src/plugin_pool.hpp"
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+using namespace Mads;
+
+static void test_pool(bool ordered) {
+  const int n = 2000;
+  vector<int> out;
+  atomic<int> inside = 0;
+  WorkerPool<int> pool(
+      4, 8, ordered,
+      [](size_t, int &job) {
+        if (job % 7 == 0)
+          throw runtime_error("worker error");
+        return job % 5 != 0; // Dropped
+      },
+      [&](int &job) {
+        // Never run concurrently
+        assert(inside.fetch_add(1) == 0);
+        out.push_back(job);
+        inside--;
+      });
+  for (int i = 1; i <= n; i++)
+    assert(pool.submit(std::move(i), pool.next()));
+  pool.stop();
+  assert(!pool.submit(1, 0));
+
+  vector<int> expected;
+  for (int i = 1; i <= n; i++) {
+    if (i % 7 && i % 5)
+      expected.push_back(i);
+  }
+  if (!ordered)
+    sort(out.begin(), out.end());
+  assert(out == expected);
+  assert(pool.completed() == n && pool.errors() == n / 7);
+  auto stats = pool.stats();
+  assert(stats["errors"] == n / 7);
+  if (ordered)
+    assert(stats["reorder_high_water"] <= 4 * 8 + 4);
+}
+
+static void test_dispatch() {
+  WorkerPool<int> pool(3, 4, false, [](size_t, int &) { return false; },
+                       [](int &) {});
+  assert(pool.next() == 0 && pool.next() == 1 && pool.next() == 2 &&
+         pool.next() == 0);
+  nlohmann::json key = {{"id", 42}};
+  assert(pool.worker_for(key) == pool.worker_for(nlohmann::json{{"id", 42}}));
+  assert(pool.worker_for(key) < pool.size());
+
+  assert(plugin_concurrency_of({}) == plugin_concurrency::serial);
+  assert(plugin_concurrency_of({{"concurrency", "keyed"}}) ==
+         plugin_concurrency::keyed);
+  assert(plugin_concurrency_of({{"concurrency", "other"}}) ==
+         plugin_concurrency::serial);
+}
+
+int main() {
+  test_pool(true);
+  test_pool(false);
+  test_dispatch();
+  cout << "Plugin pool tests passed" << endl;
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Tests of Reactor timers and wake-ups, and of Scheduler overrun accounting
+#undef NDEBUG
+#include "src/reactor.hpp"
+#include "src/scheduler.hpp"
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+using namespace Mads;
+
+static void test_timers() {
+  Reactor reactor;
+  int ticks = 0, once = 0, cancelled = 0;
+  bool running = true;
+  reactor.add_timer(10ms, [&]() { ticks++; });
+  reactor.add_timer(25ms, [&]() { once++; }, false);
+  auto id = reactor.add_timer(20ms, [&]() { cancelled++; });
+  reactor.cancel(id);
+  reactor.add_timer(105ms, [&]() { running = false; }, false);
+  auto t0 = steady_clock::now();
+  reactor.run(running);
+  auto elapsed = steady_clock::now() - t0;
+  assert(elapsed >= 105ms && elapsed < 1s);
+  assert(ticks >= 5 && ticks <= 10);
+  assert(once == 1 && cancelled == 0);
+
+  // A one-shot timer may have period 0, a repeating one may not
+  int zero = 0;
+  reactor.add_timer(0ms, [&]() { zero++; }, false);
+  assert(reactor.run_once(0ms) == 1 && zero == 1);
+  assert(reactor.run_once(0ms) == 0);
+  bool thrown = false;
+  try {
+    reactor.add_timer(0ms, []() {});
+  } catch (const invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// With no timers nor sources, the reactor waits with no timeout, until
+// woken from another thread
+static void test_wake() {
+  Reactor reactor;
+  thread waker([&]() {
+    this_thread::sleep_for(50ms);
+    reactor.wake();
+  });
+  auto t0 = steady_clock::now();
+  assert(reactor.run_once(-1ms) == 0);
+  auto elapsed = steady_clock::now() - t0;
+  assert(elapsed >= 40ms && elapsed < 1s);
+  waker.join();
+}
+
+static void test_scheduler() {
+  // Skip: the late tick and the missed ones are dropped, and the next
+  // deadline stays in phase
+  Scheduler skip(10ms, overrun_policy::skip);
+  skip.start();
+  auto t0 = steady_clock::now();
+  this_thread::sleep_for(35ms);
+  skip.wait();
+  auto s = skip.stats();
+  assert(s.overruns == 1 && s.skipped >= 3);
+  assert(steady_clock::now() - t0 >= 10ms * (s.skipped + 1));
+  skip.wait();
+  assert(skip.stats().overruns == 1 && skip.stats().iterations == 2);
+
+  // Burst: the missed ticks run back-to-back, each one counted as overrun
+  Scheduler burst(10ms, overrun_policy::burst);
+  burst.start();
+  this_thread::sleep_for(35ms);
+  for (int i = 0; i < 4; i++)
+    burst.wait();
+  assert(burst.stats().overruns >= 3 && burst.stats().skipped == 0);
+
+  // Shift: the period restarts from the late tick
+  Scheduler shift(10ms, overrun_policy::shift);
+  shift.start();
+  this_thread::sleep_for(35ms);
+  shift.wait();
+  t0 = steady_clock::now();
+  shift.wait();
+  assert(steady_clock::now() - t0 >= 9ms);
+  assert(shift.stats().overruns == 1 && shift.stats().skipped == 0);
+}
+
+int main() {
+  test_timers();
+  test_wake();
+  test_scheduler();
+  cout << "Reactor and scheduler tests passed" << endl;
+  return 0;
+}
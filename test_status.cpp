@@ -0,0 +1,107 @@
+// Tests of TopicStore: versions, snapshots, TTL and eviction bounds
+#undef NDEBUG
+#include "src/status.hpp"
+#include <cassert>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+using namespace Mads;
+
+struct value {
+  value(string s) : data(std::move(s)) {}
+  size_t footprint() const { return data.size(); }
+  string data;
+};
+
+static void test_versions() {
+  TopicStore<value> store;
+  size_t changes = 0;
+  store.on_change([&](string_view, auto const &) { changes++; });
+  store.emplace("a", "1");
+  store.emplace("b", "2");
+  auto rec = store.emplace("a", "3");
+  assert(rec->seq == 2 && rec->version == 3);
+  assert(store.get("a")->value.data == "3");
+  assert(!store.get("c"));
+  assert(store.size() == 2 && store.version() == 3 && changes == 3);
+  auto snap = store.snapshot(2);
+  assert(snap.entries.size() == 1 && snap.entries[0].first == "a");
+  assert(store.snapshot().entries.size() == 2);
+}
+
+static void test_eviction() {
+  // Least recently updated topics go first
+  TopicStore<value> store;
+  store.set_bounds({2, 0, chrono::milliseconds(0)});
+  store.emplace("a", "1");
+  store.emplace("b", "2");
+  store.emplace("a", "3");
+  store.emplace("c", "4");
+  assert(store.size() == 2);
+  assert(store.get("a") && !store.get("b") && store.get("c"));
+  assert(store.stats()["evicted"] == 1);
+
+  // Byte bound: the topic just updated is kept, even if alone over it
+  TopicStore<value> bytes;
+  size_t rec = sizeof(TopicStore<value>::record);
+  bytes.set_bounds({0, 2 * (rec + 10), chrono::milliseconds(0)});
+  bytes.emplace("a", string(10, 'x'));
+  bytes.emplace("b", string(10, 'x'));
+  assert(bytes.size() == 2);
+  bytes.emplace("c", string(10, 'x'));
+  assert(bytes.size() == 2 && !bytes.get("a"));
+  bytes.emplace("d", string(1000, 'x'));
+  assert(bytes.size() == 1 && bytes.get("d"));
+
+  // Tighter bounds apply at once
+  store.set_bounds({1, 0, chrono::milliseconds(0)});
+  assert(store.size() == 1 && store.get("c"));
+}
+
+static void test_ttl() {
+  TopicStore<value> store;
+  store.set_bounds({0, 0, chrono::milliseconds(50)});
+  store.emplace("a", "1");
+  store.emplace("b", "2");
+  this_thread::sleep_for(chrono::milliseconds(100));
+  // An update evicts the expired topics, but not itself
+  store.emplace("b", "3");
+  assert(store.size() == 1 && store.get("b"));
+  // With no updates, expire() does
+  this_thread::sleep_for(chrono::milliseconds(100));
+  store.expire();
+  assert(store.size() == 0 && store.bytes() == 0);
+  assert(store.stats()["evicted"] == 2);
+}
+
+// Readers get consistent snapshots while the writer updates and evicts
+static void test_readers() {
+  TopicStore<value> store;
+  store.set_bounds({8, 0, chrono::milliseconds(0)});
+  atomic<bool> done = false;
+  thread reader([&]() {
+    while (!done) {
+      auto snap = store.snapshot();
+      assert(snap.entries.size() <= 8);
+      for (auto const &[topic, rec] : snap.entries)
+        assert(rec->value.data == topic);
+    }
+  });
+  for (int i = 0; i < 20000; i++) {
+    string topic = to_string(i % 32);
+    store.emplace(topic, topic);
+  }
+  done = true;
+  reader.join();
+  assert(store.size() == 8);
+}
+
+int main() {
+  test_versions();
+  test_eviction();
+  test_ttl();
+  test_readers();
+  cout << "Status store tests passed" << endl;
+  return 0;
+}